@@ -26,6 +26,23 @@ else
   LIBUSB_MODULE := libusb1.0
 endif
 
+# dma_benchmark
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+  $(LIBUSB_ROOT_REL)/examples/dma_benchmark.c
+
+LOCAL_C_INCLUDES += \
+  $(LOCAL_PATH)/.. \
+  $(LIBUSB_ROOT_ABS)
+
+LOCAL_SHARED_LIBRARIES += $(LIBUSB_MODULE)
+
+LOCAL_MODULE := dma_benchmark
+
+include $(BUILD_EXECUTABLE)
+
 # dpfp
 
 include $(CLEAR_VARS)
@@ -97,6 +114,23 @@ LOCAL_MODULE := hotplugtest
 
 include $(BUILD_EXECUTABLE)
 
+# iso_ring_benchmark
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+  $(LIBUSB_ROOT_REL)/examples/iso_ring_benchmark.c
+
+LOCAL_C_INCLUDES += \
+  $(LOCAL_PATH)/.. \
+  $(LIBUSB_ROOT_ABS)
+
+LOCAL_SHARED_LIBRARIES += $(LIBUSB_MODULE)
+
+LOCAL_MODULE := iso_ring_benchmark
+
+include $(BUILD_EXECUTABLE)
+
 # listdevs
 
 include $(CLEAR_VARS)
@@ -131,6 +165,25 @@ LOCAL_MODULE := sam3u_benchmark
 
 include $(BUILD_EXECUTABLE)
 
+# submit_mt_benchmark
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+  $(LIBUSB_ROOT_REL)/examples/submit_mt_benchmark.c
+
+LOCAL_C_INCLUDES += \
+  $(LOCAL_PATH)/.. \
+  $(LIBUSB_ROOT_ABS)
+
+LOCAL_CFLAGS := -pthread
+
+LOCAL_SHARED_LIBRARIES += $(LIBUSB_MODULE)
+
+LOCAL_MODULE := submit_mt_benchmark
+
+include $(BUILD_EXECUTABLE)
+
 # xusb
 
 include $(CLEAR_VARS)
@@ -29,6 +29,9 @@ LOCAL_SRC_FILES := \
   $(LIBUSB_ROOT_REL)/libusb/descriptor.c \
   $(LIBUSB_ROOT_REL)/libusb/hotplug.c \
   $(LIBUSB_ROOT_REL)/libusb/io.c \
+  $(LIBUSB_ROOT_REL)/libusb/iso_ring.c \
+  $(LIBUSB_ROOT_REL)/libusb/stream.c \
+  $(LIBUSB_ROOT_REL)/libusb/stream_manager.c \
   $(LIBUSB_ROOT_REL)/libusb/sync.c \
   $(LIBUSB_ROOT_REL)/libusb/strerror.c \
   $(LIBUSB_ROOT_REL)/libusb/os/linux_usbfs.c \
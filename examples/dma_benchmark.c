@@ -0,0 +1,226 @@
+/*
+ * libusb example program to compare bulk throughput with heap buffers and
+ * with buffers from a device memory pool
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libusb.h"
+
+#define DEFAULT_TRANSFER_SIZE	(64 * 1024)
+#define DEFAULT_DEPTH		8
+#define DEFAULT_MEGABYTES	1024
+
+static struct libusb_device_handle *devh = NULL;
+
+static unsigned long long bytes_left, bytes_done;
+static int in_flight;
+static int failed;
+
+static double wall_seconds(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
+{
+	in_flight--;
+
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "transfer status %s\n", libusb_error_name(xfr->status));
+		failed = 1;
+		return;
+	}
+
+	bytes_done += (unsigned long long)xfr->actual_length;
+	if (bytes_left < (unsigned long long)xfr->length)
+		return;
+	bytes_left -= (unsigned long long)xfr->length;
+
+	if (libusb_submit_transfer(xfr) < 0) {
+		fprintf(stderr, "error re-submitting transfer\n");
+		failed = 1;
+		return;
+	}
+	in_flight++;
+}
+
+/* Stream megabytes of data through endpoint ep with depth transfers of
+ * transfer_size bytes in flight, using buffers from pool if given and from
+ * the heap otherwise. */
+static int run(const char *name, unsigned char ep, int transfer_size,
+	int depth, unsigned long megabytes, libusb_buffer_pool *pool)
+{
+	struct libusb_transfer **xfrs;
+	unsigned char **bufs;
+	double wall, cpu, gigabytes;
+	clock_t cpu_start;
+	int num_dev_mem = 0;
+	int i, r = 0;
+
+	xfrs = calloc((size_t)depth, sizeof(*xfrs));
+	bufs = calloc((size_t)depth, sizeof(*bufs));
+	if (!xfrs || !bufs) {
+		free(xfrs);
+		free(bufs);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < depth; i++) {
+		xfrs[i] = libusb_alloc_transfer(0);
+		if (pool) {
+			bufs[i] = libusb_buffer_pool_alloc(pool, (size_t)transfer_size);
+			if (bufs[i] && libusb_buffer_pool_is_dev_mem(pool, bufs[i]))
+				num_dev_mem++;
+		} else {
+			bufs[i] = malloc((size_t)transfer_size);
+		}
+		if (!xfrs[i] || !bufs[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		memset(bufs[i], 0x55, (size_t)transfer_size);
+		libusb_fill_bulk_transfer(xfrs[i], devh, ep, bufs[i],
+			transfer_size, cb_xfr, NULL, 0);
+	}
+
+	bytes_left = (unsigned long long)megabytes * 1024 * 1024;
+	bytes_done = 0;
+	in_flight = 0;
+	failed = 0;
+
+	wall = wall_seconds();
+	cpu_start = clock();
+
+	for (i = 0; i < depth && bytes_left >= (unsigned long long)transfer_size; i++) {
+		r = libusb_submit_transfer(xfrs[i]);
+		if (r < 0) {
+			fprintf(stderr, "error submitting transfer: %s\n", libusb_error_name(r));
+			failed = 1;
+			break;
+		}
+		bytes_left -= (unsigned long long)transfer_size;
+		in_flight++;
+	}
+
+	while (in_flight) {
+		r = libusb_handle_events(NULL);
+		if (r != LIBUSB_SUCCESS)
+			break;
+		if (failed)
+			bytes_left = 0;
+	}
+
+	wall = wall_seconds() - wall;
+	cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+	gigabytes = (double)bytes_done / (1024.0 * 1024.0 * 1024.0);
+
+	if (r == LIBUSB_SUCCESS && failed)
+		r = LIBUSB_ERROR_IO;
+
+	printf("%-5s %d/%d buffers in device memory: %.1f MB/s, %.3f CPU seconds per GB\n",
+		name, num_dev_mem, depth,
+		wall > 0 ? (double)bytes_done / (1024.0 * 1024.0) / wall : 0.0,
+		gigabytes > 0 ? cpu / gigabytes : 0.0);
+
+out:
+	for (i = 0; i < depth; i++) {
+		if (pool)
+			libusb_buffer_pool_free(pool, bufs[i]);
+		else
+			free(bufs[i]);
+		libusb_free_transfer(xfrs[i]);
+	}
+	free(bufs);
+	free(xfrs);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_buffer_pool *pool = NULL;
+	unsigned int vid, pid, ep;
+	int interface_number = 0;
+	int transfer_size = DEFAULT_TRANSFER_SIZE;
+	int depth = DEFAULT_DEPTH;
+	unsigned long megabytes = DEFAULT_MEGABYTES;
+	int rc;
+
+	if (argc < 3 || sscanf(argv[1], "%x:%x", &vid, &pid) != 2 ||
+	    sscanf(argv[2], "%x", &ep) != 1) {
+		fprintf(stderr, "usage: %s VID:PID ENDPOINT [INTERFACE] [TRANSFER_SIZE] [DEPTH] [MEGABYTES]\n"
+			"  streams MEGABYTES through the bulk endpoint (hex, e.g. 81),\n"
+			"  once with heap buffers and once with device memory buffers\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		interface_number = atoi(argv[3]);
+	if (argc > 4)
+		transfer_size = atoi(argv[4]);
+	if (argc > 5)
+		depth = atoi(argv[5]);
+	if (argc > 6)
+		megabytes = strtoul(argv[6], NULL, 0);
+	if (transfer_size <= 0 || depth <= 0) {
+		fprintf(stderr, "invalid transfer size or depth\n");
+		return 1;
+	}
+
+	rc = libusb_init_context(/*ctx=*/NULL, /*options=*/NULL, /*num_options=*/0);
+	if (rc < 0) {
+		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
+		return 1;
+	}
+
+	devh = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
+	if (!devh) {
+		fprintf(stderr, "Error finding USB device\n");
+		rc = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	rc = libusb_claim_interface(devh, interface_number);
+	if (rc < 0) {
+		fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
+		goto out;
+	}
+
+	rc = libusb_buffer_pool_create(devh, (size_t)transfer_size * (size_t)depth, &pool);
+	if (rc < 0) {
+		fprintf(stderr, "Error creating buffer pool: %s\n", libusb_error_name(rc));
+		goto release;
+	}
+
+	rc = run("heap", (unsigned char)ep, transfer_size, depth, megabytes, NULL);
+	if (rc == 0)
+		rc = run("pool", (unsigned char)ep, transfer_size, depth, megabytes, pool);
+
+	libusb_buffer_pool_destroy(pool);
+release:
+	libusb_release_interface(devh, interface_number);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(NULL);
+	return rc < 0 ? 1 : 0;
+}
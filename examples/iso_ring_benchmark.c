@@ -0,0 +1,193 @@
+/*
+ * libusb example program to measure the cost of receiving isochronous
+ * packets through an isochronous ring
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "libusb.h"
+
+#define DEFAULT_PACKETS_PER_TRANSFER	32
+#define DEFAULT_DEPTH			4
+#define DEFAULT_SECONDS			10
+
+/* the clock packet timestamps are taken from, in nanoseconds */
+static unsigned long long monotonic_ns(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER counter, frequency;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (unsigned long long)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static int run(libusb_device_handle *devh, unsigned char ep, int packet_size,
+	int packets_per_transfer, int depth, unsigned int seconds)
+{
+	libusb_iso_ring *ring;
+	struct libusb_iso_ring_stats stats;
+	unsigned long long start, deadline, packets = 0, delay_sum = 0, delay_max = 0;
+	clock_t cpu_start;
+	double cpu;
+	int r;
+
+	r = libusb_iso_ring_open(devh, ep, packet_size, packets_per_transfer, depth, &ring);
+	if (r < 0) {
+		fprintf(stderr, "Error opening ring: %s\n", libusb_error_name(r));
+		return r;
+	}
+
+	start = monotonic_ns();
+	deadline = start + (unsigned long long)seconds * 1000000000ULL;
+	cpu_start = clock();
+
+	while (monotonic_ns() < deadline) {
+		struct timeval tv = { 0, 100000 };
+		struct libusb_iso_ring_packet *pkts;
+		int n;
+
+		r = libusb_handle_events_timeout(NULL, &tv);
+		if (r < 0)
+			break;
+
+		/* everything the callbacks published is available right away */
+		while ((n = libusb_iso_ring_peek(ring, &pkts)) > 0) {
+			unsigned long long now = monotonic_ns();
+			int i;
+
+			for (i = 0; i < n; i++) {
+				unsigned long long delay = now > pkts[i].timestamp ? now - pkts[i].timestamp : 0;
+
+				delay_sum += delay;
+				if (delay > delay_max)
+					delay_max = delay;
+			}
+			packets += (unsigned long long)n;
+			libusb_iso_ring_release(ring, n);
+		}
+		if (n < 0) {
+			fprintf(stderr, "ring stopped: %s\n", libusb_error_name(n));
+			r = n;
+			break;
+		}
+	}
+
+	cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+	libusb_iso_ring_get_stats(ring, &stats);
+	libusb_iso_ring_close(ring);
+
+	printf("%llu packets (%u with errors, %u overruns) in %.1f s\n",
+		packets, stats.packet_errors, stats.overruns,
+		(double)(monotonic_ns() - start) / 1e9);
+	if (packets) {
+		printf("CPU per packet: %.2f us\n", cpu * 1e6 / (double)packets);
+		printf("reap to availability: %.1f us average, %.1f us worst\n",
+			(double)delay_sum / (double)packets / 1e3, (double)delay_max / 1e3);
+	}
+
+	return r < 0 ? r : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_device_handle *devh = NULL;
+	unsigned int vid, pid, ep;
+	int interface_number = 0, altsetting = 1;
+	int packet_size = 0;
+	int packets_per_transfer = DEFAULT_PACKETS_PER_TRANSFER;
+	int depth = DEFAULT_DEPTH;
+	unsigned int seconds = DEFAULT_SECONDS;
+	int rc;
+
+	if (argc < 3 || sscanf(argv[1], "%x:%x", &vid, &pid) != 2 ||
+	    sscanf(argv[2], "%x", &ep) != 1 || !(ep & LIBUSB_ENDPOINT_IN)) {
+		fprintf(stderr, "usage: %s VID:PID ENDPOINT [INTERFACE] [ALTSETTING] [PACKETS_PER_TRANSFER] [DEPTH] [SECONDS]\n"
+			"  receives from the isochronous IN endpoint (hex, e.g. 81) for SECONDS\n"
+			"  and reports the CPU time per packet and the delay between a transfer\n"
+			"  being reaped and its packets being seen by the application\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		interface_number = atoi(argv[3]);
+	if (argc > 4)
+		altsetting = atoi(argv[4]);
+	if (argc > 5)
+		packets_per_transfer = atoi(argv[5]);
+	if (argc > 6)
+		depth = atoi(argv[6]);
+	if (argc > 7)
+		seconds = (unsigned int)strtoul(argv[7], NULL, 0);
+	if (packets_per_transfer <= 0 || depth <= 0) {
+		fprintf(stderr, "invalid packets per transfer or depth\n");
+		return 1;
+	}
+
+	rc = libusb_init_context(/*ctx=*/NULL, /*options=*/NULL, /*num_options=*/0);
+	if (rc < 0) {
+		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
+		return 1;
+	}
+
+	devh = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
+	if (!devh) {
+		fprintf(stderr, "Error finding USB device\n");
+		rc = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	rc = libusb_claim_interface(devh, interface_number);
+	if (rc < 0) {
+		fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
+		goto out;
+	}
+
+	rc = libusb_set_interface_alt_setting(devh, interface_number, altsetting);
+	if (rc < 0) {
+		fprintf(stderr, "Error setting alternate setting: %s\n", libusb_error_name(rc));
+		goto release;
+	}
+
+	packet_size = libusb_get_max_iso_packet_size(libusb_get_device(devh), (unsigned char)ep);
+	if (packet_size <= 0) {
+		fprintf(stderr, "Error getting packet size: %s\n", libusb_error_name(packet_size));
+		rc = packet_size ? packet_size : LIBUSB_ERROR_NOT_FOUND;
+		goto release;
+	}
+
+	rc = run(devh, (unsigned char)ep, packet_size, packets_per_transfer, depth, seconds);
+
+release:
+	libusb_release_interface(devh, interface_number);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(NULL);
+	return rc < 0 ? 1 : 0;
+}
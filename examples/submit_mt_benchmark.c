@@ -0,0 +1,298 @@
+/*
+ * libusb multi-thread transfer submission benchmark
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <libusb.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(PLATFORM_POSIX)
+
+#include <pthread.h>
+#include <sched.h>
+typedef pthread_t thread_t;
+typedef void * thread_return_t;
+#define THREAD_RETURN_VALUE NULL
+#define THREAD_CALL_TYPE
+
+static inline int thread_create(thread_t *thread,
+	thread_return_t (*thread_entry)(void *arg), void *arg)
+{
+	return pthread_create(thread, NULL, thread_entry, arg) == 0 ? 0 : -1;
+}
+
+static inline void thread_join(thread_t thread)
+{
+	(void)pthread_join(thread, NULL);
+}
+
+static inline void thread_yield(void)
+{
+	(void)sched_yield();
+}
+
+#include <stdatomic.h>
+
+#elif defined(PLATFORM_WINDOWS)
+
+typedef HANDLE thread_t;
+#define THREAD_RETURN_VALUE 0
+#define THREAD_CALL_TYPE __stdcall
+
+#if defined(__CYGWIN__)
+typedef DWORD thread_return_t;
+#else
+#include <process.h>
+typedef unsigned thread_return_t;
+#endif
+
+static inline int thread_create(thread_t *thread,
+	thread_return_t (__stdcall *thread_entry)(void *arg), void *arg)
+{
+#if defined(__CYGWIN__)
+	*thread = CreateThread(NULL, 0, thread_entry, arg, 0, NULL);
+#else
+	*thread = (HANDLE)_beginthreadex(NULL, 0, thread_entry, arg, 0, NULL);
+#endif
+	return *thread != NULL ? 0 : -1;
+}
+
+static inline void thread_join(thread_t thread)
+{
+	(void)WaitForSingleObject(thread, INFINITE);
+	(void)CloseHandle(thread);
+}
+
+static inline void thread_yield(void)
+{
+	(void)SwitchToThread();
+}
+
+typedef volatile LONG atomic_bool;
+#endif /* PLATFORM_WINDOWS */
+
+/* Each thread submits GET_STATUS requests through its own device handle,
+ * cancelling them right away so that the rate is bound by libusb rather than
+ * by the devices. The devices found are shared out among the threads, each
+ * thread opening its own handle. The transfers have a timeout, so that the
+ * timeout bookkeeping is exercised as well. */
+
+#define MAX_THREADS 16
+#define MAX_DEVCOUNT 128
+#define DEPTH 8
+#define RUN_SECONDS 1
+#define TRANSFER_TIMEOUT 1000
+
+struct thread_info {
+	int number;
+	libusb_device_handle *handle;
+	struct libusb_transfer *transfers[DEPTH];
+	unsigned char buffers[DEPTH][LIBUSB_CONTROL_SETUP_SIZE + 2];
+	atomic_bool idle[DEPTH];
+	atomic_bool finished;
+	unsigned long submitted;
+	int err;
+} tinfo[MAX_THREADS];
+
+static atomic_bool stop;
+
+static void LIBUSB_CALL transfer_cb(struct libusb_transfer *transfer)
+{
+	atomic_bool *idle = transfer->user_data;
+
+	*idle = true;
+}
+
+static thread_return_t THREAD_CALL_TYPE submit_loop(void *arg)
+{
+	struct thread_info *ti = (struct thread_info *) arg;
+	int i, busy;
+
+	while (!stop && !ti->err) {
+		busy = 1;
+		for (i = 0; i < DEPTH; i++) {
+			if (!ti->idle[i])
+				continue;
+			ti->idle[i] = false;
+			ti->err = libusb_submit_transfer(ti->transfers[i]);
+			if (ti->err) {
+				ti->idle[i] = true;
+				break;
+			}
+			(void)libusb_cancel_transfer(ti->transfers[i]);
+			ti->submitted++;
+			busy = 0;
+		}
+		/* leave the CPU to the event handler */
+		if (busy)
+			thread_yield();
+	}
+
+	for (i = 0; i < DEPTH; i++) {
+		while (!ti->idle[i])
+			thread_yield();
+	}
+	ti->finished = true;
+
+	return (thread_return_t) THREAD_RETURN_VALUE;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	timespec_get(&now, TIME_UTC);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* returns the number of submissions per second, or -1 on failure */
+static double run(libusb_context *ctx, libusb_device **devs, int devcount,
+	int nthreads)
+{
+	thread_t threadId[MAX_THREADS];
+	unsigned long submitted = 0;
+	struct timespec start;
+	double seconds;
+	int errs = 0;
+	int t, i;
+
+	for (t = 0; t < nthreads; t++) {
+		struct thread_info *ti = &tinfo[t];
+
+		ti->number = t;
+		ti->submitted = 0;
+		ti->finished = false;
+		ti->err = libusb_open(devs[t % devcount], &ti->handle);
+		if (ti->err) {
+			fprintf(stderr, "Thread %d: opening device failed: %s\n",
+				t, libusb_error_name(ti->err));
+			while (t--)
+				libusb_close(tinfo[t].handle);
+			return -1;
+		}
+		for (i = 0; i < DEPTH; i++) {
+			libusb_fill_control_setup(ti->buffers[i],
+				LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+				LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+			libusb_fill_control_transfer(ti->transfers[i], ti->handle,
+				ti->buffers[i], transfer_cb, &ti->idle[i], TRANSFER_TIMEOUT);
+			ti->idle[i] = true;
+		}
+	}
+
+	stop = false;
+	timespec_get(&start, TIME_UTC);
+	for (t = 0; t < nthreads; t++)
+		thread_create(&threadId[t], &submit_loop, (void *) &tinfo[t]);
+
+	/* this thread handles the events until every thread is done */
+	for (t = 0; t < nthreads; ) {
+		struct timeval tv = { 0, 10000 };
+
+		if (!stop && elapsed_seconds(&start) >= RUN_SECONDS)
+			stop = true;
+		if (libusb_handle_events_timeout(ctx, &tv) < 0)
+			stop = true;
+		while (t < nthreads && tinfo[t].finished)
+			t++;
+	}
+	seconds = elapsed_seconds(&start);
+
+	for (t = 0; t < nthreads; t++) {
+		thread_join(threadId[t]);
+		if (tinfo[t].err) {
+			errs++;
+			fprintf(stderr, "Thread %d failed: %s\n",
+				tinfo[t].number, libusb_error_name(tinfo[t].err));
+		}
+		submitted += tinfo[t].submitted;
+		libusb_close(tinfo[t].handle);
+	}
+
+	return errs ? -1 : (double)submitted / seconds;
+}
+
+int main(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_device **devs, *usable[MAX_DEVCOUNT];
+	ssize_t devcount;
+	int nusable = 0;
+	int errs = 0;
+	int nthreads, t, i;
+
+	if (libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0) != 0) {
+		fprintf(stderr, "Failed to initialize libusb\n");
+		return 1;
+	}
+
+	devcount = libusb_get_device_list(ctx, &devs);
+	for (i = 0; i < devcount && nusable < MAX_DEVCOUNT; i++) {
+		libusb_device_handle *handle;
+
+		/* only devices that can be opened take part */
+		if (libusb_open(devs[i], &handle) != 0)
+			continue;
+		libusb_close(handle);
+		usable[nusable++] = devs[i];
+	}
+
+	if (!nusable) {
+		printf("No accessible devices, skipping benchmark\n");
+		goto out;
+	}
+
+	for (t = 0; t < MAX_THREADS; t++) {
+		for (i = 0; i < DEPTH; i++) {
+			tinfo[t].transfers[i] = libusb_alloc_transfer(0);
+			if (!tinfo[t].transfers[i]) {
+				fprintf(stderr, "Failed to allocate transfers\n");
+				errs++;
+				goto free;
+			}
+		}
+	}
+
+	printf("Submitting to %d devices, %d transfers per thread\n", nusable, DEPTH);
+	printf("# threads\tsubmissions/s\n");
+	for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+		double rate = run(ctx, usable, nusable, nthreads);
+
+		if (rate < 0) {
+			errs++;
+			break;
+		}
+		printf("%d\t%.0f\n", nthreads, rate);
+	}
+
+free:
+	for (t = 0; t < MAX_THREADS; t++) {
+		for (i = 0; i < DEPTH; i++)
+			libusb_free_transfer(tinfo[t].transfers[i]);
+	}
+out:
+	if (devcount >= 0)
+		libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
+
+	printf("All done, %d errors\n", errs);
+	return errs != 0;
+}
@@ -26,6 +26,7 @@
 #ifdef __ANDROID__
 #include <android/log.h>
 #endif
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #ifdef HAVE_SYSLOG
@@ -1366,11 +1367,16 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_mutex_init(&_dev_handle->flying_transfers_lock);
+	list_init(&_dev_handle->sync_transfers);
+	list_init(&_dev_handle->stall_recoveries);
+	list_init(&_dev_handle->flying_transfers);
 
 	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
 	if (r < 0) {
 		usbi_dbg(ctx, "wrap_sys_device 0x%" PRIxPTR " returns %d", (uintptr_t)sys_dev, r);
 		usbi_mutex_destroy(&_dev_handle->lock);
+		usbi_mutex_destroy(&_dev_handle->flying_transfers_lock);
 		free(_dev_handle);
 		return r;
 	}
@@ -1420,6 +1426,10 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_mutex_init(&_dev_handle->flying_transfers_lock);
+	list_init(&_dev_handle->sync_transfers);
+	list_init(&_dev_handle->stall_recoveries);
+	list_init(&_dev_handle->flying_transfers);
 
 	_dev_handle->dev = libusb_ref_device(dev);
 
@@ -1428,6 +1438,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		usbi_dbg(DEVICE_CTX(dev), "open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
 		usbi_mutex_destroy(&_dev_handle->lock);
+		usbi_mutex_destroy(&_dev_handle->flying_transfers_lock);
 		free(_dev_handle);
 		return r;
 	}
@@ -1497,19 +1508,21 @@ static void do_close(struct libusb_context *ctx,
 {
 	struct usbi_transfer *itransfer;
 	struct usbi_transfer *tmp;
+	struct usbi_sync_transfer *sync, *sync_tmp;
+
+	/* transfers waiting for a halt to be cleared are not on the flying
+	 * list, but the request clearing it is */
+	usbi_drop_stall_recoveries(dev_handle);
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	for_each_transfer_safe(ctx, itransfer, tmp) {
+	for_each_handle_transfer_safe(dev_handle, itransfer, tmp) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 		uint32_t state_flags;
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
 		usbi_mutex_lock(&itransfer->lock);
 		state_flags = itransfer->state_flags;
 		usbi_mutex_unlock(&itransfer->lock);
@@ -1526,7 +1539,7 @@ static void do_close(struct libusb_context *ctx,
 		 * we don't accidentally use the device handle in the future
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
-		list_del(&itransfer->list);
+		usbi_remove_flying_transfer(itransfer);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1536,15 +1549,22 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg(ctx, "Removed transfer %p from the in-flight list because device handle %p closed",
 			 (void *) transfer, (void *) dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
+	for_each_safe_helper(sync, sync_tmp, &dev_handle->sync_transfers, struct usbi_sync_transfer) {
+		list_del(&sync->list);
+		usbi_free_sync_transfer(sync);
+	}
+
 	usbi_backend.close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
+	usbi_mutex_destroy(&dev_handle->flying_transfers_lock);
+	free(dev_handle->timeout_heap);
 	free(dev_handle);
 }
 
@@ -1604,8 +1624,7 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 		usbi_mutex_lock(&ctx->event_data_lock);
 		if (!--ctx->device_close)
 			ctx->event_flags &= ~USBI_EVENT_DEVICE_CLOSE;
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
+		usbi_clear_event_if_idle(ctx);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 
 		/* Release event handling lock and wake up event waiters */
@@ -1910,6 +1929,59 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev_handle,
 	return usbi_backend.clear_halt(dev_handle, endpoint);
 }
 
+/** \ingroup libusb_dev
+ * Get the current frame number of the bus a device is connected to, for
+ * scheduling isochronous transfers with libusb_transfer_set_iso_start_frame().
+ *
+ * Not all platforms can query the frame number. Where this function returns
+ * \ref LIBUSB_ERROR_NOT_SUPPORTED, submit the first isochronous transfer as
+ * soon as possible and derive the frames of later transfers from the start
+ * frame reported by libusb_transfer_get_iso_start_frame().
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param frame_number output location for the frame number. Only populated
+ * if the return code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot query the
+ * frame number
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_frame_number(libusb_device_handle *dev_handle,
+	uint64_t *frame_number)
+{
+	if (!usbi_atomic_load(&dev_handle->dev->attached))
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (!usbi_backend.get_frame_number)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	return usbi_backend.get_frame_number(dev_handle, frame_number);
+}
+
+/** \ingroup libusb_dev
+ * Get the statistics of a device handle, for instance to tune
+ * \ref LIBUSB_OPTION_REAP_BUDGET. The counters start at zero when the device
+ * is opened. Counters a platform does not keep are reported as zero.
+ *
+ * This function may be called from any thread, while events are being
+ * handled.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param stats output location for the statistics
+ */
+void API_EXPORTED libusb_get_device_handle_stats(libusb_device_handle *dev_handle,
+	struct libusb_device_handle_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (usbi_backend.get_handle_stats)
+		usbi_backend.get_handle_stats(dev_handle, stats);
+}
+
 /** \ingroup libusb_dev
  * Perform a USB port reset to reinitialize a device. The system will attempt
  * to restore the previous configuration and alternate settings after the
@@ -2064,6 +2136,220 @@ int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/** \ingroup libusb_asyncio
+ * Create a pool of transfer buffers backed by device memory. A single block
+ * of \p size bytes is obtained with libusb_dev_mem_alloc() up front, and
+ * buffers handed out by libusb_buffer_pool_alloc() are carved from it. This
+ * gives the zero-copy benefits of device memory without paying for a
+ * mapping per buffer, and without fragmenting the limited amount of device
+ * memory some systems provide.
+ *
+ * If the device memory cannot be allocated, for example because the
+ * platform does not support it or its limit has been reached, the pool is
+ * still created and all of its buffers come from the heap. The same happens
+ * for individual buffers once the device memory is used up. Use
+ * libusb_buffer_pool_is_dev_mem() to find out where a buffer lives.
+ *
+ * The pool must be destroyed before the device handle is closed.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param size number of bytes of device memory to allocate. It is rounded
+ * up to a multiple of 512 bytes.
+ * \param pool output location for the new pool. Only populated if the return
+ * code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_buffer_pool_destroy()
+ */
+int API_EXPORTED libusb_buffer_pool_create(libusb_device_handle *dev_handle,
+	size_t size, libusb_buffer_pool **pool)
+{
+	struct libusb_buffer_pool *_pool;
+	size_t num_blocks;
+
+	if (!dev_handle || !size || !pool)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	num_blocks = (size + USBI_BUFFER_POOL_BLOCK_SIZE - 1) / USBI_BUFFER_POOL_BLOCK_SIZE;
+	if (num_blocks > UINT_MAX)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_pool = calloc(1, sizeof(*_pool));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_pool->block_runs = calloc(num_blocks, sizeof(*_pool->block_runs));
+	if (!_pool->block_runs) {
+		free(_pool);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_pool->dev_handle = dev_handle;
+	_pool->mem_size = num_blocks * USBI_BUFFER_POOL_BLOCK_SIZE;
+	_pool->mem = libusb_dev_mem_alloc(dev_handle, _pool->mem_size);
+	if (_pool->mem) {
+		_pool->num_blocks = (unsigned int)num_blocks;
+	} else {
+		usbi_dbg(HANDLE_CTX(dev_handle), "no device memory, pool %p falls back to the heap",
+			 (void *) _pool);
+		free(_pool->block_runs);
+		_pool->block_runs = NULL;
+	}
+	usbi_mutex_init(&_pool->lock);
+
+	usbi_dbg(HANDLE_CTX(dev_handle), "pool %p with %lu bytes of device memory",
+		 (void *) _pool, _pool->mem ? (unsigned long)_pool->mem_size : 0UL);
+	*pool = _pool;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a buffer pool and release its device memory. All buffers allocated
+ * from the pool must have been freed with libusb_buffer_pool_free() before.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to destroy. If NULL then this function simply returns.
+ */
+void API_EXPORTED libusb_buffer_pool_destroy(libusb_buffer_pool *pool)
+{
+	if (!pool)
+		return;
+
+	usbi_dbg(HANDLE_CTX(pool->dev_handle), "pool %p", (void *) pool);
+	if (pool->mem)
+		libusb_dev_mem_free(pool->dev_handle, pool->mem, pool->mem_size);
+	usbi_mutex_destroy(&pool->lock);
+	free(pool->block_runs);
+	free(pool);
+}
+
+/* Find and claim count consecutive free blocks, or return UINT_MAX.
+ * Called with the pool lock held. */
+static unsigned int buffer_pool_claim_blocks(struct libusb_buffer_pool *pool,
+	unsigned int count)
+{
+	unsigned int start = pool->next_block;
+	unsigned int i = start, run_start = start, run_len = 0;
+	int wrapped = 0;
+
+	/* next-fit: look from the end of the previous allocation onward and
+	 * wrap around once, skipping over allocations as whole runs */
+	while (!wrapped || i < start || run_len) {
+		if (i >= pool->num_blocks) {
+			if (wrapped)
+				break;
+			wrapped = 1;
+			i = run_start = 0;
+			run_len = 0;
+			continue;
+		}
+
+		if (pool->block_runs[i]) {
+			i += pool->block_runs[i];
+			run_start = i;
+			run_len = 0;
+			continue;
+		}
+
+		if (++run_len == count) {
+			pool->block_runs[run_start] = count;
+			pool->next_block = run_start + count;
+			return run_start;
+		}
+		i++;
+	}
+
+	return UINT_MAX;
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a transfer buffer from a buffer pool. The buffer starts on a
+ * 512 byte boundary within the pool's device memory. If that memory is
+ * missing or exhausted, the buffer is allocated from the heap instead.
+ *
+ * Buffers must be freed with libusb_buffer_pool_free(). As for
+ * libusb_dev_mem_alloc(), this means that the flag
+ * \ref LIBUSB_TRANSFER_FREE_BUFFER cannot be used on them.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to allocate from
+ * \param length size of desired data buffer
+ * \returns a pointer to the buffer, or NULL on failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_buffer_pool_alloc(libusb_buffer_pool *pool,
+	size_t length)
+{
+	size_t count = (length + USBI_BUFFER_POOL_BLOCK_SIZE - 1) / USBI_BUFFER_POOL_BLOCK_SIZE;
+	unsigned int block = UINT_MAX;
+
+	if (!count)
+		count = 1;
+
+	if (count <= pool->num_blocks) {
+		usbi_mutex_lock(&pool->lock);
+		block = buffer_pool_claim_blocks(pool, (unsigned int)count);
+		usbi_mutex_unlock(&pool->lock);
+	}
+
+	if (block != UINT_MAX)
+		return pool->mem + (size_t)block * USBI_BUFFER_POOL_BLOCK_SIZE;
+
+	if (pool->mem)
+		usbi_dbg(HANDLE_CTX(pool->dev_handle), "pool %p exhausted, %lu bytes from the heap",
+			 (void *) pool, (unsigned long)length);
+	return malloc(count * USBI_BUFFER_POOL_BLOCK_SIZE);
+}
+
+/** \ingroup libusb_asyncio
+ * Return a buffer obtained from libusb_buffer_pool_alloc() to its pool.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool the buffer was allocated from
+ * \param buffer the buffer to free. If NULL then this function simply returns.
+ */
+void API_EXPORTED libusb_buffer_pool_free(libusb_buffer_pool *pool,
+	unsigned char *buffer)
+{
+	size_t block;
+
+	if (!buffer)
+		return;
+
+	if (!libusb_buffer_pool_is_dev_mem(pool, buffer)) {
+		free(buffer);
+		return;
+	}
+
+	block = (size_t)(buffer - pool->mem) / USBI_BUFFER_POOL_BLOCK_SIZE;
+	usbi_mutex_lock(&pool->lock);
+	pool->block_runs[block] = 0;
+	usbi_mutex_unlock(&pool->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Check whether a buffer from libusb_buffer_pool_alloc() lives in the pool's
+ * device memory, as opposed to having come from the heap.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool the buffer was allocated from
+ * \param buffer the buffer to check
+ * \returns 1 if the buffer is device memory, 0 otherwise
+ */
+int API_EXPORTED libusb_buffer_pool_is_dev_mem(libusb_buffer_pool *pool,
+	const unsigned char *buffer)
+{
+	return pool->mem && buffer >= pool->mem &&
+		buffer < pool->mem + pool->mem_size;
+}
+
 /** \ingroup libusb_dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -2287,6 +2573,8 @@ void API_EXPORTED libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
  * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the option is valid but not supported
  * on this platform
  * \returns \ref LIBUSB_ERROR_NOT_FOUND if LIBUSB_OPTION_USE_USBDK is valid on this platform but UsbDk is not available
+ * \returns \ref LIBUSB_ERROR_BUSY if the option cannot be changed while a
+ * device of the context is open
  */
 int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	enum libusb_option option, ...)
@@ -2309,6 +2597,29 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	if (LIBUSB_OPTION_LOG_CB == option) {
 		log_cb = (libusb_log_cb) va_arg(ap, libusb_log_cb);
 	}
+	if (LIBUSB_OPTION_TIMER_SLACK_NS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg >= NSEC_PER_SEC) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_TRANSFER_MEM_BUDGET == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_REAP_BUDGET == option) {
+		/* peek at the argument, the backend reads it from ap itself */
+		va_list aq;
+
+		va_copy(aq, ap);
+		arg = va_arg(aq, int);
+		va_end(aq);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
 
 	do {
 		if (LIBUSB_SUCCESS != r) {
@@ -2323,7 +2634,8 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 		if (NULL == ctx) {
 			usbi_mutex_static_lock(&default_context_lock);
 			default_context_options[option].is_set = 1;
-			if (LIBUSB_OPTION_LOG_LEVEL == option) {
+			if (LIBUSB_OPTION_LOG_LEVEL == option || LIBUSB_OPTION_TIMER_SLACK_NS == option ||
+			    LIBUSB_OPTION_REAP_BUDGET == option || LIBUSB_OPTION_TRANSFER_MEM_BUDGET == option) {
 				default_context_options[option].arg.ival = arg;
 			} else if (LIBUSB_OPTION_LOG_CB == option) {
 				default_context_options[option].arg.log_cbval = log_cb;
@@ -2350,6 +2662,7 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			/* Handle all backend-specific options here */
 		case LIBUSB_OPTION_USE_USBDK:
 		case LIBUSB_OPTION_NO_DEVICE_DISCOVERY:
+		case LIBUSB_OPTION_REAP_BUDGET:
 			if (usbi_backend.set_option) {
 				r = usbi_backend.set_option(ctx, option, ap);
 				break;
@@ -2362,6 +2675,43 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			libusb_set_log_cb_internal(ctx, log_cb, LIBUSB_LOG_CB_CONTEXT);
 			break;
 
+		case LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS:
+			if (!usbi_backend.sync_control_transfer && !usbi_backend.sync_bulk_transfer) {
+				r = LIBUSB_ERROR_NOT_SUPPORTED;
+				break;
+			}
+
+			usbi_dbg(ctx, "synchronous transfers will bypass the event loop");
+			ctx->direct_sync_transfers = 1;
+			break;
+
+		case LIBUSB_OPTION_TIMER_SLACK_NS: {
+			long coarse_resolution = usbi_coarse_monotonic_resolution();
+
+			/* the coarse clock only has a lower resolution, so
+			 * deadlines taken from either clock still compare */
+			usbi_mutex_lock(&ctx->timeout_lock);
+			ctx->timer_slack_ns = arg;
+			usbi_atomic_store(&ctx->coarse_timeouts, coarse_resolution && coarse_resolution <= arg);
+			usbi_mutex_unlock(&ctx->timeout_lock);
+			usbi_dbg(ctx, "timer slack %dns%s", arg,
+				 coarse_resolution && coarse_resolution <= arg ? ", using coarse clock" : "");
+			break;
+		}
+
+		case LIBUSB_OPTION_TRANSFER_MEM_BUDGET:
+			/* the OS limit is only known once the backend is
+			 * initialized, so a budget of 0 is resolved on use.
+			 * transfers already in flight are not charged, so they
+			 * release nothing on completion */
+			usbi_mutex_lock(&ctx->transfer_mem_lock);
+			ctx->transfer_mem_budget = (size_t)arg;
+			usbi_atomic_store(&ctx->hold_transfers, 1);
+			usbi_mutex_unlock(&ctx->transfer_mem_lock);
+			usbi_dbg(ctx, "holding transfers beyond %d bytes in flight%s", arg,
+				 arg ? "" : " (the OS limit)");
+			break;
+
 		case LIBUSB_OPTION_MAX: /* unreachable */
 		default:
 			r = LIBUSB_ERROR_INVALID_PARAM;
@@ -2460,6 +2810,8 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 
 	usbi_mutex_init(&_ctx->usb_devs_lock);
 	usbi_mutex_init(&_ctx->open_devs_lock);
+	/* taken by LIBUSB_OPTION_TIMER_SLACK_NS, applied below */
+	usbi_mutex_init(&_ctx->timeout_lock);
 	list_init(&_ctx->usb_devs);
 	list_init(&_ctx->open_devs);
 
@@ -2468,7 +2820,10 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		if (LIBUSB_OPTION_LOG_LEVEL == option || !default_context_options[option].is_set) {
 			continue;
 		}
-		if (LIBUSB_OPTION_LOG_CB != option) {
+		if (LIBUSB_OPTION_TIMER_SLACK_NS == option || LIBUSB_OPTION_REAP_BUDGET == option ||
+		    LIBUSB_OPTION_TRANSFER_MEM_BUDGET == option) {
+			r = libusb_set_option(_ctx, option, default_context_options[option].arg.ival);
+		} else if (LIBUSB_OPTION_LOG_CB != option) {
 			r = libusb_set_option(_ctx, option);
 		} else {
 			r = libusb_set_option(_ctx, option, default_context_options[option].arg.log_cbval);
@@ -2487,6 +2842,10 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		case LIBUSB_OPTION_LOG_LEVEL:
 		case LIBUSB_OPTION_USE_USBDK:
 		case LIBUSB_OPTION_NO_DEVICE_DISCOVERY:
+		case LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS:
+		case LIBUSB_OPTION_TIMER_SLACK_NS:
+		case LIBUSB_OPTION_REAP_BUDGET:
+		case LIBUSB_OPTION_TRANSFER_MEM_BUDGET:
 		case LIBUSB_OPTION_MAX:
 		default:
 			r = libusb_set_option(_ctx, options[i].option, options[i].value.ival);
@@ -2557,6 +2916,7 @@ err_free_ctx:
 		default_context_refcnt = 0;
 	}
 
+	usbi_mutex_destroy(&_ctx->timeout_lock);
 	usbi_mutex_destroy(&_ctx->open_devs_lock);
 	usbi_mutex_destroy(&_ctx->usb_devs_lock);
 
@@ -2632,6 +2992,7 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 	if (!list_empty(&_ctx->open_devs))
 		usbi_warn(_ctx, "application left some devices open");
 
+	usbi_mutex_destroy(&_ctx->timeout_lock);
 	usbi_mutex_destroy(&_ctx->open_devs_lock);
 	usbi_mutex_destroy(&_ctx->usb_devs_lock);
 
@@ -2657,6 +3018,8 @@ int API_EXPORTED libusb_has_capability(uint32_t capability)
 		return (usbi_backend.caps & USBI_CAP_HAS_HID_ACCESS);
 	case LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER:
 		return (usbi_backend.caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER);
+	case LIBUSB_CAP_SUPPORTS_BULK_IOVEC:
+		return (usbi_backend.caps & USBI_CAP_SUPPORTS_BULK_IOVEC);
 	}
 	return 0;
 }
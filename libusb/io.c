@@ -23,6 +23,9 @@
 
 #include "libusbi.h"
 
+#include <limits.h>
+#include <string.h>
+
 /**
  * \page libusb_io Synchronous and asynchronous device I/O
  *
@@ -40,6 +43,11 @@
  * detailed API documentation pages for the details:
  * - \ref libusb_syncio
  * - \ref libusb_asyncio
+ * - \ref libusb_stream, built on the asynchronous interface for continuous
+ *   bulk streams
+ * - \ref libusb_iso_ring, likewise for continuous isochronous streams
+ * - \ref libusb_stream_manager, for sharing the bulk streams of USB 3
+ *   endpoints among many commands
  *
  * \section theory Transfers at a logical level
  *
@@ -282,6 +290,12 @@ if (r == 0 && actual_length == sizeof(data)) {
  * functions are any listed in the \ref libusb_syncio "synchronous API" and any of
  * the blocking functions that retrieve \ref libusb_desc "USB descriptors".
  *
+ * Instead of a callback, a transfer can be attached to a completion queue
+ * created with libusb_cq_create(), see libusb_transfer_set_cq(). Completed
+ * transfers are then added to the queue, and collected in batches with
+ * libusb_cq_reap() by any thread, without taking part in event handling.
+ * Each consumer thread can have its own queue.
+ *
  * \subsection Deallocation
  *
  * When a transfer has completed (i.e. the callback function has been invoked),
@@ -534,6 +548,11 @@ if (r == 0 && actual_length == sizeof(data)) {
  * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
  *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
  *   transfer after the transfer callback returns.
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_AUTO_RESUBMIT
+ *   "LIBUSB_TRANSFER_AUTO_RESUBMIT" makes libusb resubmit a completed transfer
+ *   into its twin buffer (see libusb_transfer_set_twin_buffer()) before
+ *   invoking the callback, so that the endpoint keeps being serviced while
+ *   the callback processes the data.
  *
  * \section asyncevent Event handling
  *
@@ -1161,17 +1180,24 @@ int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock);
+	usbi_mutex_init(&ctx->transfer_mem_lock);
 	usbi_mutex_init(&ctx->events_lock);
 	usbi_mutex_init(&ctx->event_waiters_lock);
 	usbi_cond_init(&ctx->event_waiters_cond);
 	usbi_mutex_init(&ctx->event_data_lock);
 	usbi_tls_key_create(&ctx->event_handling_key);
-	list_init(&ctx->flying_transfers);
 	list_init(&ctx->event_sources);
 	list_init(&ctx->removed_event_sources);
 	list_init(&ctx->hotplug_msgs);
 	list_init(&ctx->completed_transfers);
+	list_init(&ctx->held_transfers);
+
+#ifdef HAVE_OS_EVENT_SET
+	if (usbi_create_event_set(&ctx->event_set) == 0)
+		usbi_dbg(ctx, "using event set for waiting");
+	else
+		usbi_dbg(ctx, "event set not available, polling");
+#endif
 
 	r = usbi_create_event(&ctx->event);
 	if (r < 0)
@@ -1203,7 +1229,11 @@ err_destroy_timer:
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
 err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef HAVE_OS_EVENT_SET
+	if (usbi_using_event_set(ctx))
+		usbi_destroy_event_set(&ctx->event_set);
+#endif
+	usbi_mutex_destroy(&ctx->transfer_mem_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
@@ -1232,7 +1262,11 @@ void usbi_io_exit(struct libusb_context *ctx)
 #endif
 	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event));
 	usbi_destroy_event(&ctx->event);
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef HAVE_OS_EVENT_SET
+	if (usbi_using_event_set(ctx))
+		usbi_destroy_event_set(&ctx->event_set);
+#endif
+	usbi_mutex_destroy(&ctx->transfer_mem_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
@@ -1242,7 +1276,18 @@ void usbi_io_exit(struct libusb_context *ctx)
 	free(ctx->event_data);
 }
 
-static void calculate_timeout(struct usbi_transfer *itransfer)
+/* the time transfer timeouts count from */
+static void get_submit_time(struct libusb_context *ctx, struct timespec *now)
+{
+	if (usbi_atomic_load(&ctx->coarse_timeouts))
+		usbi_get_coarse_monotonic_time(now);
+	else
+		usbi_get_monotonic_time(now);
+}
+
+/* now is the submission time, or NULL to read the clock */
+static void calculate_timeout(struct usbi_transfer *itransfer,
+	const struct timespec *now)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	unsigned int timeout = transfer->timeout;
@@ -1252,7 +1297,10 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 		return;
 	}
 
-	usbi_get_monotonic_time(&itransfer->timeout);
+	if (now)
+		itransfer->timeout = *now;
+	else
+		get_submit_time(ITRANSFER_CTX(itransfer), &itransfer->timeout);
 
 	itransfer->timeout.tv_sec += timeout / 1000U;
 	itransfer->timeout.tv_nsec += (timeout % 1000U) * 1000000L;
@@ -1262,6 +1310,43 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 	}
 }
 
+static struct usbi_transfer *alloc_itransfer(int iso_packets)
+{
+	size_t priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
+	size_t usbi_transfer_size = PTR_ALIGN(sizeof(struct usbi_transfer));
+	size_t libusb_transfer_size = PTR_ALIGN(sizeof(struct libusb_transfer));
+	size_t iso_packets_size = PTR_ALIGN(sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
+	size_t slab_size = usbi_backend.transfer_slab_size ?
+		usbi_backend.transfer_slab_size(iso_packets) : 0;
+	size_t alloc_size = priv_size + usbi_transfer_size + libusb_transfer_size + iso_packets_size + slab_size;
+	unsigned char *ptr = calloc(1, alloc_size);
+	if (!ptr)
+		return NULL;
+
+	struct usbi_transfer *itransfer = (struct usbi_transfer *)(ptr + priv_size);
+	itransfer->num_iso_packets = iso_packets;
+	itransfer->priv = ptr;
+	if (slab_size)
+		itransfer->slab = ptr + alloc_size - slab_size;
+	usbi_mutex_init(&itransfer->lock);
+
+	return itransfer;
+}
+
+static void free_itransfer(struct usbi_transfer *itransfer)
+{
+	if (usbi_backend.free_transfer_priv)
+		usbi_backend.free_transfer_priv(itransfer);
+
+	usbi_mutex_destroy(&itransfer->lock);
+	if (itransfer->dev)
+		libusb_unref_device(itransfer->dev);
+
+	unsigned char *ptr = USBI_TRANSFER_TO_TRANSFER_PRIV(itransfer);
+	assert(ptr == itransfer->priv);
+	free(ptr);
+}
+
 /** \ingroup libusb_asyncio
  * Allocate a libusb transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1293,22 +1378,11 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	if (iso_packets < 0)
 		return NULL;
 
-	size_t priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
-	size_t usbi_transfer_size = PTR_ALIGN(sizeof(struct usbi_transfer));
-	size_t libusb_transfer_size = PTR_ALIGN(sizeof(struct libusb_transfer));
-	size_t iso_packets_size = sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets;
-	size_t alloc_size = priv_size + usbi_transfer_size + libusb_transfer_size + iso_packets_size;
-	unsigned char *ptr = calloc(1, alloc_size);
-	if (!ptr)
+	struct usbi_transfer *itransfer = alloc_itransfer(iso_packets);
+	if (!itransfer)
 		return NULL;
 
-	struct usbi_transfer *itransfer = (struct usbi_transfer *)(ptr + priv_size);
-	itransfer->num_iso_packets = iso_packets;
-	itransfer->priv = ptr;
-	usbi_mutex_init(&itransfer->lock);
-	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-
-	return transfer;
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
 /** \ingroup libusb_asyncio
@@ -1316,9 +1390,9 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
  * allocated with libusb_alloc_transfer().
  *
  * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
- * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set and the transfer buffer is
- * non-NULL, this function will also free the transfer buffer using the
- * standard system memory allocator (e.g. free()).
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set, this function will also free the
+ * transfer buffer and the twin buffer, if any, using the standard system
+ * memory allocator (e.g. free()).
  *
  * It is legal to call this function with a NULL transfer. In this case,
  * the function will simply return safely.
@@ -1333,344 +1407,2106 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	if (!transfer)
 		return;
 
+	struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (itransfer->pool) {
+		libusb_transfer_pool_release(transfer);
+		return;
+	}
+
 	usbi_dbg(TRANSFER_CTX(transfer), "transfer %p", (void *) transfer);
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) {
 		free(transfer->buffer);
+		free(itransfer->twin_buffer);
+	}
 
-	struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
-	if (itransfer->dev)
-		libusb_unref_device(itransfer->dev);
-
-	unsigned char *ptr = USBI_TRANSFER_TO_TRANSFER_PRIV(itransfer);
-	assert(ptr == itransfer->priv);
-	free(ptr);
+	free_itransfer(itransfer);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
- * NB: flying_transfers_lock must be held when calling this.
- * returns 0 on success or a LIBUSB_ERROR code on failure.
+/** \ingroup libusb_asyncio
+ * Create a pool of recycled transfers. Transfers obtained from a pool with
+ * libusb_transfer_pool_acquire() are returned to it rather than freed, so
+ * that an application which continuously allocates, submits and frees
+ * transfers does not pay for a heap allocation and a mutex initialization on
+ * every cycle.
+ *
+ * All transfers in a pool have the same number of isochronous packet
+ * descriptors. The pool is pre-filled with \p count transfers and grows on
+ * demand when it runs dry.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param iso_packets number of isochronous packet descriptors in each
+ * transfer. Must be non-negative.
+ * \param count number of transfers to allocate up front. Must be
+ * non-negative.
+ * \param pool output location for the new pool. Only populated if the return
+ * code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_transfer_pool_destroy()
  */
-#ifdef HAVE_OS_TIMER
-static int arm_timer_for_next_timeout(struct libusb_context *ctx)
+int API_EXPORTED libusb_transfer_pool_create(libusb_context *ctx,
+	int iso_packets, int count, libusb_transfer_pool **pool)
 {
-	struct usbi_transfer *itransfer;
+	struct libusb_transfer_pool *_pool;
+	int i;
 
-	if (!usbi_using_timer(ctx))
-		return 0;
+	if (iso_packets < 0 || count < 0 || !pool)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_pool = calloc(1, sizeof(*_pool));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
 
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
+	_pool->ctx = usbi_get_context(ctx);
+	_pool->iso_packets = iso_packets;
+	usbi_mutex_init(&_pool->lock);
+	list_init(&_pool->free_transfers);
 
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			break;
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer = alloc_itransfer(iso_packets);
 
-		/* act on first transfer that has not already been handled */
-		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-			usbi_dbg(ctx, "next timeout originally %ums", transfer->timeout);
-			return usbi_arm_timer(&ctx->timer, cur_ts);
+		if (!itransfer) {
+			libusb_transfer_pool_destroy(_pool);
+			return LIBUSB_ERROR_NO_MEM;
 		}
+
+		itransfer->pool = _pool;
+		list_add(&itransfer->list, &_pool->free_transfers);
 	}
 
-	usbi_dbg(ctx, "no timeouts, disarming timer");
-	return usbi_disarm_timer(&ctx->timer);
-}
-#else
-static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
-{
-	UNUSED(ctx);
+	usbi_dbg(_pool->ctx, "pool %p with %d transfers of %d iso packets",
+		 (void *) _pool, count, iso_packets);
+	*pool = _pool;
 	return 0;
 }
-#endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
- * in which case the transfer is *not* on the flying_transfers list.
- * NB: flying_transfers_lock MUST be held when calling this. */
-static int add_to_flying_list(struct usbi_transfer *itransfer)
+/** \ingroup libusb_asyncio
+ * Destroy a transfer pool. Idle transfers are freed immediately. Transfers
+ * that are still acquired remain valid, and are freed (together with the
+ * pool itself) when they are released. The pool must not be passed to
+ * libusb_transfer_pool_acquire() afterwards, as it may have been freed
+ * already.
+ *
+ * It is legal to call this function with a NULL pool. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to destroy
+ */
+void API_EXPORTED libusb_transfer_pool_destroy(libusb_transfer_pool *pool)
 {
-	struct usbi_transfer *cur;
-	struct timespec *timeout = &itransfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
-	int first = 1;
-
-	calculate_timeout(itransfer);
-
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&itransfer->list, &ctx->flying_transfers);
-		goto out;
-	}
+	struct usbi_transfer *itransfer, *tmp;
+	struct list_head free_transfers;
+	int free_pool;
 
-	/* if we have infinite timeout, append to end of list */
-	if (!TIMESPEC_IS_SET(timeout)) {
-		list_add_tail(&itransfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
+	if (!pool)
+		return;
 
-	/* otherwise, find appropriate place in list */
-	for_each_transfer(ctx, cur) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timespec *cur_ts = &cur->timeout;
+	usbi_mutex_lock(&pool->lock);
+	pool->destroyed = 1;
+	list_cut(&free_transfers, &pool->free_transfers);
+	free_pool = !pool->num_acquired;
+	usbi_mutex_unlock(&pool->lock);
 
-		if (!TIMESPEC_IS_SET(cur_ts) || TIMESPEC_CMP(cur_ts, timeout, >)) {
-			list_add_tail(&itransfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
+	for_each_safe_helper(itransfer, tmp, &free_transfers, struct usbi_transfer) {
+		list_del(&itransfer->list);
+		free_itransfer(itransfer);
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&itransfer->list, &ctx->flying_transfers);
-out:
-#ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-		usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
-			transfer->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
+	if (free_pool) {
+		usbi_dbg(pool->ctx, "pool %p", (void *) pool);
+		usbi_mutex_destroy(&pool->lock);
+		free(pool);
+	} else {
+		usbi_dbg(pool->ctx, "pool %p has acquired transfers, deferring", (void *) pool);
 	}
-#else
-	UNUSED(first);
-#endif
-
-	if (r)
-		list_del(&itransfer->list);
-
-	return r;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout.
- * NB: flying_transfers_lock MUST be held when calling this. */
-static int remove_from_flying_list(struct usbi_transfer *itransfer)
+/** \ingroup libusb_asyncio
+ * Take a transfer from a pool. The returned transfer is initialized exactly
+ * like one returned from libusb_alloc_transfer() with the pool's number of
+ * isochronous packet descriptors. When the transfer is no longer needed,
+ * return it with libusb_transfer_pool_release() or libusb_free_transfer();
+ * the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" flag also returns it to the pool.
+ *
+ * It is not legal to acquire a transfer from a pool that has been destroyed.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to take the transfer from
+ * \returns a transfer, or NULL if pool is NULL or on memory allocation failure
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_acquire(
+	libusb_transfer_pool *pool)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int rearm_timer;
-	int r = 0;
+	struct usbi_transfer *itransfer = NULL;
 
-	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
-	list_del(&itransfer->list);
-	if (rearm_timer)
-		r = arm_timer_for_next_timeout(ctx);
+	if (!pool)
+		return NULL;
 
-	return r;
+	usbi_mutex_lock(&pool->lock);
+	if (!list_empty(&pool->free_transfers)) {
+		itransfer = list_first_entry(&pool->free_transfers, struct usbi_transfer, list);
+		list_del(&itransfer->list);
+	}
+	pool->num_acquired++;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (!itransfer) {
+		itransfer = alloc_itransfer(pool->iso_packets);
+		if (!itransfer) {
+			usbi_mutex_lock(&pool->lock);
+			pool->num_acquired--;
+			usbi_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		itransfer->pool = pool;
+	}
+
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
 /** \ingroup libusb_asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
+ * Return a transfer to the pool it was acquired from. The transfer's mutex
+ * and backend private data stay initialized, so the next
+ * libusb_transfer_pool_acquire() does not need to allocate anything.
  *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns \ref LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
- * the operating system and/or hardware can support (see \ref asynclimits)
- * \returns another LIBUSB_ERROR code on other failure
+ * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set, this function will also free the
+ * transfer buffer and the twin buffer, if any, using the standard system
+ * memory allocator (e.g. free()).
+ *
+ * Transfers allocated with libusb_alloc_transfer() are simply freed. It is
+ * legal to call this function with a NULL transfer. It is not legal to
+ * release an active transfer.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to release
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+void API_EXPORTED libusb_transfer_pool_release(struct libusb_transfer *transfer)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	struct libusb_context *ctx;
-	int r;
+	struct usbi_transfer *itransfer;
+	struct libusb_transfer_pool *pool;
+	int free_pool;
 
-	assert(transfer->dev_handle);
-	if (itransfer->dev)
-		libusb_unref_device(itransfer->dev);
-	itransfer->dev = libusb_ref_device(transfer->dev_handle->dev);
+	if (!transfer)
+		return;
 
-	ctx = HANDLE_CTX(transfer->dev_handle);
-	usbi_dbg(ctx, "transfer %p", (void *) transfer);
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	pool = itransfer->pool;
+	if (!pool) {
+		libusb_free_transfer(transfer);
+		return;
+	}
 
-	/*
-	 * Important note on locking, this function takes / releases locks
-	 * in the following order:
-	 *  take flying_transfers_lock
-	 *  take itransfer->lock
-	 *  clear transfer
-	 *  add to flying_transfers list
-	 *  release flying_transfers_lock
-	 *  submit transfer
-	 *  release itransfer->lock
-	 *  if submit failed:
-	 *   take flying_transfers_lock
-	 *   remove from flying_transfers list
-	 *   release flying_transfers_lock
-	 *
-	 * Note that it takes locks in the order a-b and then releases them
-	 * in the same order a-b. This is somewhat unusual but not wrong,
-	 * release order is not important as long as *all* locks are released
-	 * before re-acquiring any locks.
-	 *
-	 * This means that the ordering of first releasing itransfer->lock
-	 * and then re-acquiring the flying_transfers_list on error is
-	 * important and must not be changed!
-	 *
-	 * This is done this way because when we take both locks we must always
-	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
-	 * the timeout handling and usbi_handle_disconnect paths.
-	 *
-	 * And we cannot release itransfer->lock before the submission is
-	 * complete otherwise timeout handling for transfers with short
-	 * timeouts may run before submission.
-	 */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	usbi_mutex_lock(&itransfer->lock);
-	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return LIBUSB_ERROR_BUSY;
+	usbi_dbg(TRANSFER_CTX(transfer), "transfer %p", (void *) transfer);
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+		free(transfer->buffer);
+		free(itransfer->twin_buffer);
+	}
+
+	if (itransfer->dev) {
+		libusb_unref_device(itransfer->dev);
+		itransfer->dev = NULL;
 	}
+
+	/* bring the transfer back to the state libusb_alloc_transfer() returns
+	 * it in, leaving the lock and the backend private data alone */
+	TIMESPEC_CLEAR(&itransfer->timeout);
 	itransfer->transferred = 0;
+	itransfer->stream_id = 0;
+	itransfer->twin_buffer = NULL;
+	itransfer->iov = NULL;
+	itransfer->iov_count = 0;
+	itransfer->iso_start_frame = 0;
+	itransfer->iso_start_frame_set = 0;
 	itransfer->state_flags = 0;
 	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return r;
+	itransfer->mem_charge = 0;
+	itransfer->held = 0;
+	itransfer->stream_slot = NULL;
+	itransfer->cq = NULL;
+	itransfer->stall_state = USBI_STALL_NONE;
+	itransfer->stall_retries = 0;
+	memset(transfer, 0, sizeof(*transfer) +
+		sizeof(struct libusb_iso_packet_descriptor) * (size_t)itransfer->num_iso_packets);
+
+	usbi_mutex_lock(&pool->lock);
+	pool->num_acquired--;
+	if (!pool->destroyed) {
+		list_add(&itransfer->list, &pool->free_transfers);
+		itransfer = NULL;
 	}
-	/*
-	 * We must release the flying transfers lock here, because with
-	 * some backends the submit_transfer method is synchronous.
-	 */
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	free_pool = pool->destroyed && !pool->num_acquired;
+	usbi_mutex_unlock(&pool->lock);
 
-	r = usbi_backend.submit_transfer(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
-	}
-	usbi_mutex_unlock(&itransfer->lock);
+	if (itransfer)
+		free_itransfer(itransfer);
 
-	if (r != LIBUSB_SUCCESS) {
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		remove_from_flying_list(itransfer);
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (free_pool) {
+		usbi_dbg(pool->ctx, "pool %p", (void *) pool);
+		usbi_mutex_destroy(&pool->lock);
+		free(pool);
 	}
-
-	return r;
 }
 
 /** \ingroup libusb_asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
+ * Create a completion queue. Transfers attached to a completion queue with
+ * libusb_transfer_set_cq() do not have their callback invoked when they
+ * complete. They are added to the queue instead, to be collected in
+ * batches with libusb_cq_reap().
  *
- * This function behaves differently on Darwin-based systems (macOS and iOS):
+ * A context can have any number of completion queues, for instance one for
+ * every thread that consumes completions.
  *
- * - Calling this function for one transfer will cause all transfers on the
- *   same endpoint to be cancelled. Your callback function will be invoked with
- *   a transfer status of
- *   \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- *   "LIBUSB_TRANSFER_CANCELLED" for each transfer that was cancelled.
-
- * - When built for macOS versions prior to 10.5, this function sends a
- *   \c ClearFeature(ENDPOINT_HALT) request for the transfer's endpoint.
- *   (Prior to libusb 1.0.27, this request was sent on all Darwin systems.)
- *   If the device does not handle this request correctly, the data toggle
- *   bits for the endpoint can be left out of sync between host and device,
- *   which can have unpredictable results when the next data is sent on
- *   the endpoint, including data being silently lost. A call to
- *   \ref libusb_clear_halt will not resolve this situation, since that
- *   function uses the same request. Therefore, if your program runs on
- *   macOS < 10.5 (or libusb < 1.0.27), and uses a device that does not
- *   correctly implement \c ClearFeature(ENDPOINT_HALT) requests, it may
- *   only be safe to cancel transfers when followed by a device reset using
- *   \ref libusb_reset_device.
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
  *
- * \param transfer the transfer to cancel
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cq output location for the new completion queue. Only populated
+ * if the return code is 0.
  * \returns 0 on success
- * \returns \ref LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
- * already complete, or already cancelled.
- * \returns a LIBUSB_ERROR code on failure
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if cq is NULL
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_cq_destroy()
  */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+int API_EXPORTED libusb_cq_create(libusb_context *ctx,
+	libusb_completion_queue **cq)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r;
+	struct libusb_completion_queue *_cq;
 
-	usbi_dbg(ctx, "transfer %p", (void *) transfer );
-	usbi_mutex_lock(&itransfer->lock);
+	if (!cq)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_cq = calloc(1, sizeof(*_cq));
+	if (!_cq)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_cq->ctx = usbi_get_context(ctx);
+	usbi_mutex_init(&_cq->lock);
+	usbi_cond_init(&_cq->cond);
+	list_init(&_cq->transfers);
+
+	usbi_dbg(_cq->ctx, "completion queue %p", (void *) _cq);
+	*cq = _cq;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a completion queue. No transfer attached to the queue may be in
+ * flight, and no thread may be waiting in libusb_cq_reap(). Completed
+ * transfers that have not been reaped are detached from the queue and
+ * belong to the application again. Transfers that were reaped earlier
+ * still refer to the queue, they must be detached with
+ * libusb_transfer_set_cq() or freed before they are submitted again.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue to destroy. If NULL then this function
+ * simply returns.
+ */
+void API_EXPORTED libusb_cq_destroy(libusb_completion_queue *cq)
+{
+	struct usbi_transfer *itransfer, *tmp;
+
+	if (!cq)
+		return;
+
+	usbi_dbg(cq->ctx, "completion queue %p", (void *) cq);
+	list_for_each_entry_safe(itransfer, tmp, &cq->transfers, cq_list, struct usbi_transfer) {
+		list_del(&itransfer->cq_list);
+		itransfer->cq = NULL;
+	}
+	usbi_cond_destroy(&cq->cond);
+	usbi_mutex_destroy(&cq->lock);
+	free(cq);
+}
+
+/** \ingroup libusb_asyncio
+ * Attach a transfer to a completion queue, or detach it. Once the transfer
+ * completes it is added to the queue rather than having its callback
+ * invoked, and it belongs to the application again only after it has been
+ * returned by libusb_cq_reap(). Until then it must not be freed or
+ * resubmitted. It is not legal to change the completion queue of an active
+ * transfer.
+ *
+ * Such a transfer may not use the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" or
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_AUTO_RESUBMIT
+ * "LIBUSB_TRANSFER_AUTO_RESUBMIT" flags, and must be submitted on a device
+ * of the context of the queue.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to attach
+ * \param cq the completion queue, or NULL to have the callback of the
+ * transfer invoked again
+ */
+void API_EXPORTED libusb_transfer_set_cq(struct libusb_transfer *transfer,
+	libusb_completion_queue *cq)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->cq = cq;
+}
+
+/* Add a completed transfer to its completion queue. The transfer may be
+ * reaped, and thus freed or resubmitted, as soon as the queue lock is
+ * released, so the caller must not touch it afterwards. */
+void usbi_cq_push(struct usbi_transfer *itransfer)
+{
+	struct libusb_completion_queue *cq = itransfer->cq;
+
+	usbi_mutex_lock(&cq->lock);
+	list_add_tail(&itransfer->cq_list, &cq->transfers);
+	if (cq->waiters)
+		usbi_cond_broadcast(&cq->cond);
+	usbi_mutex_unlock(&cq->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Collect completed transfers from a completion queue, oldest first. The
+ * transfers returned have their \ref libusb_transfer::status "status" and
+ * \ref libusb_transfer::actual_length "actual_length" set as they would
+ * be in a callback, and belong to the application again.
+ *
+ * This function does not handle events, and does not take the events lock:
+ * another thread, or the calling thread in between calls, has to handle
+ * events for transfers to complete. It is safe to call it from any thread,
+ * and completion queues can be consumed by different threads concurrently.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue
+ * \param transfers output array for the completed transfers
+ * \param max the length of the transfers array
+ * \param tv maximum time to wait for a transfer to complete if the queue is
+ * empty. A NULL value indicates unlimited timeout, a zero timeout returns
+ * immediately.
+ * \returns the number of transfers stored in transfers, 0 if the timeout
+ * expired
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns \ref LIBUSB_ERROR_INTERRUPTED if the wait was interrupted by
+ * libusb_cq_interrupt()
+ */
+int API_EXPORTED libusb_cq_reap(libusb_completion_queue *cq,
+	struct libusb_transfer **transfers, int max, struct timeval *tv)
+{
+	struct usbi_transfer *itransfer;
+	int n = 0;
+
+	if (!cq || !transfers || max <= 0 || (tv && !TIMEVAL_IS_VALID(tv)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&cq->lock);
+	while (list_empty(&cq->transfers) && !cq->interrupted) {
+		int r = 0;
+
+		if (tv && !timerisset(tv))
+			break;
+
+		cq->waiters++;
+		if (tv)
+			r = usbi_cond_timedwait(&cq->cond, &cq->lock, tv);
+		else
+			usbi_cond_wait(&cq->cond, &cq->lock);
+		cq->waiters--;
+		if (r == LIBUSB_ERROR_TIMEOUT)
+			break;
+	}
+
+	if (list_empty(&cq->transfers) && cq->interrupted) {
+		cq->interrupted = 0;
+		usbi_mutex_unlock(&cq->lock);
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+
+	while (n < max && !list_empty(&cq->transfers)) {
+		itransfer = list_first_entry(&cq->transfers, struct usbi_transfer, cq_list);
+		list_del(&itransfer->cq_list);
+		transfers[n++] = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	}
+	usbi_mutex_unlock(&cq->lock);
+
+	return n;
+}
+
+/** \ingroup libusb_asyncio
+ * Interrupt a libusb_cq_reap() call waiting on a completion queue, for
+ * instance to stop the thread consuming it. If no thread is waiting, the
+ * next call that finds the queue empty returns right away instead.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue. If NULL then this function simply
+ * returns.
+ */
+void API_EXPORTED libusb_cq_interrupt(libusb_completion_queue *cq)
+{
+	if (!cq)
+		return;
+
+	usbi_mutex_lock(&cq->lock);
+	cq->interrupted = 1;
+	usbi_cond_broadcast(&cq->cond);
+	usbi_mutex_unlock(&cq->lock);
+}
+
+/* Helpers for the timeout heap. The heap is stored 0-based in
+ * dev_handle->timeout_heap, whereas usbi_transfer->timeout_heap_pos is
+ * 1-based so that a freshly allocated transfer is known not to be on the heap.
+ * NB: the flying_transfers_lock of the device handle must be held when
+ * calling these. */
+static inline int timeout_heap_before(struct usbi_transfer *a,
+	struct usbi_transfer *b)
+{
+	return TIMESPEC_CMP(&a->timeout, &b->timeout, <);
+}
+
+static inline void timeout_heap_set(struct libusb_device_handle *dev_handle,
+	unsigned int idx, struct usbi_transfer *itransfer)
+{
+	dev_handle->timeout_heap[idx] = itransfer;
+	itransfer->timeout_heap_pos = idx + 1;
+}
+
+static void timeout_heap_sift_up(struct libusb_device_handle *dev_handle,
+	unsigned int idx)
+{
+	struct usbi_transfer *itransfer = dev_handle->timeout_heap[idx];
+
+	while (idx > 0) {
+		unsigned int parent = (idx - 1) / 2;
+
+		if (!timeout_heap_before(itransfer, dev_handle->timeout_heap[parent]))
+			break;
+		timeout_heap_set(dev_handle, idx, dev_handle->timeout_heap[parent]);
+		idx = parent;
+	}
+	timeout_heap_set(dev_handle, idx, itransfer);
+}
+
+static void timeout_heap_sift_down(struct libusb_device_handle *dev_handle,
+	unsigned int idx)
+{
+	struct usbi_transfer *itransfer = dev_handle->timeout_heap[idx];
+	unsigned int len = dev_handle->timeout_heap_len;
+
+	while (2 * idx + 1 < len) {
+		unsigned int child = 2 * idx + 1;
+
+		if (child + 1 < len &&
+		    timeout_heap_before(dev_handle->timeout_heap[child + 1], dev_handle->timeout_heap[child]))
+			child++;
+		if (!timeout_heap_before(dev_handle->timeout_heap[child], itransfer))
+			break;
+		timeout_heap_set(dev_handle, idx, dev_handle->timeout_heap[child]);
+		idx = child;
+	}
+	timeout_heap_set(dev_handle, idx, itransfer);
+}
+
+static int timeout_heap_push(struct libusb_device_handle *dev_handle,
+	struct usbi_transfer *itransfer)
+{
+	if (dev_handle->timeout_heap_len == dev_handle->timeout_heap_size) {
+		unsigned int size = dev_handle->timeout_heap_size ? 2 * dev_handle->timeout_heap_size : 16;
+		struct usbi_transfer **heap;
+
+		heap = realloc(dev_handle->timeout_heap, size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		dev_handle->timeout_heap = heap;
+		dev_handle->timeout_heap_size = size;
+	}
+
+	dev_handle->timeout_heap[dev_handle->timeout_heap_len++] = itransfer;
+	timeout_heap_sift_up(dev_handle, dev_handle->timeout_heap_len - 1);
+	return 0;
+}
+
+static void timeout_heap_remove(struct libusb_device_handle *dev_handle,
+	struct usbi_transfer *itransfer)
+{
+	unsigned int idx = itransfer->timeout_heap_pos - 1;
+	struct usbi_transfer *last = dev_handle->timeout_heap[--dev_handle->timeout_heap_len];
+
+	itransfer->timeout_heap_pos = 0;
+	if (last == itransfer)
+		return;
+
+	/* move the last entry into the hole and restore the heap order */
+	dev_handle->timeout_heap[idx] = last;
+	if (idx > 0 && timeout_heap_before(last, dev_handle->timeout_heap[(idx - 1) / 2]))
+		timeout_heap_sift_up(dev_handle, idx);
+	else
+		timeout_heap_sift_down(dev_handle, idx);
+}
+
+/* returns the flying transfer of a device handle with the next upcoming
+ * timeout, or NULL if there is none. Transfers whose timeout has already
+ * been handled or is handled by the OS are dropped from the heap on the way.
+ * NB: the flying_transfers_lock of the device handle must be held when
+ * calling this. */
+static struct usbi_transfer *next_timeout_transfer(struct libusb_device_handle *dev_handle)
+{
+	while (dev_handle->timeout_heap_len) {
+		struct usbi_transfer *itransfer = dev_handle->timeout_heap[0];
+
+		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return itransfer;
+		timeout_heap_remove(dev_handle, itransfer);
+	}
+
+	return NULL;
+}
+
+/* lower earliest to deadline if that is set and comes first */
+static void earliest_deadline(struct timespec *earliest,
+	const struct timespec *deadline)
+{
+	if (TIMESPEC_IS_SET(deadline) &&
+	    (!TIMESPEC_IS_SET(earliest) || TIMESPEC_CMP(deadline, earliest, <)))
+		*earliest = *deadline;
+}
+
+#ifdef HAVE_OS_TIMER
+/* returns non-zero if the two deadlines are no further apart than the
+ * timer slack */
+static int within_timer_slack(struct libusb_context *ctx,
+	const struct timespec *a, const struct timespec *b)
+{
+	struct timespec diff;
+
+	if (TIMESPEC_CMP(a, b, <))
+		TIMESPEC_SUB(b, a, &diff);
+	else
+		TIMESPEC_SUB(a, b, &diff);
+
+	return !diff.tv_sec && diff.tv_nsec <= ctx->timer_slack_ns;
+}
+
+/* arms the timer for the given deadline, unless it is already armed for the
+ * same deadline give or take the timer slack.
+ * NB: timeout_lock must be held when calling this. */
+static int arm_timer(struct libusb_context *ctx, const struct timespec *deadline)
+{
+	int r;
+
+	if (TIMESPEC_IS_SET(&ctx->timer_deadline) &&
+	    within_timer_slack(ctx, &ctx->timer_deadline, deadline))
+		return 0;
+
+	r = usbi_arm_timer(&ctx->timer, deadline);
+	if (r)
+		return r;
+
+	ctx->timer_armed = 1;
+	ctx->timer_deadline = *deadline;
+	return 0;
+}
+
+/* rearms the timer based on the next deadline of the context.
+ * NB: timeout_lock must be held when calling this.
+ * returns 0 on success or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timer_for_next_timeout(struct libusb_context *ctx)
+{
+	int r;
+
+	if (!usbi_using_timer(ctx))
+		return 0;
+
+	if (TIMESPEC_IS_SET(&ctx->next_deadline))
+		return arm_timer(ctx, &ctx->next_deadline);
+
+	if (!ctx->timer_armed)
+		return 0;
+
+	usbi_dbg(ctx, "no timeouts, disarming timer");
+	r = usbi_disarm_timer(&ctx->timer);
+	if (r)
+		return r;
+
+	ctx->timer_armed = 0;
+	TIMESPEC_CLEAR(&ctx->timer_deadline);
+	return 0;
+}
+#else
+static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+	return 0;
+}
+#endif
+
+/* make sure the context wakes up for the next timeout of a device handle.
+ * Deadlines no earlier than the one the handle published last are already
+ * covered by the deadline of the context.
+ * NB: the flying_transfers_lock of the device handle must be held when
+ * calling this. */
+static int publish_deadline(struct libusb_device_handle *dev_handle,
+	const struct timespec *deadline)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int r = 0;
+
+	if (TIMESPEC_IS_SET(&dev_handle->published_deadline) &&
+	    !TIMESPEC_CMP(deadline, &dev_handle->published_deadline, <))
+		return 0;
+	dev_handle->published_deadline = *deadline;
+
+	usbi_mutex_lock(&ctx->timeout_lock);
+	if (ctx->scans_in_progress)
+		earliest_deadline(&ctx->scan_deadline, deadline);
+	if (!TIMESPEC_IS_SET(&ctx->next_deadline) ||
+	    TIMESPEC_CMP(deadline, &ctx->next_deadline, <)) {
+		ctx->next_deadline = *deadline;
+		r = arm_timer_for_next_timeout(ctx);
+	}
+	usbi_mutex_unlock(&ctx->timeout_lock);
+
+	return r;
+}
+
+/* add a transfer to the active transfers list of its device handle, and to
+ * the timeout heap if it has a timeout.
+ * This function will return non 0 if fails to update the timer,
+ * in which case the transfer is *not* on the flying_transfers list.
+ * NB: the flying_transfers_lock of the device handle MUST be held when
+ * calling this. */
+static int add_to_flying_list(struct usbi_transfer *itransfer,
+	const struct timespec *now)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct timespec *timeout = &itransfer->timeout;
+	int r;
+
+	calculate_timeout(itransfer, now);
+
+	list_add_tail(&itransfer->list, &dev_handle->flying_transfers);
+
+	/* transfers of infinite timeout are not tracked on the heap */
+	if (!TIMESPEC_IS_SET(timeout))
+		return 0;
+
+	r = timeout_heap_push(dev_handle, itransfer);
+	if (r)
+		goto err;
+
+	/* only a transfer that is first in line can move the deadline */
+	if (itransfer->timeout_heap_pos == 1) {
+		r = publish_deadline(dev_handle, timeout);
+		if (r) {
+			timeout_heap_remove(dev_handle, itransfer);
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	list_del(&itransfer->list);
+	return r;
+}
+
+/* the transfer memory budget held transfers have to fit in, 0 if transfers
+ * are never held */
+static size_t transfer_mem_budget(struct libusb_context *ctx)
+{
+	if (!usbi_atomic_load(&ctx->hold_transfers))
+		return 0;
+
+	return ctx->transfer_mem_budget ? ctx->transfer_mem_budget : ctx->os_transfer_mem_limit;
+}
+
+/* whether a transfer has to wait for earlier ones to complete before its
+ * buffer of size bytes fits the transfer memory budget. Nothing is held while
+ * no transfer is in flight, as there would be no completion to wait for.
+ * NB: transfer_mem_lock MUST be held when calling this. */
+static int must_hold_transfer(struct libusb_context *ctx, size_t size)
+{
+	size_t budget = transfer_mem_budget(ctx);
+
+	if (!budget || !ctx->transfer_mem_in_flight)
+		return 0;
+
+	return size > budget - MIN(budget, ctx->transfer_mem_in_flight) ||
+	       !list_empty(&ctx->held_transfers);
+}
+
+/* stop counting the buffer memory of a transfer that leaves the flying list,
+ * or take it off the held list if it never reached the backend. Held
+ * transfers that may fit now are submitted by the event handler. */
+static void release_transfer_mem(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+
+	if (!usbi_atomic_load(&ctx->hold_transfers))
+		return;
+
+	usbi_mutex_lock(&ctx->transfer_mem_lock);
+	if (itransfer->held) {
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->held = 0;
+		usbi_mutex_unlock(&itransfer->lock);
+		list_del(&itransfer->held_list);
+		goto out;
+	}
+
+	if (!itransfer->mem_charge)
+		goto out;
+
+	ctx->transfer_mem_in_flight -= itransfer->mem_charge;
+	itransfer->mem_charge = 0;
+
+	/* completions submit held transfers themselves */
+	if (!list_empty(&ctx->held_transfers) && !usbi_handling_events(ctx)) {
+		usbi_mutex_lock(&ctx->event_data_lock);
+		if (!ctx->event_flags)
+			usbi_signal_event(&ctx->event);
+		ctx->event_flags |= USBI_EVENT_HELD_TRANSFERS;
+		usbi_mutex_unlock(&ctx->event_data_lock);
+	}
+
+out:
+	usbi_mutex_unlock(&ctx->transfer_mem_lock);
+}
+
+/* remove a transfer from the active transfers list of its device handle.
+ * The deadline of the context is left alone, it is brought up to date once
+ * it has passed.
+ * NB: the flying_transfers_lock of the device handle MUST be held when
+ * calling this. */
+static void remove_from_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	list_del(&itransfer->list);
+	release_transfer_mem(itransfer);
+	if (itransfer->timeout_heap_pos)
+		timeout_heap_remove(transfer->dev_handle, itransfer);
+}
+
+/* remove a transfer whose device handle is being closed from the active
+ * transfers list.
+ * NB: the flying_transfers_lock of the device handle MUST be held when
+ * calling this. */
+void usbi_remove_flying_transfer(struct usbi_transfer *itransfer)
+{
+	remove_from_flying_list(itransfer);
+}
+
+/* validate the segments of a scatter-gather transfer and set the transfer
+ * length to their total length */
+static int prepare_iovec_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int length = 0;
+	int i;
+
+	if (!(usbi_backend.caps & USBI_CAP_SUPPORTS_BULK_IOVEC))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if ((transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+	     transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM) ||
+	    (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) ||
+	    itransfer->iov_count < 0 || !itransfer->iov)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < itransfer->iov_count; i++) {
+		int seg_len = itransfer->iov[i].length;
+
+		if (seg_len < 0 || seg_len > INT_MAX - length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		length += seg_len;
+	}
+
+	transfer->length = length;
+	return 0;
+}
+
+/* Checks and preparations done before any lock is taken when submitting a
+ * transfer */
+static int prepare_submission(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	assert(transfer->dev_handle);
+	if ((transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) && !itransfer->twin_buffer)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (itransfer->cq && ((transfer->flags &
+			(LIBUSB_TRANSFER_FREE_TRANSFER | LIBUSB_TRANSFER_AUTO_RESUBMIT)) ||
+			itransfer->cq->ctx != HANDLE_CTX(transfer->dev_handle)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (itransfer->iov_count && transfer->buffer) {
+		/* refilled with a buffer, e.g. by libusb_fill_bulk_transfer() */
+		itransfer->iov = NULL;
+		itransfer->iov_count = 0;
+	}
+	if (itransfer->iov_count) {
+		r = prepare_iovec_transfer(itransfer);
+		if (r < 0)
+			return r;
+	}
+
+	if (itransfer->dev)
+		libusb_unref_device(itransfer->dev);
+	itransfer->dev = libusb_ref_device(transfer->dev_handle->dev);
+
+	usbi_dbg(HANDLE_CTX(transfer->dev_handle), "transfer %p", (void *) transfer);
+	return 0;
+}
+
+/* take the locks queue_submission() needs for transfers of a device handle.
+ * Returns whether transfers may be held, which the caller passes on to
+ * queue_submission() and unlock_submission(), as the budget can be set
+ * meanwhile. */
+static int lock_submission(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int hold = (int)usbi_atomic_load(&ctx->hold_transfers);
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	if (hold)
+		usbi_mutex_lock(&ctx->transfer_mem_lock);
+	return hold;
+}
+
+static void unlock_submission(struct libusb_device_handle *dev_handle, int hold)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+
+	if (hold)
+		usbi_mutex_unlock(&ctx->transfer_mem_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+}
+
+/* Put a transfer on the flying list, see libusb_submit_transfer() for the
+ * locking. Returns 0 with itransfer->lock still held if the transfer is to
+ * be passed on to the backend with backend_submission(), 1 if it has been
+ * held back, or a LIBUSB_ERROR code.
+ * NB: the locks taken by lock_submission() MUST be held when calling this. */
+static int queue_submission(struct usbi_transfer *itransfer,
+	const struct timespec *now, int hold)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int r;
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+		usbi_mutex_unlock(&itransfer->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	itransfer->transferred = 0;
+	itransfer->state_flags = 0;
+	itransfer->timeout_flags = 0;
+	r = add_to_flying_list(itransfer, now);
+	if (r) {
+		usbi_mutex_unlock(&itransfer->lock);
+		return r;
+	}
+	if (!hold)
+		return 0;
+	if (must_hold_transfer(ctx, (size_t)transfer->length)) {
+		/* the transfer counts as in flight, its timeout included, but
+		 * only reaches the backend from submit_held_transfers() */
+		usbi_dbg(ctx, "holding transfer %p, %zu bytes in flight",
+			 (void *) transfer, ctx->transfer_mem_in_flight);
+		list_add_tail(&itransfer->held_list, &ctx->held_transfers);
+		itransfer->held = 1;
+		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		usbi_mutex_unlock(&itransfer->lock);
+		return 1;
+	}
+	itransfer->mem_charge = (size_t)transfer->length;
+	ctx->transfer_mem_in_flight += itransfer->mem_charge;
+	return 0;
+}
+
+/* Pass a transfer queued by queue_submission() on to the backend and release
+ * its lock. If this fails, the caller must remove the transfer from the
+ * flying list. */
+static int backend_submission(struct usbi_transfer *itransfer)
+{
+	int r;
+
+	r = usbi_backend.submit_transfer(itransfer);
+	if (r == LIBUSB_SUCCESS) {
+		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		/* a requested start frame only applies to one submission */
+		itransfer->iso_start_frame_set = 0;
+	}
+	usbi_mutex_unlock(&itransfer->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
+ * the operating system and/or hardware can support (see \ref asynclimits),
+ * or if \ref libusb_transfer_flags::LIBUSB_TRANSFER_AUTO_RESUBMIT
+ * "LIBUSB_TRANSFER_AUTO_RESUBMIT" is set without a twin buffer, or if the
+ * segments set with libusb_transfer_set_iovec() are invalid, or if the
+ * transfer cannot use the completion queue set with libusb_transfer_set_cq()
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_device_handle *dev_handle;
+	int hold, r;
+
+	r = prepare_submission(itransfer);
+	if (r < 0)
+		return r;
+
+	dev_handle = transfer->dev_handle;
+
+	/*
+	 * Important note on locking, this function takes / releases locks
+	 * in the following order:
+	 *  take flying_transfers_lock of the device handle
+	 *  (take transfer_mem_lock, if transfers may be held)
+	 *  take itransfer->lock
+	 *  clear transfer
+	 *  add to flying_transfers list
+	 *  release flying_transfers_lock (and transfer_mem_lock)
+	 *  submit transfer
+	 *  release itransfer->lock
+	 *  if submit failed:
+	 *   take flying_transfers_lock
+	 *   remove from flying_transfers list
+	 *   release flying_transfers_lock
+	 *
+	 * Note that it takes locks in the order a-b and then releases them
+	 * in the same order a-b. This is somewhat unusual but not wrong,
+	 * release order is not important as long as *all* locks are released
+	 * before re-acquiring any locks.
+	 *
+	 * This means that the ordering of first releasing itransfer->lock
+	 * and then re-acquiring the flying_transfers_list on error is
+	 * important and must not be changed!
+	 *
+	 * This is done this way because when we take both locks we must always
+	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
+	 * the timeout handling and usbi_handle_disconnect paths.
+	 *
+	 * And we cannot release itransfer->lock before the submission is
+	 * complete otherwise timeout handling for transfers with short
+	 * timeouts may run before submission.
+	 */
+	hold = lock_submission(dev_handle);
+	r = queue_submission(itransfer, NULL, hold);
+	/*
+	 * We must release the flying transfers lock here, because with
+	 * some backends the submit_transfer method is synchronous.
+	 */
+	unlock_submission(dev_handle, hold);
+	if (r)
+		return r < 0 ? r : LIBUSB_SUCCESS;
+
+	r = backend_submission(itransfer);
+	if (r != LIBUSB_SUCCESS) {
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		remove_from_flying_list(itransfer);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	}
+
+	return r;
+}
+
+/* The number of transfers libusb_submit_transfers() handles at once. This
+ * bounds the number of transfer locks held at the same time. */
+#define SUBMIT_BATCH_SIZE	64
+
+/* Submit transfers of the same device handle that passed
+ * prepare_submission(), following the same steps and locking as
+ * libusb_submit_transfer() */
+static int submit_handle_transfers(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer **transfers, int num_transfers, int *results,
+	const struct timespec *now)
+{
+	uint64_t backend_failed = 0;
+	int i, hold, submitted = 0;
+
+	hold = lock_submission(dev_handle);
+	for (i = 0; i < num_transfers; i++) {
+		if (results[i] == 0)
+			results[i] = queue_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]), now, hold);
+	}
+	unlock_submission(dev_handle, hold);
+
+	for (i = 0; i < num_transfers; i++) {
+		if (results[i] == 0) {
+			results[i] = backend_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+			if (results[i] != LIBUSB_SUCCESS)
+				backend_failed |= UINT64_C(1) << i;
+		} else if (results[i] == 1) {
+			results[i] = LIBUSB_SUCCESS;
+		}
+		if (results[i] == LIBUSB_SUCCESS)
+			submitted++;
+	}
+
+	if (backend_failed) {
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		for (i = 0; i < num_transfers; i++) {
+			if (backend_failed & (UINT64_C(1) << i))
+				remove_from_flying_list(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+		}
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+	}
+
+	return submitted;
+}
+
+/* Submit up to SUBMIT_BATCH_SIZE transfers. Transfers of the same device
+ * handle that are listed next to each other are queued under a single
+ * acquisition of its locks. */
+static int submit_transfer_batch(struct libusb_context *ctx,
+	struct libusb_transfer **transfers, int num_transfers, int *results)
+{
+	struct timespec now;
+	int i, j, submitted = 0;
+
+	for (i = 0; i < num_transfers; i++) {
+		/* queueing a transfer twice would take its lock twice */
+		for (j = 0; j < i; j++) {
+			if (transfers[j] == transfers[i])
+				break;
+		}
+		if (j < i)
+			results[i] = LIBUSB_ERROR_BUSY;
+		else
+			results[i] = prepare_submission(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+	}
+
+	/* all transfers of the batch count their timeout from the same time */
+	get_submit_time(ctx, &now);
+
+	/* the transfers of one device handle go to the backend before the
+	 * locks of the next one are taken */
+	for (i = 0; i < num_transfers; i = j) {
+		struct libusb_device_handle *dev_handle = transfers[i]->dev_handle;
+
+		for (j = i + 1; j < num_transfers && transfers[j]->dev_handle == dev_handle; j++)
+			;
+		submitted += submit_handle_transfers(dev_handle, transfers + i, j - i,
+			results + i, &now);
+	}
+
+	return submitted;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit several transfers at once. The effect is that of calling
+ * libusb_submit_transfer() on each transfer in turn, but consecutive
+ * transfers of the same device handle are put in flight under a single
+ * acquisition of libusb's internal locks, and are then passed on to the
+ * operating system back to back. All transfers count their timeouts from the
+ * same time. This makes priming an endpoint with many transfers cheaper.
+ *
+ * The transfers are independent of each other: one that fails to submit
+ * does not prevent the others from being submitted. The result of each
+ * submission is stored in results, if given.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfers the transfers to submit, which must all belong to the
+ * same context
+ * \param num_transfers the number of transfers
+ * \param results array of num_transfers entries receiving what
+ * libusb_submit_transfer() would have returned for each transfer, or NULL.
+ * A transfer listed twice fails with \ref LIBUSB_ERROR_BUSY the second time.
+ * \returns the number of transfers submitted
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if transfers is NULL, holds NULL
+ * pointers or transfers of different contexts, or if num_transfers is not
+ * positive. No transfer is submitted in that case.
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results)
+{
+	struct libusb_context *ctx;
+	int scratch[SUBMIT_BATCH_SIZE];
+	int i, n, submitted = 0;
+
+	if (!transfers || num_transfers <= 0 || !transfers[0] || !transfers[0]->dev_handle)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = HANDLE_CTX(transfers[0]->dev_handle);
+	for (i = 1; i < num_transfers; i++) {
+		if (!transfers[i] || !transfers[i]->dev_handle ||
+		    HANDLE_CTX(transfers[i]->dev_handle) != ctx)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_dbg(ctx, "%d transfers", num_transfers);
+	for (i = 0; i < num_transfers; i += n) {
+		n = MIN(num_transfers - i, SUBMIT_BATCH_SIZE);
+		submitted += submit_transfer_batch(ctx, transfers + i, n,
+			results ? results + i : scratch);
+	}
+
+	return submitted;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * This function behaves differently on Darwin-based systems (macOS and iOS):
+ *
+ * - Calling this function for one transfer will cause all transfers on the
+ *   same endpoint to be cancelled. Your callback function will be invoked with
+ *   a transfer status of
+ *   \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ *   "LIBUSB_TRANSFER_CANCELLED" for each transfer that was cancelled.
+
+ * - When built for macOS versions prior to 10.5, this function sends a
+ *   \c ClearFeature(ENDPOINT_HALT) request for the transfer's endpoint.
+ *   (Prior to libusb 1.0.27, this request was sent on all Darwin systems.)
+ *   If the device does not handle this request correctly, the data toggle
+ *   bits for the endpoint can be left out of sync between host and device,
+ *   which can have unpredictable results when the next data is sent on
+ *   the endpoint, including data being silently lost. A call to
+ *   \ref libusb_clear_halt will not resolve this situation, since that
+ *   function uses the same request. Therefore, if your program runs on
+ *   macOS < 10.5 (or libusb < 1.0.27), and uses a device that does not
+ *   correctly implement \c ClearFeature(ENDPOINT_HALT) requests, it may
+ *   only be safe to cancel transfers when followed by a device reset using
+ *   \ref libusb_reset_device.
+ *
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
+ * already complete, or already cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int r;
+
+	usbi_dbg(ctx, "transfer %p", (void *) transfer );
+	usbi_mutex_lock(&itransfer->lock);
 	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
 			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
 	}
-	r = usbi_backend.cancel_transfer(itransfer);
+	if (itransfer->held) {
+		/* the backend has not seen the transfer, so the event handler
+		 * completes it right away */
+		itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+		usbi_signal_transfer_completion(itransfer);
+		r = LIBUSB_SUCCESS;
+		goto out;
+	}
+	if (itransfer->stall_state != USBI_STALL_NONE) {
+		/* taken care of by the recovery from a stall of its
+		 * endpoint, which completes it as cancelled */
+		itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+		r = LIBUSB_SUCCESS;
+		goto out;
+	}
+	r = usbi_backend.cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ctx, "cancel transfer failed error %d", r);
+		else
+			usbi_dbg(ctx, "cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+
+out:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Set the twin buffer of a transfer. A transfer with the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_AUTO_RESUBMIT
+ * "LIBUSB_TRANSFER_AUTO_RESUBMIT" flag alternates between its buffer and the
+ * twin buffer, which must have room for \ref libusb_transfer::length
+ * "length" bytes as well. It is not legal to change the twin buffer of an
+ * active transfer.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to set the twin buffer for
+ * \param buffer the twin buffer, or NULL to clear it
+ */
+void API_EXPORTED libusb_transfer_set_twin_buffer(
+	struct libusb_transfer *transfer, unsigned char *buffer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->twin_buffer = buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Get the twin buffer of a transfer. Within the callback of a transfer that
+ * has been resubmitted automatically, this is the buffer now in flight while
+ * \ref libusb_transfer::buffer "buffer" holds the completed data.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to get the twin buffer for
+ * \returns the twin buffer, or NULL if there is none
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_transfer_get_twin_buffer(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->twin_buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Set the data segments of a scatter-gather bulk transfer. Instead of its
+ * \ref libusb_transfer::buffer "buffer", the transfer then sends data from,
+ * or receives data into, the segments in order, and its
+ * \ref libusb_transfer::length "length" is set to their total length on
+ * submission. The segment array and the buffers it points to must stay
+ * valid until the transfer has completed. Normally you would use
+ * libusb_fill_bulk_iovec_transfer() instead of calling this function
+ * directly.
+ *
+ * Setting segments clears the transfer buffer. Once a buffer is set again,
+ * for instance when the transfer is refilled with libusb_fill_bulk_transfer()
+ * or libusb_fill_interrupt_transfer(), the segments are dropped on the next
+ * submission. A transfer refilled without a buffer, such as a zero-length
+ * one, keeps its segments until they are cleared by calling this function
+ * with an \p iov_count of 0.
+ *
+ * Each segment is submitted as a separate request to the operating system.
+ * Every segment except the last one should therefore be a multiple of the
+ * endpoint's maximum packet size, otherwise the device sees a short packet
+ * where the segment ends.
+ *
+ * Scatter-gather transfers are only available where \ref libusb_has_capability
+ * "libusb_has_capability(LIBUSB_CAP_SUPPORTS_BULK_IOVEC)" is true; elsewhere
+ * submitting one fails with \ref LIBUSB_ERROR_NOT_SUPPORTED. They cannot be
+ * combined with \ref libusb_transfer_flags::LIBUSB_TRANSFER_AUTO_RESUBMIT
+ * "LIBUSB_TRANSFER_AUTO_RESUBMIT".
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to set the segments for
+ * \param iov array of data segments
+ * \param iov_count number of segments in \p iov, or 0 to go back to using
+ * the transfer buffer
+ */
+void API_EXPORTED libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int iov_count)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->iov = iov;
+	itransfer->iov_count = iov_count;
+	if (iov_count)
+		transfer->buffer = NULL;
+}
+
+/** \ingroup libusb_asyncio
+ * Schedule the next submission of an isochronous transfer on a given bus
+ * frame, rather than as soon as possible. This makes it possible to start a
+ * stream with a fixed latency, or to keep the streams of several endpoints
+ * in phase. The request only applies to the next successful submission of
+ * the transfer; later submissions are scheduled as soon as possible again,
+ * which on most platforms means right after the transfers already queued on
+ * the endpoint.
+ *
+ * Frame numbers are in the units of the host controller's frame counter,
+ * which depending on the platform and the bus speed counts frames or
+ * microframes. Use libusb_get_frame_number() where available, or the start
+ * frame reported back by libusb_transfer_get_iso_start_frame() for an earlier
+ * transfer, as a reference. Whether the frame can be honoured, and how far
+ * in the future it may lie, depends on the host controller; a frame that has
+ * already passed usually fails the transfer or its first packets. Platforms
+ * that cannot schedule on a given frame ignore the request.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the isochronous transfer to schedule
+ * \param start_frame the bus frame the transfer should start on
+ */
+void API_EXPORTED libusb_transfer_set_iso_start_frame(
+	struct libusb_transfer *transfer, uint64_t start_frame)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->iso_start_frame = start_frame;
+	itransfer->iso_start_frame_set = 1;
+}
+
+/** \ingroup libusb_asyncio
+ * Get the start frame of an isochronous transfer. Within the transfer
+ * callback, this is the bus frame the transfer actually started on, as
+ * reported by the operating system. Adding the number of frames the
+ * transfer covers gives the start frame for a transfer that is to follow
+ * it without a gap.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the isochronous transfer to get the start frame for
+ * \returns the start frame of the transfer
+ */
+uint64_t API_EXPORTED libusb_transfer_get_iso_start_frame(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->iso_start_frame;
+}
+
+/* Resubmit an auto-resubmitting transfer that has just completed into its
+ * twin buffer. On success, the buffer holding the completed data becomes the
+ * twin buffer and 0 is returned. On failure, the transfer is left as it was
+ * and the flag is cleared so that the callback can tell. */
+static int auto_resubmit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	unsigned char *completed = transfer->buffer;
+	int r;
+
+	transfer->buffer = itransfer->twin_buffer;
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		usbi_dbg(ITRANSFER_CTX(itransfer), "auto resubmission failed: %s",
+			 libusb_error_name(r));
+		transfer->buffer = completed;
+		transfer->flags &= (uint8_t)~LIBUSB_TRANSFER_AUTO_RESUBMIT;
+		return r;
+	}
+
+	itransfer->twin_buffer = completed;
+	return 0;
+}
+
+/* Pass held transfers on to the backend in the order they were submitted,
+ * for as long as they fit the transfer memory budget. Transfers the backend
+ * fails to submit are completed with an error, so this must only be called
+ * while handling events. */
+static void submit_held_transfers(struct libusb_context *ctx)
+{
+	usbi_mutex_lock(&ctx->transfer_mem_lock);
+
+	/* completing a failed transfer comes back here */
+	if (ctx->submitting_held) {
+		usbi_mutex_unlock(&ctx->transfer_mem_lock);
+		return;
+	}
+	ctx->submitting_held = 1;
+
+	while (1) {
+		struct usbi_transfer *itransfer = NULL, *cur;
+		struct libusb_transfer *transfer;
+		size_t budget = transfer_mem_budget(ctx);
+		int r;
+
+		/* cancelled transfers are completed by the event handler */
+		list_for_each_entry(cur, &ctx->held_transfers, held_list, struct usbi_transfer) {
+			usbi_mutex_lock(&cur->lock);
+			if (!(cur->state_flags & USBI_TRANSFER_CANCELLING)) {
+				itransfer = cur;
+				break;
+			}
+			usbi_mutex_unlock(&cur->lock);
+		}
+		if (!itransfer)
+			break;
+
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		if (budget && ctx->transfer_mem_in_flight &&
+		    (size_t)transfer->length > budget - MIN(budget, ctx->transfer_mem_in_flight)) {
+			usbi_mutex_unlock(&itransfer->lock);
+			break;
+		}
+
+		list_del(&itransfer->held_list);
+		itransfer->held = 0;
+		itransfer->mem_charge = (size_t)transfer->length;
+		ctx->transfer_mem_in_flight += itransfer->mem_charge;
+		usbi_mutex_unlock(&ctx->transfer_mem_lock);
+
+		usbi_dbg(ctx, "submitting held transfer %p", (void *) transfer);
+		r = usbi_backend.submit_transfer(itransfer);
+		if (r == LIBUSB_SUCCESS)
+			itransfer->iso_start_frame_set = 0;
+		usbi_mutex_unlock(&itransfer->lock);
+
+		if (r != LIBUSB_SUCCESS) {
+			usbi_dbg(ctx, "held transfer %p failed: %s",
+				 (void *) transfer, libusb_error_name(r));
+			usbi_handle_transfer_completion(itransfer,
+				r == LIBUSB_ERROR_NO_DEVICE ? LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR);
+		}
+
+		usbi_mutex_lock(&ctx->transfer_mem_lock);
+	}
+
+	ctx->submitting_held = 0;
+	usbi_mutex_unlock(&ctx->transfer_mem_lock);
+}
+
+/* Invoke the callback of a transfer that is no longer on the flying list,
+ * see usbi_handle_transfer_completion() */
+static void complete_transfer(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	unsigned char *in_flight_buffer = NULL;
+	uint8_t flags;
+
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	usbi_mutex_unlock(&itransfer->lock);
+	itransfer->stall_retries = 0;
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg(ctx, "interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	assert(transfer->actual_length >= 0);
+
+	/* resubmission does not touch status and actual_length, so the callback
+	 * still sees those of the completed transfer. It also gets the completed
+	 * buffer, the one in flight is put back once the callback returns. */
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+			&& auto_resubmit_transfer(itransfer) == 0) {
+		in_flight_buffer = transfer->buffer;
+		transfer->buffer = itransfer->twin_buffer;
+		itransfer->twin_buffer = in_flight_buffer;
+	}
+
+	/* the stream may go to the next command before the callback runs */
+	if (itransfer->stream_slot)
+		usbi_stream_manager_transfer_done(itransfer);
+
+	flags = transfer->flags;
+	if (itransfer->cq) {
+		/* reaping may free or resubmit the transfer, which neither
+		 * frees itself nor resubmits automatically */
+		usbi_dbg(ctx, "transfer %p to completion queue %p",
+			 (void *) transfer, (void *) itransfer->cq);
+		usbi_cq_push(itransfer);
+	} else {
+		usbi_dbg(ctx, "transfer %p has callback %p",
+			 (void *) transfer, transfer->callback);
+		if (transfer->callback) {
+			libusb_lock_event_waiters (ctx);
+			transfer->callback(transfer);
+			libusb_unlock_event_waiters(ctx);
+		}
+	}
+	if (usbi_atomic_load(&ctx->hold_transfers))
+		submit_held_transfers(ctx);
+	if (in_flight_buffer) {
+		/* the transfer is in flight again and must not have been freed */
+		itransfer->twin_buffer = transfer->buffer;
+		transfer->buffer = in_flight_buffer;
+		return;
+	}
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* The CLEAR_FEATURE(ENDPOINT_HALT) request of libusb_clear_halt_async() */
+struct clear_halt_request {
+	/* first, so that LIBUSB_TRANSFER_FREE_BUFFER frees the request */
+	unsigned char setup[LIBUSB_CONTROL_SETUP_SIZE];
+	unsigned char endpoint;
+	int reset_endpoint;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+};
+
+static void LIBUSB_CALL clear_halt_cb(struct libusb_transfer *transfer)
+{
+	struct clear_halt_request *req = transfer->user_data;
+
+	/* the device has reset its side of the endpoint, do the same here */
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && req->reset_endpoint) {
+		int r = usbi_backend.reset_endpoint(transfer->dev_handle, req->endpoint);
+
+		if (r < 0) {
+			usbi_dbg(TRANSFER_CTX(transfer), "resetting endpoint 0x%02x failed: %s",
+				 req->endpoint, libusb_error_name(r));
+			transfer->status = r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	transfer->callback = req->callback;
+	transfer->user_data = req->user_data;
+	if (transfer->callback)
+		transfer->callback(transfer);
+}
+
+/* Submit the request of libusb_clear_halt_async(). The transfer carrying it
+ * is stored through transfer_out, if not NULL, while it is in flight. The
+ * caller then resets the host side of the endpoint itself. */
+static int submit_clear_halt(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, libusb_transfer_cb_fn callback, void *user_data,
+	unsigned int timeout, struct libusb_transfer **transfer_out)
+{
+	struct libusb_transfer *transfer;
+	struct clear_halt_request *req;
+	int r;
+
+	if (!usbi_backend.reset_endpoint)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	req = malloc(sizeof(*req));
+	if (!req) {
+		libusb_free_transfer(transfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	req->endpoint = endpoint;
+	req->reset_endpoint = !transfer_out;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	libusb_fill_control_setup(req->setup,
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_ENDPOINT,
+		LIBUSB_REQUEST_CLEAR_FEATURE, 0 /* ENDPOINT_HALT */, endpoint, 0);
+	libusb_fill_control_transfer(transfer, dev_handle, req->setup,
+		clear_halt_cb, req, timeout);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	if (transfer_out)
+		*transfer_out = transfer;
+	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(ctx, "cancel transfer failed error %d", r);
-		else
-			usbi_dbg(ctx, "cancel transfer failed error %d", r);
+		if (transfer_out)
+			*transfer_out = NULL;
+		libusb_free_transfer(transfer);
+	}
+	return r;
+}
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+/** \ingroup libusb_asyncio
+ * Asynchronously clear the halt/stall condition for an endpoint. This is
+ * the asynchronous counterpart of libusb_clear_halt(): the CLEAR_FEATURE
+ * request is submitted as a control transfer, so transfers already queued on
+ * the endpoint do not have to be cancelled first, and the request goes out
+ * without waiting for them.
+ *
+ * Once the request has completed and the host side of the endpoint has been
+ * reset, the callback is invoked with a control transfer allocated by
+ * libusb. The request succeeded if its \ref libusb_transfer::status "status"
+ * is \ref LIBUSB_TRANSFER_COMPLETED. The transfer is freed when the
+ * callback returns, so the callback must not free or resubmit it.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the endpoint to clear halt status
+ * \param callback the function to invoke once the halt has been cleared
+ * \param user_data user data passed to the callback
+ * \param timeout timeout for the request in milliseconds, 0 for none
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the backend cannot reset the
+ * host side of an endpoint
+ * \returns another LIBUSB_ERROR code if submitting the request failed
+ * \see LIBUSB_TRANSFER_RECOVER_STALL
+ */
+int API_EXPORTED libusb_clear_halt_async(libusb_device_handle *dev_handle,
+	unsigned char endpoint, libusb_transfer_cb_fn callback, void *user_data,
+	unsigned int timeout)
+{
+	usbi_dbg(HANDLE_CTX(dev_handle), "endpoint 0x%x", endpoint);
+	return submit_clear_halt(dev_handle, endpoint, callback, user_data, timeout, NULL);
+}
+
+/* A LIBUSB_TRANSFER_RECOVER_STALL transfer that stalls this many times in a
+ * row completes with LIBUSB_TRANSFER_STALL */
+#define MAX_STALL_RETRIES	3
+
+/* Timeout of the request clearing the halt of an endpoint, in milliseconds */
+#define STALL_RECOVERY_TIMEOUT	1000
+
+/* The transfers that stalled on an endpoint, or were stopped to stay behind
+ * those, waiting for its halt to be cleared. The parked list is in the order
+ * the transfers are to be submitted again. */
+struct stall_recovery {
+	struct list_head list;
+	unsigned char endpoint;
+	struct list_head parked;
+
+	/* The request clearing the halt while it is in flight */
+	struct libusb_transfer *clear_halt;
+	enum libusb_transfer_status clear_status;
+
+	/* The request and the stopped transfers not back yet. Only changed by
+	 * the event handler */
+	int pending;
+};
+
+/* Submit the parked transfers of a recovery again once the halt has been
+ * cleared. The others are handed to the event handler to be completed: this
+ * may run from the callback of the request that cleared the halt, with the
+ * event waiters lock held, where their callbacks cannot be invoked.
+ * The host side of the endpoint is only reset here, once no transfer of the
+ * recovery is pending on it any more. */
+static void finish_stall_recovery(struct libusb_device_handle *dev_handle,
+	struct stall_recovery *recovery)
+{
+	enum libusb_transfer_status clear_status = recovery->clear_status;
+	struct usbi_transfer *itransfer, *tmp;
+
+	if (clear_status == LIBUSB_TRANSFER_COMPLETED) {
+		int r = usbi_backend.reset_endpoint(dev_handle, recovery->endpoint);
+
+		if (r < 0) {
+			usbi_dbg(HANDLE_CTX(dev_handle), "resetting endpoint 0x%02x failed: %s",
+				 recovery->endpoint, libusb_error_name(r));
+			clear_status = r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		}
 	}
 
-	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+	usbi_dbg(HANDLE_CTX(dev_handle), "endpoint 0x%02x, clear halt status %d",
+		 recovery->endpoint, clear_status);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_del(&recovery->list);
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	list_for_each_entry_safe(itransfer, tmp, &recovery->parked, stall_list, struct usbi_transfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		enum libusb_transfer_status status = LIBUSB_TRANSFER_STALL;
+
+		list_del(&itransfer->stall_list);
+		usbi_mutex_lock(&itransfer->lock);
+		if (itransfer->state_flags & USBI_TRANSFER_CANCELLING)
+			status = LIBUSB_TRANSFER_CANCELLED;
+		else if (clear_status == LIBUSB_TRANSFER_NO_DEVICE)
+			status = LIBUSB_TRANSFER_NO_DEVICE;
+
+		if (status == LIBUSB_TRANSFER_STALL && clear_status == LIBUSB_TRANSFER_COMPLETED) {
+			itransfer->stall_state = USBI_STALL_NONE;
+			itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+			usbi_mutex_unlock(&itransfer->lock);
+			if (libusb_submit_transfer(transfer) == 0)
+				continue;
+			usbi_mutex_lock(&itransfer->lock);
+		}
 
-out:
+		itransfer->stall_state = USBI_STALL_COMPLETING;
+		itransfer->stall_status = status;
+		usbi_mutex_unlock(&itransfer->lock);
+		usbi_signal_transfer_completion(itransfer);
+	}
+
+	free(recovery);
+}
+
+/* Complete a transfer taken off the list of a stall recovery. Only called by
+ * the event handler. */
+static void complete_parked_transfer(struct usbi_transfer *itransfer)
+{
+	enum libusb_transfer_status status;
+
+	usbi_mutex_lock(&itransfer->lock);
+	status = itransfer->stall_status;
+	if (itransfer->state_flags & USBI_TRANSFER_CANCELLING)
+		status = LIBUSB_TRANSFER_CANCELLED;
+	itransfer->stall_state = USBI_STALL_NONE;
 	usbi_mutex_unlock(&itransfer->lock);
-	return r;
+
+	complete_transfer(itransfer, status);
+}
+
+static void LIBUSB_CALL stall_recovery_cb(struct libusb_transfer *transfer)
+{
+	struct stall_recovery *recovery = transfer->user_data;
+
+	recovery->clear_halt = NULL;
+	recovery->clear_status = transfer->status;
+	if (!--recovery->pending)
+		finish_stall_recovery(transfer->dev_handle, recovery);
+}
+
+/* Find the stall recovery of an endpoint.
+ * NB: the lock of the device handle must be held when calling this. */
+static struct stall_recovery *find_stall_recovery(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	struct stall_recovery *recovery;
+
+	list_for_each_entry(recovery, &dev_handle->stall_recoveries, list, struct stall_recovery) {
+		if (recovery->endpoint == endpoint)
+			return recovery;
+	}
+
+	return NULL;
+}
+
+/* Take the LIBUSB_TRANSFER_RECOVER_STALL transfers queued on the endpoint of
+ * a new recovery back from the backend. The device would otherwise pass data
+ * to them before the ones that stalled are submitted again. They are parked
+ * in the order they were submitted, behind the transfer that stalled.
+ * This drains the endpoint, but without waiting for it: the CLEAR_FEATURE
+ * request goes out while the stopped transfers are on their way back.
+ * NB: the recovery must not be on the list of the device handle yet. */
+static void stop_stalled_endpoint(struct libusb_device_handle *dev_handle,
+	struct stall_recovery *recovery)
+{
+	struct usbi_transfer *itransfer;
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	for_each_handle_transfer(dev_handle, itransfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		if (transfer->endpoint != recovery->endpoint ||
+		    !(transfer->flags & LIBUSB_TRANSFER_RECOVER_STALL))
+			continue;
+
+		usbi_mutex_lock(&itransfer->lock);
+		if ((itransfer->state_flags & (USBI_TRANSFER_IN_FLIGHT | USBI_TRANSFER_CANCELLING)) ==
+				USBI_TRANSFER_IN_FLIGHT && !itransfer->held &&
+		    itransfer->stall_state == USBI_STALL_NONE &&
+		    usbi_backend.cancel_transfer(itransfer) == LIBUSB_SUCCESS) {
+			itransfer->stall_state = USBI_STALL_STOPPING;
+			list_add_tail(&itransfer->stall_list, &recovery->parked);
+			recovery->pending++;
+		}
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+}
+
+/* A transfer stopped by stop_stalled_endpoint() is back from the backend. It
+ * stays parked unless it was cancelled, timed out or moved data meanwhile. */
+static void stopped_transfer_done(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct stall_recovery *recovery;
+	int keep, last;
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (itransfer->state_flags & USBI_TRANSFER_CANCELLING) {
+		keep = 0;
+	} else {
+		keep = !itransfer->transferred &&
+			(status == LIBUSB_TRANSFER_CANCELLED || status == LIBUSB_TRANSFER_STALL);
+		/* cut short by the stall rather than by the application */
+		if (status == LIBUSB_TRANSFER_CANCELLED)
+			status = LIBUSB_TRANSFER_STALL;
+	}
+	itransfer->stall_state = keep ? USBI_STALL_PARKED : USBI_STALL_NONE;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	recovery = find_stall_recovery(dev_handle, transfer->endpoint);
+	if (!keep)
+		list_del(&itransfer->stall_list);
+	usbi_mutex_unlock(&dev_handle->lock);
+	assert(recovery);
+
+	last = !--recovery->pending;
+	if (!keep)
+		complete_transfer(itransfer, status);
+	if (last)
+		finish_stall_recovery(dev_handle, recovery);
+}
+
+/* Park a LIBUSB_TRANSFER_RECOVER_STALL transfer that has just stalled until
+ * the halt of its endpoint is cleared, and start clearing it unless that is
+ * already under way. Returns 0 if the transfer has been taken care of, in
+ * which case its callback must not be invoked here. */
+static int park_stalled_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct stall_recovery *recovery;
+	int r;
+
+	if ((transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+	     transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM &&
+	     transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT) ||
+	    !dev_handle || !usbi_backend.reset_endpoint ||
+	    itransfer->stall_retries >= MAX_STALL_RETRIES)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (itransfer->state_flags & USBI_TRANSFER_CANCELLING) {
+		usbi_mutex_unlock(&itransfer->lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	itransfer->stall_state = USBI_STALL_PARKED;
+	itransfer->stall_retries++;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	/* recoveries are only started by the event handler, so none can
+	 * appear for the endpoint between here and adding the new one */
+	usbi_mutex_lock(&dev_handle->lock);
+	recovery = find_stall_recovery(dev_handle, transfer->endpoint);
+	if (recovery)
+		list_add_tail(&itransfer->stall_list, &recovery->parked);
+	usbi_mutex_unlock(&dev_handle->lock);
+	if (recovery)
+		return 0;
+
+	recovery = malloc(sizeof(*recovery));
+	if (!recovery) {
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->stall_state = USBI_STALL_NONE;
+		usbi_mutex_unlock(&itransfer->lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	recovery->endpoint = transfer->endpoint;
+	recovery->clear_halt = NULL;
+	recovery->clear_status = LIBUSB_TRANSFER_ERROR;
+	recovery->pending = 1;
+	list_init(&recovery->parked);
+	list_add_tail(&itransfer->stall_list, &recovery->parked);
+	stop_stalled_endpoint(dev_handle, recovery);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_add_tail(&recovery->list, &dev_handle->stall_recoveries);
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	usbi_dbg(ITRANSFER_CTX(itransfer), "transfer %p stalled, clearing halt on endpoint 0x%02x, %d transfers stopped",
+		 (void *) transfer, recovery->endpoint, recovery->pending - 1);
+	r = submit_clear_halt(dev_handle, recovery->endpoint, stall_recovery_cb,
+		recovery, STALL_RECOVERY_TIMEOUT, &recovery->clear_halt);
+	if (r < 0 && !--recovery->pending)
+		finish_stall_recovery(dev_handle, recovery);
+	return 0;
+}
+
+/* Give up on the stall recoveries of a device handle that is being closed.
+ * The requests clearing the halts are dropped, and the parked transfers
+ * complete from the event handler with LIBUSB_TRANSFER_NO_DEVICE, or
+ * LIBUSB_TRANSFER_CANCELLED if they were cancelled.
+ * Called by do_close() with the events lock held. */
+void usbi_drop_stall_recoveries(struct libusb_device_handle *dev_handle)
+{
+	struct stall_recovery *recovery, *tmp;
+	struct usbi_transfer *itransfer, *itmp;
+	struct list_head recoveries;
+
+	list_init(&recoveries);
+	usbi_mutex_lock(&dev_handle->lock);
+	if (!list_empty(&dev_handle->stall_recoveries))
+		list_cut(&recoveries, &dev_handle->stall_recoveries);
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	list_for_each_entry_safe(recovery, tmp, &recoveries, list, struct stall_recovery) {
+		usbi_dbg(HANDLE_CTX(dev_handle), "dropping stall recovery of endpoint 0x%02x",
+			 recovery->endpoint);
+
+		if (recovery->clear_halt) {
+			usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+			remove_from_flying_list(LIBUSB_TRANSFER_TO_USBI_TRANSFER(recovery->clear_halt));
+			usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+			libusb_free_transfer(recovery->clear_halt);
+		}
+
+		list_for_each_entry_safe(itransfer, itmp, &recovery->parked, stall_list, struct usbi_transfer) {
+			list_del(&itransfer->stall_list);
+			if (itransfer->stall_state == USBI_STALL_STOPPING) {
+				usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+				remove_from_flying_list(itransfer);
+				usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+			}
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle = NULL;
+			usbi_mutex_lock(&itransfer->lock);
+			itransfer->stall_state = USBI_STALL_COMPLETING;
+			itransfer->stall_status = LIBUSB_TRANSFER_NO_DEVICE;
+			usbi_mutex_unlock(&itransfer->lock);
+			usbi_signal_transfer_completion(itransfer);
+		}
+
+		free(recovery);
+	}
+}
+
+/* Cancel the transfers of a device handle, all of them or only those on one
+ * endpoint. Returns the number of transfers being cancelled. */
+static int cancel_handle_transfers(struct libusb_device_handle *dev_handle,
+	int all_endpoints, unsigned char endpoint)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_transfer *itransfer;
+	struct stall_recovery *recovery;
+	int count = 0;
+
+	/* the same lock order as the timeout handling, which also cancels
+	 * transfers while walking the flying list */
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	for_each_handle_transfer(dev_handle, itransfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		if (!all_endpoints && transfer->endpoint != endpoint)
+			continue;
+		if (libusb_cancel_transfer(transfer) == LIBUSB_SUCCESS)
+			count++;
+	}
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+	/* transfers waiting for a halt to be cleared are not on the flying list */
+	usbi_mutex_lock(&dev_handle->lock);
+	list_for_each_entry(recovery, &dev_handle->stall_recoveries, list, struct stall_recovery) {
+		if (!all_endpoints && recovery->endpoint != endpoint)
+			continue;
+		list_for_each_entry(itransfer, &recovery->parked, stall_list, struct usbi_transfer) {
+			if (libusb_cancel_transfer(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)) == LIBUSB_SUCCESS)
+				count++;
+		}
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	usbi_dbg(ctx, "cancelling %d transfers", count);
+	return count;
 }
 
 /** \ingroup libusb_asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
+ * Asynchronously cancel all transfers in flight on an endpoint. This has the
+ * same effect as calling libusb_cancel_transfer() on each of them, but the
+ * transfers are found by libusb and cancelled in a single pass, so that the
+ * application does not need to keep track of them to shut a stream down.
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * The callback of each transfer is invoked as usual once its cancellation is
+ * complete. Transfers submitted while this function runs may or may not be
+ * cancelled.
  *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \returns the number of transfers being cancelled
+ * \see libusb_cancel_handle_transfers()
  */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+int API_EXPORTED libusb_cancel_endpoint_transfers(libusb_device_handle *dev_handle,
+	unsigned char endpoint)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-
-	itransfer->stream_id = stream_id;
+	usbi_dbg(HANDLE_CTX(dev_handle), "endpoint 0x%02x", endpoint);
+	return cancel_handle_transfers(dev_handle, 0, endpoint);
 }
 
 /** \ingroup libusb_asyncio
- * Get a transfers bulk stream id.
+ * Asynchronously cancel all transfers in flight on a device handle, on any
+ * endpoint. See libusb_cancel_endpoint_transfers().
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
  *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
+ * \param dev_handle a device handle
+ * \returns the number of transfers being cancelled
  */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+int API_EXPORTED libusb_cancel_handle_transfers(libusb_device_handle *dev_handle)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-
-	return itransfer->stream_id;
+	usbi_dbg(HANDLE_CTX(dev_handle), " ");
+	return cancel_handle_transfers(dev_handle, 1, 0);
 }
 
 /* Handle completion of a transfer (completion might be an error condition).
@@ -1680,53 +3516,38 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
  * data before calling it.
  * Do not call this function with the usbi_transfer lock held. User-specified
  * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
+ * will attempt to take the lock.
+ * Transfers with LIBUSB_TRANSFER_AUTO_RESUBMIT that completed successfully
+ * are resubmitted into their twin buffer before the callback is invoked.
+ * Transfers with LIBUSB_TRANSFER_RECOVER_STALL that stalled are parked until
+ * the halt of their endpoint is cleared. */
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	uint8_t flags;
-	int r;
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = remove_from_flying_list(itransfer);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (r < 0)
-		usbi_err(ctx, "failed to set timer for next timeout");
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	remove_from_flying_list(itransfer);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	usbi_mutex_unlock(&itransfer->lock);
+	if (transfer->flags & LIBUSB_TRANSFER_RECOVER_STALL) {
+		enum usbi_stall_state stall_state;
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg(ctx, "interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
+		usbi_mutex_lock(&itransfer->lock);
+		stall_state = itransfer->stall_state;
+		usbi_mutex_unlock(&itransfer->lock);
+		if (stall_state == USBI_STALL_STOPPING) {
+			stopped_transfer_done(itransfer, status);
+			return 0;
 		}
+		if (status == LIBUSB_TRANSFER_STALL && park_stalled_transfer(itransfer) == 0)
+			return 0;
 	}
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	assert(transfer->actual_length >= 0);
-	usbi_dbg(ctx, "transfer %p has callback %p",
-		 (void *) transfer, transfer->callback);
-	if (transfer->callback) {
-		libusb_lock_event_waiters (ctx);
-		transfer->callback(transfer);
-		libusb_unlock_event_waiters(ctx);
-	}
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	return r;
+	complete_transfer(itransfer, status);
+	return 0;
 }
 
 /* Similar to usbi_handle_transfer_completion() but exclusively for transfers
@@ -1738,11 +3559,13 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct libusb_device_handle *dev_handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
 	uint8_t timed_out;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 	timed_out = itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	/* if the URB was cancelled due to timeout, report timeout to the user */
 	if (timed_out) {
@@ -1754,24 +3577,52 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
+/* Push a completed transfer onto the completed_head stack of the context.
+ * The event is only signalled when the stack goes from empty to non-empty;
+ * one wakeup of the event handler then takes every transfer pushed so far.
+ * The backend's handle_transfer_completion() function will be called the
+ * next time an event handler runs. */
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 {
 	struct libusb_device *dev = itransfer->dev;
 
 	if (dev) {
 		struct libusb_context *ctx = DEVICE_CTX(dev);
-		unsigned int event_flags;
+		void *head = usbi_atomic_ptr_load(&ctx->completed_head);
 
-		usbi_mutex_lock(&ctx->event_data_lock);
-		event_flags = ctx->event_flags;
-		ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
-		list_add_tail(&itransfer->completed_list, &ctx->completed_transfers);
-		if (!event_flags)
+		do {
+			itransfer->completed_next = head;
+		} while (!usbi_atomic_ptr_cas(&ctx->completed_head, &head, itransfer));
+
+		if (!head)
 			usbi_signal_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+	}
+}
+
+/* Clear the event if there are no further pending events. A completed
+ * transfer pushed since the event was last handled signals it again, as
+ * its own signal may just have been cleared. Call with event_data_lock held. */
+void usbi_clear_event_if_idle(struct libusb_context *ctx)
+{
+	if (ctx->event_flags)
+		return;
+
+	usbi_clear_event(&ctx->event);
+	if (usbi_atomic_ptr_load(&ctx->completed_head))
+		usbi_signal_event(&ctx->event);
+}
+
+/* Move the transfers pushed onto completed_head to the tail of the
+ * completed_transfers list, restoring the order in which they completed.
+ * Only called by the event handler. */
+static void take_completed_transfers(struct libusb_context *ctx)
+{
+	struct usbi_transfer *itransfer = usbi_atomic_ptr_exchange(&ctx->completed_head, NULL);
+	struct list_head *tail = ctx->completed_transfers.prev;
+
+	while (itransfer) {
+		list_add(&itransfer->completed_list, tail);
+		itransfer = itransfer->completed_next;
 	}
 }
 
@@ -2045,7 +3896,8 @@ int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
 	return 0;
 }
 
-/* NB: flying_transfers_lock must be held when calling this */
+/* NB: the flying_transfers_lock of the device handle must be held when
+ * calling this */
 static void handle_timeout(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2061,52 +3913,97 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 			"async cancel failed %d", r);
 }
 
-/* NB: flying_transfers_lock must be held when calling this */
-static void handle_timeouts_locked(struct libusb_context *ctx)
+/* Walk the device handles to time out the transfers whose timeout is no
+ * later than systime, and make the earliest timeout left the next deadline
+ * of the context. Deadlines published by handles while this runs are
+ * collected in scan_deadline, so that they are not lost whether or not the
+ * walk had already passed their handle. */
+static void update_next_deadline(struct libusb_context *ctx,
+	const struct timespec *systime)
 {
-	struct timespec systime;
-	struct usbi_transfer *itransfer;
+	struct libusb_device_handle *dev_handle;
+	struct timespec next_deadline = { 0, 0 };
+	int r;
 
-	if (list_empty(&ctx->flying_transfers))
-		return;
+	usbi_mutex_lock(&ctx->timeout_lock);
+	if (!ctx->scans_in_progress++)
+		TIMESPEC_CLEAR(&ctx->scan_deadline);
+	usbi_mutex_unlock(&ctx->timeout_lock);
 
-	/* get current time */
-	usbi_get_monotonic_time(&systime);
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	for_each_open_device(ctx, dev_handle) {
+		struct usbi_transfer *itransfer;
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
+		/* pop transfers off the timeout heap until we reach one whose
+		 * timeout has not expired yet */
+		while ((itransfer = next_timeout_transfer(dev_handle))) {
+			if (TIMESPEC_CMP(&itransfer->timeout, systime, >))
+				break;
 
-		/* ignore timeouts we've already handled */
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+			/* otherwise, we've got an expired timeout to handle */
+			timeout_heap_remove(dev_handle, itransfer);
+			handle_timeout(itransfer);
+		}
 
-		/* if transfer has non-expired timeout, nothing more to do */
-		if (TIMESPEC_CMP(cur_ts, &systime, >))
-			return;
+		if (itransfer) {
+			dev_handle->published_deadline = itransfer->timeout;
+			earliest_deadline(&next_deadline, &itransfer->timeout);
+		} else {
+			TIMESPEC_CLEAR(&dev_handle->published_deadline);
+		}
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(itransfer);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	usbi_mutex_lock(&ctx->timeout_lock);
+	earliest_deadline(&next_deadline, &ctx->scan_deadline);
+	ctx->scans_in_progress--;
+	ctx->next_deadline = next_deadline;
+	r = arm_timer_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->timeout_lock);
+
+	if (r < 0)
+		usbi_err(ctx, "failed to set timer for next timeout");
 }
 
-static void handle_timeouts(struct libusb_context *ctx)
+/* Handle the expired timeouts, if the next deadline of the context has
+ * passed. Returns 1 if it had, 0 otherwise. */
+static int handle_timeouts(struct libusb_context *ctx)
 {
+	struct timespec systime;
+	int expired;
+
 	ctx = usbi_get_context(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	/* get current time, and treat timeouts that are due within the
+	 * timer slack as expired as well */
+	usbi_get_monotonic_time(&systime);
+	usbi_mutex_lock(&ctx->timeout_lock);
+	systime.tv_nsec += ctx->timer_slack_ns;
+	if (systime.tv_nsec >= NSEC_PER_SEC) {
+		++systime.tv_sec;
+		systime.tv_nsec -= NSEC_PER_SEC;
+	}
+
+	/* no timeout can have expired before the deadline of the context */
+	expired = TIMESPEC_IS_SET(&ctx->next_deadline) &&
+		  !TIMESPEC_CMP(&ctx->next_deadline, &systime, >);
+	usbi_mutex_unlock(&ctx->timeout_lock);
+
+	if (expired)
+		update_next_deadline(ctx, &systime);
+
+	return expired;
 }
 
 static int handle_event_trigger(struct libusb_context *ctx)
 {
 	struct list_head hotplug_msgs;
 	int hotplug_event = 0;
+	int held_transfers = 0;
 	int r = 0;
 
 	usbi_dbg(ctx, "event triggered");
@@ -2135,6 +4032,13 @@ static int handle_event_trigger(struct libusb_context *ctx)
 	if (ctx->event_flags & USBI_EVENT_DEVICE_CLOSE)
 		usbi_dbg(ctx, "someone is closing a device");
 
+	/* check if held transfers may fit the transfer memory budget */
+	if (ctx->event_flags & USBI_EVENT_HELD_TRANSFERS) {
+		usbi_dbg(ctx, "transfer memory was released");
+		ctx->event_flags &= ~USBI_EVENT_HELD_TRANSFERS;
+		held_transfers = 1;
+	}
+
 	/* check for any pending hotplug messages */
 	if (ctx->event_flags & USBI_EVENT_HOTPLUG_MSG_PENDING) {
 		usbi_dbg(ctx, "hotplug message received");
@@ -2144,17 +4048,38 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		list_cut(&hotplug_msgs, &ctx->hotplug_msgs);
 	}
 
+	/* if no further pending events, clear the event. Completed transfers
+	 * are taken after this, so that one pushed from now on either is
+	 * taken below or signals the event again */
+	if (!ctx->event_flags)
+		usbi_clear_event(&ctx->event);
+
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
 	/* complete any pending transfers */
-	if (ctx->event_flags & USBI_EVENT_TRANSFER_COMPLETED) {
+	take_completed_transfers(ctx);
+	if (!list_empty(&ctx->completed_transfers)) {
 		struct usbi_transfer *itransfer, *tmp;
-		struct list_head completed_transfers;
 
-		assert(!list_empty(&ctx->completed_transfers));
-		list_cut(&completed_transfers, &ctx->completed_transfers);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+		__for_each_completed_transfer_safe(&ctx->completed_transfers, itransfer, tmp) {
+			enum usbi_stall_state stall_state;
+			int held;
 
-		__for_each_completed_transfer_safe(&completed_transfers, itransfer, tmp) {
 			list_del(&itransfer->completed_list);
+			usbi_mutex_lock(&itransfer->lock);
+			held = itransfer->held;
+			stall_state = itransfer->stall_state;
+			usbi_mutex_unlock(&itransfer->lock);
+			if (held) {
+				/* cancelled before it reached the backend */
+				usbi_handle_transfer_cancellation(itransfer);
+				continue;
+			}
+			if (stall_state == USBI_STALL_COMPLETING) {
+				/* given up on by a stall recovery */
+				complete_parked_transfer(itransfer);
+				continue;
+			}
 			r = usbi_backend.handle_transfer_completion(itransfer);
 			if (r) {
 				usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
@@ -2162,20 +4087,13 @@ static int handle_event_trigger(struct libusb_context *ctx)
 			}
 		}
 
-		usbi_mutex_lock(&ctx->event_data_lock);
-		if (!list_empty(&completed_transfers)) {
-			/* an error occurred, put the remaining transfers back on the list */
-			list_splice_front(&completed_transfers, &ctx->completed_transfers);
-		} else if (list_empty(&ctx->completed_transfers)) {
-			ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
-		}
+		/* an error occurred, handle the remaining transfers next time */
+		if (!list_empty(&ctx->completed_transfers))
+			usbi_signal_event(&ctx->event);
 	}
 
-	/* if no further pending events, clear the event */
-	if (!ctx->event_flags)
-		usbi_clear_event(&ctx->event);
-
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	if (held_transfers)
+		submit_held_transfers(ctx);
 
 	/* process the hotplug events, if any */
 	if (hotplug_event)
@@ -2189,15 +4107,21 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	/* the timer has expired, so it has to be rearmed or disarmed even for
+	 * a deadline close to the one it was armed for */
+	usbi_mutex_lock(&ctx->timeout_lock);
+	TIMESPEC_CLEAR(&ctx->timer_deadline);
+	usbi_mutex_unlock(&ctx->timeout_lock);
 
-	/* process the timeout that just happened */
-	handle_timeouts_locked(ctx);
+	/* process the timeout that just happened, this arms the timer for
+	 * the next one */
+	if (handle_timeouts(ctx))
+		return 0;
 
-	/* arm for next timeout */
+	/* the deadline was lowered and has not passed yet */
+	usbi_mutex_lock(&ctx->timeout_lock);
 	r = arm_timer_for_next_timeout(ctx);
-
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeout_lock);
 
 	return r;
 }
@@ -2217,7 +4141,9 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 	/* only reallocate the event source data when the list of event sources has
 	 * been modified since the last handle_events(), otherwise reuse them to
-	 * save the additional overhead */
+	 * save the additional overhead. With an event set this only allocates
+	 * the buffer for ready events once, as the set itself is kept up to
+	 * date by usbi_add_event_source() and usbi_remove_event_source() */
 	usbi_mutex_lock(&ctx->event_data_lock);
 	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
 		usbi_dbg(ctx, "event sources modified, reallocating event data");
@@ -2236,8 +4162,7 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 		/* if no further pending events, clear the event so that we do
 		 * not immediately return from the wait function */
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
+		usbi_clear_event_if_idle(ctx);
 	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
@@ -2561,6 +4486,9 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
  * so you should call libusb_handle_events_timeout() or similar immediately.
  * A return code of 0 indicates that there are no pending timeouts.
  *
+ * The returned timeout may expire before any transfer actually times out,
+ * as it is only brought up to date once it has expired.
+ *
  * On some platforms, this function will always returns 0 (no pending
  * timeouts). See \ref polltime.
  *
@@ -2573,34 +4501,16 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *itransfer;
 	struct timespec systime;
-	struct timespec next_timeout = { 0, 0 };
+	struct timespec next_timeout;
 
 	ctx = usbi_get_context(ctx);
 	if (usbi_using_timer(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg(ctx, "no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	for_each_transfer(ctx, itransfer) {
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if we've reached transfers of infinite timeout, we're done looking */
-		if (!TIMESPEC_IS_SET(&itransfer->timeout))
-			break;
-
-		next_timeout = itransfer->timeout;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeout_lock);
+	next_timeout = ctx->next_deadline;
+	usbi_mutex_unlock(&ctx->timeout_lock);
 
 	if (!TIMESPEC_IS_SET(&next_timeout)) {
 		usbi_dbg(ctx, "no URB with timeout or all handled by OS; no timeout!");
@@ -2690,6 +4600,17 @@ int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle
 	ievent_source->data.os_handle = os_handle;
 	ievent_source->data.poll_events = poll_events;
 	usbi_mutex_lock(&ctx->event_data_lock);
+#ifdef HAVE_OS_EVENT_SET
+	if (usbi_using_event_set(ctx)) {
+		int r = usbi_event_set_add(&ctx->event_set, os_handle, poll_events);
+
+		if (r) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			free(ievent_source);
+			return r;
+		}
+	}
+#endif
 	list_add_tail(&ievent_source->list, &ctx->event_sources);
 	usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
@@ -2725,6 +4646,10 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 
 	list_del(&ievent_source->list);
 	list_add_tail(&ievent_source->list, &ctx->removed_event_sources);
+#ifdef HAVE_OS_EVENT_SET
+	if (usbi_using_event_set(ctx))
+		usbi_event_set_remove(&ctx->event_set, os_handle);
+#endif
 	usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
@@ -2835,20 +4760,20 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 
 	while (1) {
 		to_cancel = NULL;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		for_each_transfer(ctx, cur) {
-			struct libusb_transfer *cur_transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur);
-			if (cur_transfer->dev_handle == dev_handle) {
-				usbi_mutex_lock(&cur->lock);
-				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				usbi_mutex_unlock(&cur->lock);
-
-				if (to_cancel)
-					break;
-			}
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		for_each_handle_transfer(dev_handle, cur) {
+			usbi_mutex_lock(&cur->lock);
+			/* held transfers that were cancelled are already
+			 * queued for completion */
+			if ((cur->state_flags & USBI_TRANSFER_IN_FLIGHT) &&
+			    !(cur->held && (cur->state_flags & USBI_TRANSFER_CANCELLING)))
+				to_cancel = cur;
+			usbi_mutex_unlock(&cur->lock);
+
+			if (to_cancel)
+				break;
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 		if (!to_cancel)
 			break;
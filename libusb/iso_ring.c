@@ -0,0 +1,726 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Isochronous packet rings for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libusbi.h"
+
+#include <limits.h>
+#include <string.h>
+
+/**
+ * @defgroup libusb_iso_ring Isochronous rings
+ *
+ * This page documents libusb's isochronous ring API, which runs a
+ * continuous isochronous stream, such as audio or video, on behalf of the
+ * application.
+ *
+ * A ring keeps \p depth isochronous transfers of several packets each
+ * queued on an endpoint, and resubmits them as they complete. Instead of
+ * handling transfer callbacks, the application sees individual packets in a
+ * ring of \ref libusb_iso_ring_packet descriptors: libusb_iso_ring_peek()
+ * returns the packets available to it, and libusb_iso_ring_release() hands
+ * them back.
+ *
+ * For an IN endpoint, the available packets hold received data, along with
+ * the status of each packet and the time its transfer was reaped. For an OUT
+ * endpoint, they are free packets to fill, and releasing them queues them
+ * for sending. A transfer is submitted as soon as all of its packets have
+ * been queued.
+ *
+ * Packets are produced by transfer callbacks while the application handles
+ * events, and consumed by the application, possibly from another thread.
+ * Peeking at and releasing packets takes no lock; only when a release lets a
+ * transfer be submitted, which in steady state happens from the callbacks,
+ * does the releasing thread take the ring's lock to submit it.
+ *
+ * For an asynchronous OUT endpoint, libusb_iso_ring_set_feedback() has the
+ * ring follow the rate reported by the device's feedback endpoint, and
+ * suggest the length of each packet accordingly.
+ */
+
+struct iso_ring_slot {
+	struct libusb_iso_ring *ring;
+	struct libusb_transfer *transfer;
+};
+
+struct libusb_iso_ring {
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	int packet_size;
+	int packets_per_transfer;
+	int depth;
+
+	/* The packet data, from device memory if it could be had. Packet i
+	 * starts at offset i * packet_size */
+	unsigned char *buffer;
+	size_t buffer_size;
+	int buffer_is_dev_mem;
+
+	/* Slot s transfers packets s * packets_per_transfer onwards */
+	struct iso_ring_slot *slots;
+	int num_slots;
+
+	struct libusb_iso_ring_packet *packets;
+	int capacity;
+
+	/* Positions in the ring, counted in packets modulo 2 * capacity so
+	 * that a full ring can be told from an empty one. Packets from
+	 * device_pos up to submit_pos are in flight.
+	 * IN: packets from user_pos up to device_pos hold data for the user.
+	 * OUT: packets from submit_pos up to user_pos are queued for sending.
+	 * user_pos is only written by the user, device_pos only by transfer
+	 * callbacks, submit_pos only with the lock held. */
+	usbi_atomic_t user_pos;
+	usbi_atomic_t device_pos;
+	usbi_atomic_t submit_pos;
+
+	/* First error the ring ran into, stops all submissions */
+	usbi_atomic_t error;
+
+	/* Protects the fields below */
+	usbi_mutex_t lock;
+
+	int closing;
+
+	/* Set by libusb_iso_ring_close() once no transfer is in flight */
+	int drained;
+
+	struct libusb_iso_ring_stats stats;
+
+	/* OUT rate adaptation, see libusb_iso_ring_set_feedback() */
+	struct libusb_transfer *feedback_transfer;
+	int feedback_in_flight;
+	unsigned int frame_bytes;
+
+	/* Samples per packet in 16.16 fixed point, 0 without feedback */
+	usbi_atomic_t rate;
+
+	/* Only used by the user: the packets up to suggest_pos have their
+	 * length suggested, with the fraction of a sample carried over */
+	long suggest_pos;
+	uint32_t rate_remainder;
+};
+
+#define ISO_RING_IS_IN(ring)	IS_EPIN((ring)->endpoint)
+
+static int iso_ring_distance(const struct libusb_iso_ring *ring, long to, long from)
+{
+	long d = to - from;
+
+	return (int)(d < 0 ? d + 2L * ring->capacity : d);
+}
+
+static long iso_ring_advance(const struct libusb_iso_ring *ring, long pos, int n)
+{
+	pos += n;
+	return pos >= 2L * ring->capacity ? pos - 2L * ring->capacity : pos;
+}
+
+static int iso_ring_index(const struct libusb_iso_ring *ring, long pos)
+{
+	return (int)(pos >= ring->capacity ? pos - ring->capacity : pos);
+}
+
+static int iso_ring_transfer_error(struct libusb_iso_ring *ring,
+	enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(HANDLE_CTX(ring->dev_handle),
+			"unrecognised status code %d", status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+static uint64_t iso_ring_timestamp(void)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+/* Set up the packet lengths of an OUT transfer from what the user queued,
+ * moving the data of shortened packets together as libusb expects it */
+static void iso_ring_prepare_out(struct libusb_iso_ring *ring,
+	struct libusb_transfer *transfer, int first)
+{
+	unsigned char *data = transfer->buffer;
+	int i;
+
+	for (i = 0; i < ring->packets_per_transfer; i++) {
+		struct libusb_iso_ring_packet *packet = &ring->packets[first + i];
+
+		if (data != packet->buffer)
+			memmove(data, packet->buffer, packet->length);
+		transfer->iso_packet_desc[i].length = packet->length;
+		data += packet->length;
+	}
+	transfer->length = (int)(data - transfer->buffer);
+}
+
+/* Submit transfers in ring order until depth transfers are in flight or the
+ * next one cannot go yet. Called with the ring lock held. */
+static void iso_ring_submit_locked(struct libusb_iso_ring *ring)
+{
+	int n = ring->packets_per_transfer;
+
+	while (!usbi_atomic_load(&ring->error) && !ring->closing) {
+		long submit_pos = usbi_atomic_load(&ring->submit_pos);
+		long user_pos = usbi_atomic_load(&ring->user_pos);
+		int first = iso_ring_index(ring, submit_pos);
+		struct iso_ring_slot *slot = &ring->slots[first / n];
+		int r;
+
+		if (iso_ring_distance(ring, submit_pos, usbi_atomic_load(&ring->device_pos)) >=
+		    ring->depth * n)
+			break;
+
+		if (ISO_RING_IS_IN(ring)) {
+			/* the packets must have been consumed */
+			if (iso_ring_distance(ring, submit_pos, user_pos) + n > ring->capacity)
+				break;
+		} else {
+			/* all packets must have been queued */
+			if (iso_ring_distance(ring, user_pos, submit_pos) < n)
+				break;
+			iso_ring_prepare_out(ring, slot->transfer, first);
+		}
+
+		r = libusb_submit_transfer(slot->transfer);
+		if (r < 0) {
+			usbi_dbg(HANDLE_CTX(ring->dev_handle), "iso ring %p submit failed: %s",
+				 (void *) ring, libusb_error_name(r));
+			usbi_atomic_store(&ring->error, r);
+			break;
+		}
+
+		usbi_atomic_store(&ring->submit_pos, iso_ring_advance(ring, submit_pos, n));
+	}
+}
+
+static void iso_ring_check_drained_locked(struct libusb_iso_ring *ring)
+{
+	if (ring->closing && !ring->feedback_in_flight &&
+	    usbi_atomic_load(&ring->submit_pos) == usbi_atomic_load(&ring->device_pos))
+		ring->drained = 1;
+}
+
+static void LIBUSB_CALL iso_ring_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct iso_ring_slot *slot = transfer->user_data;
+	struct libusb_iso_ring *ring = slot->ring;
+	int n = ring->packets_per_transfer;
+	int first = (int)(slot - ring->slots) * n;
+	unsigned int packet_errors = 0;
+	long device_pos;
+	int i;
+
+	/* transfers on an endpoint complete in the order they were submitted,
+	 * so this one holds the packets at device_pos */
+	if (ISO_RING_IS_IN(ring)) {
+		uint64_t timestamp = iso_ring_timestamp();
+
+		for (i = 0; i < n; i++) {
+			struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+			struct libusb_iso_ring_packet *packet = &ring->packets[first + i];
+
+			packet->length = desc->actual_length;
+			packet->status = desc->status;
+			packet->timestamp = timestamp;
+			if (desc->status != LIBUSB_TRANSFER_COMPLETED)
+				packet_errors++;
+		}
+	}
+
+	usbi_mutex_lock(&ring->lock);
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		ring->stats.packets += (uint64_t)n;
+		ring->stats.packet_errors += packet_errors;
+	} else if (!ring->closing && !usbi_atomic_load(&ring->error)) {
+		int error = iso_ring_transfer_error(ring, transfer->status);
+
+		usbi_atomic_store(&ring->error, error);
+		usbi_dbg(HANDLE_CTX(ring->dev_handle), "iso ring %p stopped: %s",
+			 (void *) ring, libusb_error_name(error));
+	}
+
+	/* publishing the position hands the packets to the user */
+	device_pos = iso_ring_advance(ring, usbi_atomic_load(&ring->device_pos), n);
+	usbi_atomic_store(&ring->device_pos, device_pos);
+
+	iso_ring_submit_locked(ring);
+
+	if (usbi_atomic_load(&ring->submit_pos) == device_pos) {
+		if (ring->closing) {
+			iso_ring_check_drained_locked(ring);
+		} else if (!usbi_atomic_load(&ring->error)) {
+			if (ISO_RING_IS_IN(ring))
+				ring->stats.overruns++;
+			else
+				ring->stats.underruns++;
+		}
+	}
+	usbi_mutex_unlock(&ring->lock);
+}
+
+static void LIBUSB_CALL iso_ring_feedback_cb(struct libusb_transfer *transfer)
+{
+	struct libusb_iso_ring *ring = transfer->user_data;
+	struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[0];
+	const unsigned char *data = transfer->buffer;
+	uint32_t rate = 0;
+
+	/* full speed devices report 10.14 fixed point in three bytes, faster
+	 * ones 16.16 in four */
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+	    desc->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (desc->actual_length == 3)
+			rate = ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+				(uint32_t)data[2] << 16) << 2;
+		else if (desc->actual_length == 4)
+			rate = (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+			       (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+	}
+
+	usbi_mutex_lock(&ring->lock);
+	if (rate && rate <= INT32_MAX) {
+		usbi_atomic_store(&ring->rate, (long)rate);
+		ring->stats.feedback_rate = rate;
+	}
+
+	ring->feedback_in_flight = 0;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && !ring->closing) {
+		int r = libusb_submit_transfer(transfer);
+
+		if (r == 0)
+			ring->feedback_in_flight = 1;
+		else
+			usbi_dbg(HANDLE_CTX(ring->dev_handle), "iso ring %p feedback stopped: %s",
+				 (void *) ring, libusb_error_name(r));
+	} else if (!ring->closing) {
+		usbi_dbg(HANDLE_CTX(ring->dev_handle), "iso ring %p feedback stopped: status %d",
+			 (void *) ring, transfer->status);
+	}
+	iso_ring_check_drained_locked(ring);
+	usbi_mutex_unlock(&ring->lock);
+}
+
+static void iso_ring_free(struct libusb_iso_ring *ring)
+{
+	int i;
+
+	if (ring->slots) {
+		for (i = 0; i < ring->num_slots; i++)
+			libusb_free_transfer(ring->slots[i].transfer);
+		free(ring->slots);
+	}
+	libusb_free_transfer(ring->feedback_transfer);
+	free(ring->packets);
+
+	if (ring->buffer_is_dev_mem)
+		libusb_dev_mem_free(ring->dev_handle, ring->buffer, ring->buffer_size);
+	else
+		free(ring->buffer);
+
+	usbi_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+/** \ingroup libusb_iso_ring
+ * Open an isochronous ring on an endpoint. The packet buffers and all
+ * transfers are allocated up front. For an IN endpoint, \p depth transfers
+ * are submitted right away; for an OUT endpoint, transfers are submitted as
+ * packets are queued.
+ *
+ * The ring holds twice as many packets as there are in flight. Its buffers
+ * are taken from device memory (see libusb_dev_mem_alloc()) where available,
+ * and from the heap otherwise.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid isochronous endpoint
+ * \param packet_size the maximum length of each packet, usually the
+ * endpoint's maximum isochronous packet size
+ * \param packets_per_transfer the number of packets in each transfer
+ * \param depth the number of transfers to keep in flight
+ * \param ring output location for the new ring. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if submitting the first transfers
+ * failed
+ * \see libusb_iso_ring_close()
+ */
+int API_EXPORTED libusb_iso_ring_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int packet_size, int packets_per_transfer,
+	int depth, libusb_iso_ring **ring)
+{
+	struct libusb_iso_ring *_ring;
+	size_t transfer_bytes;
+	int i, r = 0;
+
+	if (!dev_handle || !ring || packet_size <= 0 || packets_per_transfer <= 0 ||
+	    depth <= 0 || depth > INT_MAX / 4 / packets_per_transfer ||
+	    (size_t)packet_size > INT_MAX / (size_t)packets_per_transfer)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	transfer_bytes = (size_t)packet_size * (size_t)packets_per_transfer;
+	if (transfer_bytes > SIZE_MAX / 2 / (size_t)depth)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_ring = calloc(1, sizeof(*_ring));
+	if (!_ring)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_ring->dev_handle = dev_handle;
+	_ring->endpoint = endpoint;
+	_ring->packet_size = packet_size;
+	_ring->packets_per_transfer = packets_per_transfer;
+	_ring->depth = depth;
+	_ring->num_slots = 2 * depth;
+	_ring->capacity = _ring->num_slots * packets_per_transfer;
+	usbi_mutex_init(&_ring->lock);
+
+	_ring->buffer_size = (size_t)_ring->num_slots * transfer_bytes;
+	_ring->buffer = libusb_dev_mem_alloc(dev_handle, _ring->buffer_size);
+	if (_ring->buffer)
+		_ring->buffer_is_dev_mem = 1;
+	else
+		_ring->buffer = malloc(_ring->buffer_size);
+
+	_ring->slots = calloc((size_t)_ring->num_slots, sizeof(*_ring->slots));
+	_ring->packets = calloc((size_t)_ring->capacity, sizeof(*_ring->packets));
+	if (!_ring->buffer || !_ring->slots || !_ring->packets) {
+		iso_ring_free(_ring);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < _ring->capacity; i++)
+		_ring->packets[i].buffer = _ring->buffer + (size_t)i * (size_t)packet_size;
+
+	for (i = 0; i < _ring->num_slots; i++) {
+		struct iso_ring_slot *slot = &_ring->slots[i];
+
+		slot->ring = _ring;
+		slot->transfer = libusb_alloc_transfer(packets_per_transfer);
+		if (!slot->transfer) {
+			iso_ring_free(_ring);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		libusb_fill_iso_transfer(slot->transfer, dev_handle, endpoint,
+			_ring->buffer + (size_t)i * transfer_bytes, (int)transfer_bytes,
+			packets_per_transfer, iso_ring_transfer_cb, slot, 0);
+		libusb_set_iso_packet_lengths(slot->transfer, (unsigned int)packet_size);
+	}
+
+	if (ISO_RING_IS_IN(_ring)) {
+		usbi_mutex_lock(&_ring->lock);
+		iso_ring_submit_locked(_ring);
+		if (!usbi_atomic_load(&_ring->submit_pos))
+			r = (int)usbi_atomic_load(&_ring->error);
+		usbi_mutex_unlock(&_ring->lock);
+	}
+
+	if (r < 0) {
+		iso_ring_free(_ring);
+		return r;
+	}
+
+	usbi_dbg(HANDLE_CTX(dev_handle), "iso ring %p on ep 0x%02x, %d transfers of %d x %d bytes%s",
+		 (void *) _ring, endpoint, depth, packets_per_transfer, packet_size,
+		 _ring->buffer_is_dev_mem ? " in device memory" : "");
+	*ring = _ring;
+	return 0;
+}
+
+/** \ingroup libusb_iso_ring
+ * Close an isochronous ring. Transfers still in flight are cancelled, and
+ * this function handles events until they have all completed, so it must not
+ * be called from a transfer callback. Packets that have not been transferred
+ * yet are discarded.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the ring to close. If NULL then this function simply returns.
+ */
+void API_EXPORTED libusb_iso_ring_close(libusb_iso_ring *ring)
+{
+	struct libusb_context *ctx;
+	long pos, submit_pos;
+	int r;
+
+	if (!ring)
+		return;
+
+	ctx = HANDLE_CTX(ring->dev_handle);
+	usbi_dbg(ctx, "iso ring %p", (void *) ring);
+
+	usbi_mutex_lock(&ring->lock);
+	ring->closing = 1;
+	submit_pos = usbi_atomic_load(&ring->submit_pos);
+	for (pos = usbi_atomic_load(&ring->device_pos); pos != submit_pos;
+	     pos = iso_ring_advance(ring, pos, ring->packets_per_transfer)) {
+		int slot = iso_ring_index(ring, pos) / ring->packets_per_transfer;
+
+		libusb_cancel_transfer(ring->slots[slot].transfer);
+	}
+	if (ring->feedback_in_flight)
+		libusb_cancel_transfer(ring->feedback_transfer);
+	iso_ring_check_drained_locked(ring);
+	usbi_mutex_unlock(&ring->lock);
+
+	while (!ring->drained) {
+		r = libusb_handle_events_completed(ctx, &ring->drained);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				 libusb_error_name(r));
+	}
+
+	iso_ring_free(ring);
+}
+
+/** \ingroup libusb_iso_ring
+ * Follow the rate of an asynchronous OUT endpoint. The ring keeps a transfer
+ * queued on the device's feedback endpoint, and from then on suggests the
+ * length of each OUT packet returned by libusb_iso_ring_peek() so that the
+ * device receives samples at the rate it reports.
+ *
+ * Until the first feedback value arrives, \p nominal_rate is used. Rates
+ * are in samples per packet in 16.16 fixed point, e.g. 0x300000 for 48 kHz
+ * audio with one packet per millisecond. Values in the 10.14 format that
+ * full speed devices report are converted.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring an OUT ring
+ * \param feedback_endpoint the address of the feedback endpoint
+ * \param nominal_rate the rate to start with, in samples per packet as 16.16
+ * fixed point
+ * \param frame_bytes the size of one sample frame in bytes, that is one
+ * sample for every channel
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if this is an IN ring, a parameter
+ * is out of range or feedback has already been set up
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if submitting the feedback transfer
+ * failed
+ */
+int API_EXPORTED libusb_iso_ring_set_feedback(libusb_iso_ring *ring,
+	unsigned char feedback_endpoint, uint32_t nominal_rate,
+	unsigned int frame_bytes)
+{
+	struct libusb_transfer *transfer;
+	int r;
+
+	if (ISO_RING_IS_IN(ring) || !IS_EPIN(feedback_endpoint) ||
+	    !nominal_rate || nominal_rate > INT32_MAX || !frame_bytes ||
+	    ring->feedback_transfer)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	transfer = libusb_alloc_transfer(1);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+	transfer->buffer = malloc(4);
+	if (!transfer->buffer) {
+		libusb_free_transfer(transfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	libusb_fill_iso_transfer(transfer, ring->dev_handle, feedback_endpoint,
+		transfer->buffer, 4, 1, iso_ring_feedback_cb, ring, 0);
+	libusb_set_iso_packet_lengths(transfer, 4);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	usbi_mutex_lock(&ring->lock);
+	ring->frame_bytes = frame_bytes;
+	ring->stats.feedback_rate = nominal_rate;
+	usbi_atomic_store(&ring->rate, (long)nominal_rate);
+	r = libusb_submit_transfer(transfer);
+	if (r == 0) {
+		ring->feedback_transfer = transfer;
+		ring->feedback_in_flight = 1;
+	} else {
+		usbi_atomic_store(&ring->rate, 0);
+	}
+	usbi_mutex_unlock(&ring->lock);
+
+	if (r < 0)
+		libusb_free_transfer(transfer);
+	return r;
+}
+
+/* the length an OUT packet should have to keep up with the feedback rate */
+static unsigned int iso_ring_suggest_length(struct libusb_iso_ring *ring)
+{
+	uint32_t rate = (uint32_t)usbi_atomic_load(&ring->rate);
+	uint32_t samples;
+
+	if (!rate)
+		return (unsigned int)ring->packet_size;
+
+	ring->rate_remainder += rate;
+	samples = ring->rate_remainder >> 16;
+	ring->rate_remainder &= 0xffff;
+
+	if (samples > (unsigned int)ring->packet_size / ring->frame_bytes)
+		samples = (unsigned int)ring->packet_size / ring->frame_bytes;
+	return samples * ring->frame_bytes;
+}
+
+/** \ingroup libusb_iso_ring
+ * Get the packets available to the user. For an IN ring, these are the
+ * oldest received packets that have not been released yet, each with its
+ * \ref libusb_iso_ring_packet::length "length",
+ * \ref libusb_iso_ring_packet::status "status" and
+ * \ref libusb_iso_ring_packet::timestamp "timestamp". For an OUT ring,
+ * these are free packets, each with a suggested
+ * \ref libusb_iso_ring_packet::length "length" that may be lowered after
+ * filling in the data.
+ *
+ * The packets are consecutive in memory and stay valid until they are
+ * passed to libusb_iso_ring_release(). When the ring wraps around, only the
+ * packets up to its end are returned, and another call returns the rest.
+ * A return value of 0 means that no packet is available right now, and that
+ * events need to be handled for the ring to make progress.
+ *
+ * This function does not block or take any lock. Only one thread at a time
+ * may use the user side of a ring.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the ring
+ * \param packets output location for the first available packet
+ * \returns the number of available packets, possibly 0
+ * \returns the LIBUSB_ERROR code the ring stopped with, once an IN ring has
+ * no more packets or an OUT ring has failed
+ */
+int API_EXPORTED libusb_iso_ring_peek(libusb_iso_ring *ring,
+	struct libusb_iso_ring_packet **packets)
+{
+	long user_pos = usbi_atomic_load(&ring->user_pos);
+	long device_pos = usbi_atomic_load(&ring->device_pos);
+	int error = (int)usbi_atomic_load(&ring->error);
+	int index = iso_ring_index(ring, user_pos);
+	int available;
+
+	if (ISO_RING_IS_IN(ring)) {
+		available = iso_ring_distance(ring, device_pos, user_pos);
+	} else {
+		if (error)
+			return error;
+		available = ring->capacity - iso_ring_distance(ring, user_pos, device_pos);
+	}
+
+	available = MIN(available, ring->capacity - index);
+	if (!available)
+		return error;
+
+	if (!ISO_RING_IS_IN(ring)) {
+		while (iso_ring_distance(ring, ring->suggest_pos, user_pos) < available) {
+			ring->packets[iso_ring_index(ring, ring->suggest_pos)].length =
+				iso_ring_suggest_length(ring);
+			ring->suggest_pos = iso_ring_advance(ring, ring->suggest_pos, 1);
+		}
+	}
+
+	*packets = &ring->packets[index];
+	return available;
+}
+
+/** \ingroup libusb_iso_ring
+ * Hand back the first \p count packets returned by libusb_iso_ring_peek().
+ * For an IN ring, their buffers are reused for later transfers. For an OUT
+ * ring, the packets are queued for sending with the lengths they have now,
+ * and a transfer is submitted once all its packets are queued.
+ *
+ * This function only takes the ring's lock when a transfer can be submitted
+ * as a result.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the ring
+ * \param count number of packets to release, at most the number returned by
+ * the last call to libusb_iso_ring_peek()
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if \p count is out of range, or
+ * an OUT packet is longer than the packet size
+ */
+int API_EXPORTED libusb_iso_ring_release(libusb_iso_ring *ring, int count)
+{
+	long user_pos = usbi_atomic_load(&ring->user_pos);
+	long device_pos = usbi_atomic_load(&ring->device_pos);
+	int index = iso_ring_index(ring, user_pos);
+	int available;
+	int i;
+
+	if (ISO_RING_IS_IN(ring))
+		available = iso_ring_distance(ring, device_pos, user_pos);
+	else
+		available = iso_ring_distance(ring, ring->suggest_pos, user_pos);
+
+	if (count < 0 || count > MIN(available, ring->capacity - index))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (!ISO_RING_IS_IN(ring)) {
+		for (i = 0; i < count; i++) {
+			if (ring->packets[index + i].length > (unsigned int)ring->packet_size)
+				return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	usbi_atomic_store(&ring->user_pos, iso_ring_advance(ring, user_pos, count));
+
+	/* in steady state, transfer callbacks do the submitting */
+	if (iso_ring_distance(ring, usbi_atomic_load(&ring->submit_pos),
+			usbi_atomic_load(&ring->device_pos)) < ring->depth * ring->packets_per_transfer) {
+		usbi_mutex_lock(&ring->lock);
+		iso_ring_submit_locked(ring);
+		usbi_mutex_unlock(&ring->lock);
+	}
+
+	return 0;
+}
+
+/** \ingroup libusb_iso_ring
+ * Get the statistics of an isochronous ring.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the ring
+ * \param stats output location for the statistics
+ */
+void API_EXPORTED libusb_iso_ring_get_stats(libusb_iso_ring *ring,
+	struct libusb_iso_ring_stats *stats)
+{
+	usbi_mutex_lock(&ring->lock);
+	*stats = ring->stats;
+	usbi_mutex_unlock(&ring->lock);
+}
@@ -166,9 +166,10 @@ typedef SSIZE_T ssize_t;
  * <li>libusb version 1.0.25: LIBUSB_API_VERSION = 0x01000109
  * <li>libusb version 1.0.26: LIBUSB_API_VERSION = 0x01000109
  * <li>libusb version 1.0.27: LIBUSB_API_VERSION = 0x0100010A
+ * <li>libusb version 1.0.29: LIBUSB_API_VERSION = 0x0100010B
  * </ul>
  */
-#define LIBUSB_API_VERSION 0x0100010A
+#define LIBUSB_API_VERSION 0x0100010B
 
 /** \def LIBUSBX_API_VERSION
  * \ingroup libusb_misc
@@ -1420,7 +1421,61 @@ enum libusb_transfer_flags {
 	 *
 	 * Available since libusb-1.0.9.
 	 */
-	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3)
+	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3),
+
+	/** Resubmit the transfer as soon as it completes successfully, before
+	 * the callback is invoked, so that the endpoint does not go idle while
+	 * the callback runs. The transfer alternates between its buffer and a
+	 * twin buffer set with libusb_transfer_set_twin_buffer(); the callback
+	 * sees \ref libusb_transfer::buffer "buffer" pointing to the data that
+	 * has just completed while the other buffer is in flight. Submitting
+	 * a transfer with this flag but without a twin buffer fails with
+	 * \ref LIBUSB_ERROR_INVALID_PARAM.
+	 *
+	 * As the transfer is already in flight again, the callback must not
+	 * resubmit, free or modify it, other than cancelling it with
+	 * libusb_cancel_transfer() to end the cycle. Transfers that complete
+	 * with any other status than \ref LIBUSB_TRANSFER_COMPLETED are not
+	 * resubmitted. If the resubmission fails, this flag is cleared from
+	 * \ref libusb_transfer::flags "flags" before the callback is invoked.
+	 *
+	 * With \ref LIBUSB_TRANSFER_FREE_BUFFER, the twin buffer is freed
+	 * along with the transfer buffer.
+	 *
+	 * Available since libusb-1.0.29.
+	 */
+	LIBUSB_TRANSFER_AUTO_RESUBMIT = (1U << 4),
+
+	/** Recover from a stall of the endpoint rather than completing with
+	 * \ref LIBUSB_TRANSFER_STALL. When the transfer stalls, libusb clears
+	 * the halt of the endpoint with libusb_clear_halt_async() and submits
+	 * the transfer again once the halt is cleared, without invoking the
+	 * callback in between. Transfers with this flag that are queued behind
+	 * it on the same endpoint are taken back before the halt is cleared,
+	 * and are submitted again along with it in the order they were
+	 * submitted, so that the data keeps its order. The same goes for those
+	 * that stall on the endpoint while its halt is being cleared. Transfers
+	 * without this flag are left alone.
+	 *
+	 * This still drains the endpoint queue, only inside libusb: the
+	 * transfers queued behind the one that stalled are submitted again only
+	 * once all of them are back from the backend. What is saved compared to
+	 * doing it in the application is that the CLEAR_FEATURE request goes
+	 * out at once, while they are being taken back, and that no callback
+	 * is invoked. Leaving them in flight instead is not possible without
+	 * reordering the data, since a transfer cannot be queued ahead of them
+	 * again, and some host controllers refuse to reset an endpoint with
+	 * transfers pending on it.
+	 *
+	 * The callback is invoked with \ref LIBUSB_TRANSFER_STALL if the halt
+	 * cannot be cleared or if the transfer stalls three times in a row.
+	 * A transfer waiting for the halt to be cleared is still in flight and
+	 * can be cancelled as usual. Only applies to bulk, bulk stream and
+	 * interrupt transfers.
+	 *
+	 * Available since libusb-1.0.29.
+	 */
+	LIBUSB_TRANSFER_RECOVER_STALL = (1U << 5)
 };
 
 /** \ingroup libusb_asyncio
@@ -1436,6 +1491,20 @@ struct libusb_iso_packet_descriptor {
 	enum libusb_transfer_status status;
 };
 
+/** \ingroup libusb_asyncio
+ * Segment of a scatter-gather bulk transfer, see
+ * libusb_fill_bulk_iovec_transfer().
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_iovec {
+	/** Data buffer of this segment */
+	unsigned char *buffer;
+
+	/** Length of the data buffer. Must be non-negative. */
+	int length;
+};
+
 struct libusb_transfer;
 
 /** \ingroup libusb_asyncio
@@ -1536,7 +1605,12 @@ enum libusb_capability {
 
 	/** The library supports detaching of the default USB driver, using
 	 * \ref libusb_detach_kernel_driver(), if one is set by the OS kernel */
-	LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER = 0x0101U
+	LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER = 0x0101U,
+
+	/** The library supports scatter-gather bulk transfers, see
+	 * \ref libusb_fill_bulk_iovec_transfer().
+	 * Available since libusb-1.0.29. */
+	LIBUSB_CAP_SUPPORTS_BULK_IOVEC = 0x0102U
 };
 
 /** \ingroup libusb_lib
@@ -1644,7 +1718,96 @@ enum libusb_option {
 	 */
 	LIBUSB_OPTION_LOG_CB = 3,
 
-	LIBUSB_OPTION_MAX = 4
+	/** Perform synchronous transfers with blocking system calls
+	 *
+	 * With this option set, libusb_control_transfer(), libusb_bulk_transfer()
+	 * and libusb_interrupt_transfer() issue a single blocking request to the
+	 * operating system instead of submitting an asynchronous transfer and
+	 * running the event loop until it completes. This saves several system
+	 * calls and the event lock round trip per request.
+	 *
+	 * Requests the operating system cannot perform this way, such as bulk
+	 * transfers larger than it accepts in one piece, silently use the
+	 * asynchronous path. So do bulk and interrupt transfers with a timeout
+	 * that are longer than one packet of the endpoint: the operating system
+	 * does not report how much data was transferred before the timeout
+	 * expired, which is only known to be none for a single packet. Short
+	 * request and response messages therefore take the direct path with
+	 * their timeout, long reads and writes with a timeout do not. Note that
+	 * a blocked request is not visible to libusb_handle_events() and
+	 * friends.
+	 *
+	 * This option takes no argument and cannot be unset.
+	 *
+	 * Only valid on Linux. Returns \ref LIBUSB_ERROR_NOT_SUPPORTED on all
+	 * other platforms.
+	 *
+	 * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS = 4,
+
+	/** Set the tolerance for transfer timeouts, in nanoseconds
+	 *
+	 * This option must be provided an argument of type int, between 0 and
+	 * 999999999. Transfer timeouts may then expire up to this much earlier or
+	 * later than requested, which lets libusb handle timeouts that are close
+	 * together in one go and skip reprogramming the timer it uses to track
+	 * them. When the tolerance covers the resolution of a cheaper, coarse
+	 * system clock, that clock is also used to compute transfer deadlines
+	 * on submission.
+	 *
+	 * The default is 0, meaning that timeouts are handled as precisely as
+	 * the platform allows. The slack can be changed at any time, it applies
+	 * to the timeouts handled from then on.
+	 *
+	 * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_TIMER_SLACK_NS = 5,
+
+	/** Set the maximum number of completed transfers reaped from one device
+	 * per round of event handling
+	 *
+	 * This option must be provided an argument of type int. libusb adapts
+	 * the number of completions it collects from each ready device to the
+	 * rate the device completes transfers at, serving ready devices in turn
+	 * so that a busy device cannot hold up the others. This option sets the
+	 * upper bound of that budget. A value of 0 restores the default.
+	 * libusb_get_device_handle_stats() reports how often a device still had
+	 * completions left when its budget ran out.
+	 *
+	 * Only valid on Linux. Returns \ref LIBUSB_ERROR_NOT_SUPPORTED on all
+	 * other platforms.
+	 *
+	 * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_REAP_BUDGET = 6,
+
+	/** Hold back transfers that would exceed a budget of buffer memory
+	 *
+	 * This option must be provided an argument of type int, the budget in
+	 * bytes. libusb keeps track of the buffer memory of the transfers in
+	 * flight in a context. With this option set, a transfer that would
+	 * take it over the budget is accepted by libusb_submit_transfer(), but
+	 * only passed on to the operating system once earlier transfers have
+	 * completed and made room for it. Transfers are passed on in the order
+	 * they were submitted, and a transfer is never held while nothing is in
+	 * flight, so one larger than the whole budget still goes through.
+	 *
+	 * A held transfer can be cancelled and times out like any other. A
+	 * value of 0 selects the limit the operating system imposes, such as
+	 * the usbfs_memory_mb parameter of Linux, beyond which submissions
+	 * would otherwise fail. Where there is no such limit, no transfer is
+	 * held.
+	 *
+	 * This option cannot be unset. It can be set or changed at any time,
+	 * transfers already in flight when it is first set are not counted
+	 * against the budget.
+	 *
+	 * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_TRANSFER_MEM_BUDGET = 7,
+
+	LIBUSB_OPTION_MAX = 8
 };
 
 /** \ingroup libusb_lib
@@ -1784,8 +1947,26 @@ int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev_handl
 	int interface_number, int alternate_setting);
 int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev_handle,
 	unsigned char endpoint);
+int LIBUSB_CALL libusb_get_frame_number(libusb_device_handle *dev_handle,
+	uint64_t *frame_number);
 int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev_handle);
 
+/** \ingroup libusb_dev
+ * Statistics of a device handle, as returned by
+ * libusb_get_device_handle_stats().
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_device_handle_stats {
+	/** Number of times event handling moved on to other devices while
+	 * this one still had completed transfers to reap, because its reap
+	 * budget was used up. See \ref LIBUSB_OPTION_REAP_BUDGET. */
+	unsigned long reap_budget_exhausted;
+};
+
+void LIBUSB_CALL libusb_get_device_handle_stats(libusb_device_handle *dev_handle,
+	struct libusb_device_handle_stats *stats);
+
 int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev_handle,
 	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
 int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev_handle,
@@ -1796,6 +1977,157 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length);
 
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of transfer buffers carved from one block
+ * of device memory. This is an opaque type for which you are only ever
+ * provided with a pointer, originating from libusb_buffer_pool_create().
+ */
+typedef struct libusb_buffer_pool libusb_buffer_pool;
+
+int LIBUSB_CALL libusb_buffer_pool_create(libusb_device_handle *dev_handle,
+	size_t size, libusb_buffer_pool **pool);
+void LIBUSB_CALL libusb_buffer_pool_destroy(libusb_buffer_pool *pool);
+unsigned char * LIBUSB_CALL libusb_buffer_pool_alloc(libusb_buffer_pool *pool,
+	size_t length);
+void LIBUSB_CALL libusb_buffer_pool_free(libusb_buffer_pool *pool,
+	unsigned char *buffer);
+int LIBUSB_CALL libusb_buffer_pool_is_dev_mem(libusb_buffer_pool *pool,
+	const unsigned char *buffer);
+
+/** \ingroup libusb_stream
+ * Structure representing a continuous stream of data through a bulk
+ * endpoint. This is an opaque type for which you are only ever provided
+ * with a pointer, originating from libusb_stream_open().
+ */
+typedef struct libusb_stream libusb_stream;
+
+/** \ingroup libusb_stream
+ * Statistics of a stream, as returned by libusb_stream_get_stats().
+ */
+struct libusb_stream_stats {
+	/** Number of bytes transferred over the endpoint */
+	uint64_t bytes_transferred;
+
+	/** Number of times an IN endpoint was left without a transfer in
+	 * flight because the ring was full of data not consumed yet */
+	unsigned int overruns;
+
+	/** Number of times an OUT endpoint was left without a transfer in
+	 * flight because no data was queued */
+	unsigned int underruns;
+};
+
+int LIBUSB_CALL libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int transfer_size, int depth,
+	libusb_stream **stream);
+void LIBUSB_CALL libusb_stream_close(libusb_stream *stream);
+int LIBUSB_CALL libusb_stream_acquire(libusb_stream *stream,
+	unsigned char **data);
+int LIBUSB_CALL libusb_stream_commit(libusb_stream *stream, int length);
+int LIBUSB_CALL libusb_stream_flush(libusb_stream *stream);
+void LIBUSB_CALL libusb_stream_get_stats(libusb_stream *stream,
+	struct libusb_stream_stats *stats);
+
+/** \ingroup libusb_iso_ring
+ * Structure representing a ring of isochronous packets kept flowing through
+ * an endpoint. This is an opaque type for which you are only ever provided
+ * with a pointer, originating from libusb_iso_ring_open().
+ */
+typedef struct libusb_iso_ring libusb_iso_ring;
+
+/** \ingroup libusb_iso_ring
+ * A packet in an isochronous ring, as returned by libusb_iso_ring_peek().
+ */
+struct libusb_iso_ring_packet {
+	/** Packet data. Room for the ring's packet size is always available */
+	unsigned char *buffer;
+
+	/** IN: amount of data received. OUT: amount of data to send, set to
+	 * a suggested length by libusb_iso_ring_peek() */
+	unsigned int length;
+
+	/** IN: status code of this packet */
+	enum libusb_transfer_status status;
+
+	/** IN: time the transfer holding this packet was reaped, in
+	 * nanoseconds of a monotonic clock */
+	uint64_t timestamp;
+};
+
+/** \ingroup libusb_iso_ring
+ * Statistics of an isochronous ring, as returned by
+ * libusb_iso_ring_get_stats().
+ */
+struct libusb_iso_ring_stats {
+	/** Number of packets transferred */
+	uint64_t packets;
+
+	/** Number of IN packets received with a status other than
+	 * \ref LIBUSB_TRANSFER_COMPLETED */
+	unsigned int packet_errors;
+
+	/** Number of times an IN endpoint was left without a transfer in
+	 * flight because the ring was full of packets not released yet */
+	unsigned int overruns;
+
+	/** Number of times an OUT endpoint was left without a transfer in
+	 * flight because no packets were queued */
+	unsigned int underruns;
+
+	/** Last rate reported by the feedback endpoint, in samples per packet
+	 * as 16.16 fixed point, see libusb_iso_ring_set_feedback() */
+	uint32_t feedback_rate;
+};
+
+int LIBUSB_CALL libusb_iso_ring_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int packet_size, int packets_per_transfer,
+	int depth, libusb_iso_ring **ring);
+void LIBUSB_CALL libusb_iso_ring_close(libusb_iso_ring *ring);
+int LIBUSB_CALL libusb_iso_ring_set_feedback(libusb_iso_ring *ring,
+	unsigned char feedback_endpoint, uint32_t nominal_rate,
+	unsigned int frame_bytes);
+int LIBUSB_CALL libusb_iso_ring_peek(libusb_iso_ring *ring,
+	struct libusb_iso_ring_packet **packets);
+int LIBUSB_CALL libusb_iso_ring_release(libusb_iso_ring *ring, int count);
+void LIBUSB_CALL libusb_iso_ring_get_stats(libusb_iso_ring *ring,
+	struct libusb_iso_ring_stats *stats);
+
+/** \ingroup libusb_stream_manager
+ * Structure representing a set of USB 3 bulk streams handed out to
+ * commands. This is an opaque type for which you are only ever provided
+ * with a pointer, originating from libusb_stream_manager_open().
+ */
+typedef struct libusb_stream_manager libusb_stream_manager;
+
+/** \ingroup libusb_stream_manager
+ * Statistics of one bulk stream of a stream manager, as returned by
+ * libusb_stream_manager_get_stream_stats().
+ */
+struct libusb_bulk_stream_stats {
+	/** Number of commands completed on the stream */
+	uint64_t commands;
+
+	/** Number of transfers completed on the stream */
+	uint64_t transfers;
+
+	/** Number of bytes transferred on the stream */
+	uint64_t bytes;
+
+	/** Number of transfers that completed with a status other than
+	 * \ref LIBUSB_TRANSFER_COMPLETED or could not be submitted */
+	unsigned int errors;
+};
+
+int LIBUSB_CALL libusb_stream_manager_open(libusb_device_handle *dev_handle,
+	unsigned char *endpoints, int num_endpoints, uint32_t num_streams,
+	libusb_stream_manager **mgr);
+void LIBUSB_CALL libusb_stream_manager_close(libusb_stream_manager *mgr);
+int LIBUSB_CALL libusb_stream_manager_get_num_streams(libusb_stream_manager *mgr);
+int LIBUSB_CALL libusb_stream_manager_submit(libusb_stream_manager *mgr,
+	struct libusb_transfer **transfers, int num_transfers);
+int LIBUSB_CALL libusb_stream_manager_get_stream_stats(libusb_stream_manager *mgr,
+	uint32_t stream_id, struct libusb_bulk_stream_stats *stats);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
@@ -1880,12 +2212,60 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *results);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(libusb_device_handle *dev_handle,
+	unsigned char endpoint);
+int LIBUSB_CALL libusb_cancel_handle_transfers(libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_clear_halt_async(libusb_device_handle *dev_handle,
+	unsigned char endpoint, libusb_transfer_cb_fn callback, void *user_data,
+	unsigned int timeout);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_transfer_set_twin_buffer(
+	struct libusb_transfer *transfer, unsigned char *buffer);
+unsigned char * LIBUSB_CALL libusb_transfer_get_twin_buffer(
+	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int iov_count);
+void LIBUSB_CALL libusb_transfer_set_iso_start_frame(
+	struct libusb_transfer *transfer, uint64_t start_frame);
+uint64_t LIBUSB_CALL libusb_transfer_get_iso_start_frame(
+	struct libusb_transfer *transfer);
+
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of recycled transfers. This is an opaque
+ * type for which you are only ever provided with a pointer, originating from
+ * libusb_transfer_pool_create().
+ */
+typedef struct libusb_transfer_pool libusb_transfer_pool;
+
+int LIBUSB_CALL libusb_transfer_pool_create(libusb_context *ctx,
+	int iso_packets, int count, libusb_transfer_pool **pool);
+void LIBUSB_CALL libusb_transfer_pool_destroy(libusb_transfer_pool *pool);
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_acquire(
+	libusb_transfer_pool *pool);
+void LIBUSB_CALL libusb_transfer_pool_release(struct libusb_transfer *transfer);
+
+/** \ingroup libusb_asyncio
+ * Structure representing a completion queue. This is an opaque type for
+ * which you are only ever provided with a pointer, originating from
+ * libusb_cq_create().
+ */
+typedef struct libusb_completion_queue libusb_completion_queue;
+
+int LIBUSB_CALL libusb_cq_create(libusb_context *ctx,
+	libusb_completion_queue **cq);
+void LIBUSB_CALL libusb_cq_destroy(libusb_completion_queue *cq);
+void LIBUSB_CALL libusb_transfer_set_cq(struct libusb_transfer *transfer,
+	libusb_completion_queue *cq);
+int LIBUSB_CALL libusb_cq_reap(libusb_completion_queue *cq,
+	struct libusb_transfer **transfers, int max, struct timeval *tv);
+void LIBUSB_CALL libusb_cq_interrupt(libusb_completion_queue *cq);
 
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1989,6 +2369,34 @@ static inline void libusb_fill_bulk_stream_transfer(
 	libusb_transfer_set_stream_id(transfer, stream_id);
 }
 
+/** \ingroup libusb_asyncio
+ * Helper function to populate the required \ref libusb_transfer fields
+ * for a scatter-gather bulk transfer. The data is sent from, or received
+ * into, the segments in \p iov in order, without being copied into one
+ * contiguous buffer. See libusb_transfer_set_iovec() for the requirements
+ * on the segments.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param iov array of data segments
+ * \param iov_count number of segments in \p iov
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ */
+static inline void libusb_fill_bulk_iovec_transfer(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, const struct libusb_iovec *iov, int iov_count,
+	libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, NULL, 0,
+				  callback, user_data, timeout);
+	libusb_transfer_set_iovec(transfer, iov, iov_count);
+}
+
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for an interrupt transfer.
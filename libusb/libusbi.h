@@ -93,6 +93,13 @@
  *   usbi_atomic_inc() - Atomically increment a variable's value and return the new value
  *   usbi_atomic_dec() - Atomically decrement a variable's value and return the new value
  *
+ * and the following ones on pointers (usbi_atomic_ptr_t):
+ *   usbi_atomic_ptr_load() - Atomically read a pointer
+ *   usbi_atomic_ptr_exchange() - Atomically write a new pointer and return the old one
+ *   usbi_atomic_ptr_cas() - Atomically replace a pointer if it still holds the
+ *     expected value, otherwise store its current value in expected. Returns
+ *     non-zero if the pointer was replaced
+ *
  * All of these operations are ordered with each other, thus the effects of
  * any one operation is guaranteed to be seen by any other operation.
  */
@@ -102,6 +109,18 @@ typedef volatile LONG usbi_atomic_t;
 #define usbi_atomic_store(a, v)	(*(a)) = (v)
 #define usbi_atomic_inc(a)	InterlockedIncrement((a))
 #define usbi_atomic_dec(a)	InterlockedDecrement((a))
+typedef void * volatile usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	(*(a))
+#define usbi_atomic_ptr_exchange(a, v)	InterlockedExchangePointer((a), (v))
+static inline int usbi_atomic_ptr_cas(usbi_atomic_ptr_t *a, void **expected, void *desired)
+{
+	void *old = InterlockedCompareExchangePointer(a, desired, *expected);
+
+	if (old == *expected)
+		return 1;
+	*expected = old;
+	return 0;
+}
 #else
 #if defined(__HAIKU__) && defined(__GNUC__) && !defined(__clang__)
 /* The Haiku port of libusb has some C++ files and GCC does not define
@@ -113,6 +132,11 @@ typedef long usbi_atomic_t;
 #define usbi_atomic_store(a, v)        __atomic_store_n((a), (v), __ATOMIC_SEQ_CST)
 #define usbi_atomic_inc(a)     __atomic_add_fetch((a), 1, __ATOMIC_SEQ_CST)
 #define usbi_atomic_dec(a)     __atomic_sub_fetch((a), 1, __ATOMIC_SEQ_CST)
+typedef void *usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)        __atomic_load_n((a), __ATOMIC_SEQ_CST)
+#define usbi_atomic_ptr_exchange(a, v) __atomic_exchange_n((a), (v), __ATOMIC_SEQ_CST)
+#define usbi_atomic_ptr_cas(a, e, d)   \
+	__atomic_compare_exchange_n((a), (e), (d), 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 #else
 #include <stdatomic.h>
 typedef atomic_long usbi_atomic_t;
@@ -120,6 +144,10 @@ typedef atomic_long usbi_atomic_t;
 #define usbi_atomic_store(a, v)	atomic_store((a), (v))
 #define usbi_atomic_inc(a)	(atomic_fetch_add((a), 1) + 1)
 #define usbi_atomic_dec(a)	(atomic_fetch_add((a), -1) - 1)
+typedef _Atomic(void *) usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	atomic_load((a))
+#define usbi_atomic_ptr_exchange(a, v)	atomic_exchange((a), (v))
+#define usbi_atomic_ptr_cas(a, e, d)	atomic_compare_exchange_weak((a), (e), (d))
 #endif
 #endif
 
@@ -153,6 +181,7 @@ extern "C" {
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_SUPPORTS_BULK_IOVEC		0x00040000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -360,6 +389,25 @@ struct libusb_context {
 	libusb_log_cb log_handler;
 #endif
 
+	/* set by LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS */
+	int direct_sync_transfers;
+
+	/* set by LIBUSB_OPTION_TIMER_SLACK_NS, with timeout_lock held.
+	 * coarse_timeouts is set when the slack covers the resolution of the
+	 * coarse monotonic clock, and is read without the lock on submission */
+	long timer_slack_ns;
+	usbi_atomic_t coarse_timeouts;
+
+	/* set by LIBUSB_OPTION_TRANSFER_MEM_BUDGET, with transfer_mem_lock
+	 * held. hold_transfers is read without the lock on submission and
+	 * completion. A transfer_mem_budget of 0 stands for the OS limit */
+	usbi_atomic_t hold_transfers;
+	size_t transfer_mem_budget;
+
+	/* The limit the OS imposes on the buffer memory of the transfers in
+	 * flight, 0 if there is none. Set by the backend's init function */
+	size_t os_transfer_mem_limit;
+
 	/* used for signalling occurrence of an internal event. */
 	usbi_event_t event;
 
@@ -367,6 +415,18 @@ struct libusb_context {
 	/* used for timeout handling, if supported by OS.
 	 * this timer is maintained to trigger on the next pending timeout */
 	usbi_timer_t timer;
+	/* timer_armed is set while the timer is armed or has expired without
+	 * being rearmed, timer_deadline holds the deadline it is armed for
+	 * until it expires. Protected by timeout_lock */
+	int timer_armed;
+	struct timespec timer_deadline;
+#endif
+
+#ifdef HAVE_OS_EVENT_SET
+	/* used to wait for events, if supported by OS. the event sources are
+	 * added to and removed from this set as they come and go, so that it
+	 * does not have to be rebuilt on every change */
+	usbi_event_set_t event_set;
 #endif
 
 	struct list_head usb_devs;
@@ -385,14 +445,34 @@ struct libusb_context {
 	/* A flag to indicate that the context is ready for hotplug notifications */
 	usbi_atomic_t hotplug_ready;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
-	/* Note paths taking both this and usbi_transfer->lock must always
-	 * take this lock first */
-	usbi_mutex_t flying_transfers_lock; /* for flying_transfers and timeout_flags */
+	/* The in-flight transfers and their timeouts are tracked by the device
+	 * handles, see struct libusb_device_handle. The context only keeps the
+	 * earliest deadline any of its handles has published. It is a lower
+	 * bound: it is not raised when transfers complete, but recomputed from
+	 * the handles once it has passed. Unset if no handle has published a
+	 * deadline. scans_in_progress counts the threads recomputing it, while
+	 * it is non-zero deadlines published in the meantime are also collected
+	 * in scan_deadline. */
+	struct timespec next_deadline;
+	struct timespec scan_deadline;
+	unsigned int scans_in_progress;
+	/* for next_deadline, the scan fields and the timer state. No other
+	 * lock is taken while holding this one */
+	usbi_mutex_t timeout_lock;
+
+	/* Buffer memory of the transfers in flight, and the transfers held
+	 * back from the backend until they fit the budget set by
+	 * LIBUSB_OPTION_TRANSFER_MEM_BUDGET, in submission order. Held
+	 * transfers are on the flying_transfers list of their device handle as
+	 * well. Only maintained if hold_transfers is set. Protected by
+	 * transfer_mem_lock. Note paths taking both this and the
+	 * flying_transfers_lock of a device handle must take the latter first,
+	 * and paths taking both this and usbi_transfer->lock must take this
+	 * first */
+	usbi_mutex_t transfer_mem_lock;
+	size_t transfer_mem_in_flight;
+	struct list_head held_transfers;
+	int submitting_held;
 
 #if !defined(PLATFORM_WINDOWS)
 	/* user callbacks for pollfd changes */
@@ -442,7 +522,13 @@ struct libusb_context {
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
+	/* Transfers completed by the backend but not yet handled, newest first.
+	 * Lock-free: any thread pushes with usbi_signal_transfer_completion(),
+	 * only the event handler takes them off. */
+	usbi_atomic_ptr_t completed_head;
+
+	/* Completed transfers taken off completed_head, oldest first, that
+	 * are still to be handled. Only accessed during event handling. */
 	struct list_head completed_transfers;
 
 	struct list_head list;
@@ -484,11 +570,11 @@ enum usbi_event_flags {
 	/* One or more hotplug messages are pending */
 	USBI_EVENT_HOTPLUG_MSG_PENDING = 1U << 3,
 
-	/* One or more completed transfers are pending */
-	USBI_EVENT_TRANSFER_COMPLETED = 1U << 4,
-
 	/* A device is in the process of being closed */
-	USBI_EVENT_DEVICE_CLOSE = 1U << 5,
+	USBI_EVENT_DEVICE_CLOSE = 1U << 4,
+
+	/* Held transfers may fit the transfer memory budget again */
+	USBI_EVENT_HELD_TRANSFERS = 1U << 5,
 };
 
 /* Macros for managing event handling state */
@@ -526,15 +612,50 @@ struct libusb_device {
 };
 
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces, sync_transfers and
+	 * stall_recoveries */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* idle transfers kept for reuse by the synchronous API */
+	struct list_head sync_transfers;
+
+	/* endpoints whose halt is being cleared for transfers with
+	 * LIBUSB_TRANSFER_RECOVER_STALL */
+	struct list_head stall_recoveries;
+
+	/* this is a list of in-flight transfers of this handle, in no
+	 * particular order. */
+	struct list_head flying_transfers;
+	/* binary min-heap of the in-flight transfers that have a timeout which
+	 * has not been handled yet, ordered by timeout expiration. The entry
+	 * at index 0 is the transfer to time out the soonest. Transfers with
+	 * infinite timeout are never placed on the heap. */
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
+	/* the deadline last published to the context's next_deadline, unset
+	 * if none has been published since the context last recomputed it */
+	struct timespec published_deadline;
+	/* Note paths taking both this and usbi_transfer->lock must always
+	 * take this lock first */
+	usbi_mutex_t flying_transfers_lock; /* for all of the above and timeout_flags */
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
 };
 
+/* A transfer and control bounce buffer cached by the synchronous API */
+struct usbi_sync_transfer {
+	struct list_head list;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	size_t buffer_size;
+};
+
+void usbi_free_sync_transfer(struct usbi_sync_transfer *sync);
+
 /* Function called by backend during device initialization to convert
  * multi-byte fields in the device descriptor to host-endian format.
  */
@@ -569,6 +690,30 @@ void usbi_get_monotonic_time(struct timespec *tp);
 void usbi_get_real_time(struct timespec *tp);
 #endif
 
+/* A cheaper, lower resolution variant of usbi_get_monotonic_time() where the
+ * platform has one. usbi_coarse_monotonic_resolution() returns its resolution
+ * in nanoseconds, or 0 if there is no such clock. */
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_COARSE)
+static inline void usbi_get_coarse_monotonic_time(struct timespec *tp)
+{
+	ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC_COARSE, tp), 0);
+}
+static inline long usbi_coarse_monotonic_resolution(void)
+{
+	struct timespec res;
+
+	if (clock_getres(CLOCK_MONOTONIC_COARSE, &res) != 0 || res.tv_sec)
+		return 0;
+	return res.tv_nsec;
+}
+#else
+#define usbi_get_coarse_monotonic_time usbi_get_monotonic_time
+static inline long usbi_coarse_monotonic_resolution(void)
+{
+	return 0;
+}
+#endif
+
 /* in-memory transfer layout:
  *
  * 1. os private data
@@ -582,15 +727,40 @@ void usbi_get_real_time(struct timespec *tp);
  *  LIBUSB_TRANSFER_TO_USBI_TRANSFER
  */
 
+/* Where a LIBUSB_TRANSFER_RECOVER_STALL transfer is in recovering from a
+ * stall of its endpoint */
+enum usbi_stall_state {
+	USBI_STALL_NONE = 0,
+
+	/* On the stall recovery's list, waiting for the halt to be cleared */
+	USBI_STALL_PARKED,
+
+	/* On the stall recovery's list behind a transfer that stalled, and
+	 * being taken back from the backend */
+	USBI_STALL_STOPPING,
+
+	/* Taken off the list and signalled for the event handler to
+	 * complete it with stall_status */
+	USBI_STALL_COMPLETING,
+};
+
 struct usbi_transfer {
 	int num_iso_packets;
+	/* Link in the flying_transfers list of the device handle. Protected
+	 * by its flying_transfers_lock */
 	struct list_head list;
 	struct list_head completed_list;
+	/* Link in the completed_head stack of the context */
+	struct usbi_transfer *completed_next;
 	struct timespec timeout;
 	int transferred;
 	uint32_t stream_id;
 	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
-	uint32_t timeout_flags; /* Protected by the flying_transfers_lock */
+	/* Protected by the flying_transfers_lock of the device handle */
+	uint32_t timeout_flags;
+	/* 1-based position in the timeout_heap of the device handle, 0 if not
+	 * on the heap. Protected by its flying_transfers_lock */
+	unsigned int timeout_heap_pos;
 
 	/* The device reference is held until destruction for logging
 	 * even after dev_handle is set to NULL.  */
@@ -603,11 +773,115 @@ struct usbi_transfer {
 	 * cancelling the transfer from another thread while you are processing
 	 * its completion (presumably there would be races within your OS backend
 	 * if this were possible).
-	 * Note paths taking both this and the flying_transfers_lock must
-	 * always take the flying_transfers_lock first */
+	 * Note paths taking both this and the flying_transfers_lock of the
+	 * device handle must always take the flying_transfers_lock first */
 	usbi_mutex_t lock;
 
+	/* The pool this transfer is recycled to, or NULL if the transfer was
+	 * allocated with libusb_alloc_transfer() */
+	struct libusb_transfer_pool *pool;
+
 	void *priv;
+
+	/* Backend scratch memory reserved at allocation time, see
+	 * usbi_os_backend.transfer_slab_size. NULL if there is none */
+	void *slab;
+
+	/* The buffer swapped in for LIBUSB_TRANSFER_AUTO_RESUBMIT */
+	unsigned char *twin_buffer;
+
+	/* Segments of a scatter-gather bulk transfer, iov_count is 0 for
+	 * transfers using the plain buffer. Dropped on submission if the
+	 * transfer has a buffer again */
+	const struct libusb_iovec *iov;
+	int iov_count;
+
+	/* Isochronous start frame. If iso_start_frame_set, the next submission
+	 * is scheduled on this frame rather than as soon as possible. Once the
+	 * transfer completes, backends store the frame it started on. */
+	uint64_t iso_start_frame;
+	int iso_start_frame_set;
+
+	/* Buffer memory counted in ctx->transfer_mem_in_flight for this
+	 * transfer. Protected by ctx->transfer_mem_lock */
+	size_t mem_charge;
+
+	/* Set while the transfer is on ctx->held_transfers. Only changed with
+	 * both ctx->transfer_mem_lock and the lock above held, so either
+	 * one suffices for reading it */
+	int held;
+	struct list_head held_list;
+
+	/* The stream of a stream manager this transfer was submitted on, NULL
+	 * for transfers submitted directly */
+	struct stream_manager_slot *stream_slot;
+
+	/* The completion queue the transfer is added to when it completes,
+	 * instead of invoking its callback. NULL if there is none */
+	struct libusb_completion_queue *cq;
+	/* Link in the transfers list of the completion queue. Protected by
+	 * the lock of the queue */
+	struct list_head cq_list;
+
+	/* Set while the transfer waits for the halt of its endpoint to be
+	 * cleared, on the stall recovery's list, and until the event handler
+	 * completes it if it does not go out again. The transfer stays in
+	 * flight meanwhile. Protected by the lock above */
+	enum usbi_stall_state stall_state;
+	enum libusb_transfer_status stall_status;
+	struct list_head stall_list;
+
+	/* Stalls recovered from since the callback was last invoked */
+	unsigned int stall_retries;
+};
+
+struct libusb_transfer_pool {
+	struct libusb_context *ctx;
+	int iso_packets;
+
+	/* Idle transfers, linked through usbi_transfer->list.
+	 * Protected by lock, as are the fields below */
+	usbi_mutex_t lock;
+	struct list_head free_transfers;
+	unsigned int num_acquired;
+	int destroyed;
+};
+
+struct libusb_completion_queue {
+	struct libusb_context *ctx;
+
+	/* Completed transfers not reaped yet, oldest first, linked through
+	 * usbi_transfer->cq_list. Protected by lock, as are the fields below */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	struct list_head transfers;
+	unsigned int waiters;
+	int interrupted;
+};
+
+/* Buffers are handed out from a buffer pool in whole blocks of this size,
+ * which keeps them aligned for DMA and to any USB max packet size */
+#define USBI_BUFFER_POOL_BLOCK_SIZE	512
+
+struct libusb_buffer_pool {
+	struct libusb_device_handle *dev_handle;
+
+	/* Device memory the buffers are carved from, NULL if it could not
+	 * be allocated, in which case every buffer comes from the heap */
+	unsigned char *mem;
+	size_t mem_size;
+
+	/* Protects the fields below */
+	usbi_mutex_t lock;
+
+	/* Number of blocks in the allocation starting at each block, 0 for
+	 * blocks that are free or inside an allocation */
+	unsigned int *block_runs;
+	unsigned int num_blocks;
+
+	/* Block after the most recent allocation, where the next search for
+	 * free blocks starts */
+	unsigned int next_block;
 };
 
 enum usbi_transfer_state_flags {
@@ -808,6 +1082,8 @@ void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+void usbi_remove_flying_transfer(struct usbi_transfer *itransfer);
+void usbi_drop_stall_recoveries(struct libusb_device_handle *dev_handle);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
@@ -820,6 +1096,9 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer);
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer);
+void usbi_clear_event_if_idle(struct libusb_context *ctx);
+void usbi_cq_push(struct usbi_transfer *itransfer);
+void usbi_stream_manager_transfer_done(struct usbi_transfer *itransfer);
 
 void usbi_connect_device(struct libusb_device *dev);
 void usbi_disconnect_device(struct libusb_device *dev);
@@ -868,6 +1147,24 @@ static inline int usbi_using_timer(struct libusb_context *ctx)
 #endif
 }
 
+#ifdef HAVE_OS_EVENT_SET
+int usbi_create_event_set(usbi_event_set_t *event_set);
+void usbi_destroy_event_set(usbi_event_set_t *event_set);
+int usbi_event_set_add(usbi_event_set_t *event_set, usbi_os_handle_t os_handle,
+	short poll_events);
+void usbi_event_set_remove(usbi_event_set_t *event_set, usbi_os_handle_t os_handle);
+#endif
+
+static inline int usbi_using_event_set(struct libusb_context *ctx)
+{
+#ifdef HAVE_OS_EVENT_SET
+	return usbi_event_set_valid(&ctx->event_set);
+#else
+	UNUSED(ctx);
+	return 0;
+#endif
+}
+
 struct usbi_reported_events {
 	union {
 		struct {
@@ -1270,6 +1567,24 @@ struct usbi_os_backend {
 	int (*clear_halt)(struct libusb_device_handle *dev_handle,
 		unsigned char endpoint);
 
+	/* Reset the host side state of an endpoint, such as its data toggle,
+	 * after libusb has cleared its halt with a CLEAR_FEATURE request.
+	 * Unlike clear_halt, this must not send anything to the device.
+	 * Optional, libusb_clear_halt_async() is not supported without it.
+	 *
+	 * This function is called from the event handling path, it should
+	 * not block for long.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected since it
+	 *   was opened
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*reset_endpoint)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint);
+
 	/* Perform a USB port reset to reinitialize a device. Optional.
 	 *
 	 * If possible, the device handle should still be usable after the reset
@@ -1288,6 +1603,27 @@ struct usbi_os_backend {
 	 */
 	int (*reset_device)(struct libusb_device_handle *dev_handle);
 
+	/* Get the current frame number of the bus the device is connected to.
+	 * Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected since it
+	 *   was opened
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_frame_number)(struct libusb_device_handle *dev_handle,
+		uint64_t *frame_number);
+
+	/* Fill in the statistics of a device handle kept by the backend.
+	 * Optional, the statistics are zeroed before this is called.
+	 *
+	 * This function may be called from any thread, concurrently with event
+	 * handling.
+	 */
+	void (*get_handle_stats)(struct libusb_device_handle *dev_handle,
+		struct libusb_device_handle_stats *stats);
+
 	/* Alloc num_streams usb3 bulk streams on the passed in endpoints */
 	int (*alloc_streams)(struct libusb_device_handle *dev_handle,
 		uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
@@ -1398,6 +1734,59 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Release any resources the backend keeps in the private data of a
+	 * transfer across submissions. Called when the transfer is freed,
+	 * never while it is in flight.
+	 *
+	 * Optional, only needed by backends that cache per-transfer state.
+	 */
+	void (*free_transfer_priv)(struct usbi_transfer *itransfer);
+
+	/* Return the number of bytes of scratch memory the backend needs for
+	 * a transfer with num_iso_packets isochronous packet descriptors.
+	 * The memory is reserved once, in the same allocation as the transfer
+	 * itself, and is available through usbi_transfer->slab (NULL if this
+	 * returned 0). It is zeroed on allocation and otherwise left alone by
+	 * the library.
+	 *
+	 * Optional, for backends that would otherwise allocate per-submission
+	 * structures whose size only depends on the packet count.
+	 */
+	size_t (*transfer_slab_size)(int num_iso_packets);
+
+	/* Perform a control transfer with a single blocking request to the
+	 * operating system. Optional, used instead of the asynchronous path
+	 * by libusb_control_transfer() when LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS
+	 * is set.
+	 *
+	 * The setup fields are in host-endian byte order.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this particular request has to go
+	 *   through the asynchronous path
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *dev_handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer with a single blocking request
+	 * to the operating system. Optional, used instead of the asynchronous
+	 * path by libusb_bulk_transfer() and libusb_interrupt_transfer() when
+	 * LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS is set.
+	 *
+	 * Return:
+	 * - 0 on success, with *transferred populated
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this particular request has to go
+	 *   through the asynchronous path
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1498,17 +1887,11 @@ extern const struct usbi_os_backend usbi_backend;
 #define for_each_open_device(ctx, h) \
 	for_each_helper(h, &(ctx)->open_devs, struct libusb_device_handle)
 
-#define __for_each_transfer(list, t) \
-	for_each_helper(t, (list), struct usbi_transfer)
-
-#define for_each_transfer(ctx, t) \
-	__for_each_transfer(&(ctx)->flying_transfers, t)
-
-#define __for_each_transfer_safe(list, t, n) \
-	for_each_safe_helper(t, n, (list), struct usbi_transfer)
+#define for_each_handle_transfer(h, t) \
+	for_each_helper(t, &(h)->flying_transfers, struct usbi_transfer)
 
-#define for_each_transfer_safe(ctx, t, n) \
-	__for_each_transfer_safe(&(ctx)->flying_transfers, t, n)
+#define for_each_handle_transfer_safe(h, t, n) \
+	for_each_safe_helper(t, n, &(h)->flying_transfers, struct usbi_transfer)
 
 #define __for_each_completed_transfer_safe(list, t, n) \
 	list_for_each_entry_safe(t, n, (list), completed_list, struct usbi_transfer)
@@ -2167,6 +2167,22 @@ static int darwin_reenumerate_device (struct libusb_device_handle *dev_handle, b
   return darwin_restore_state (dev_handle, active_config, claimed_interfaces);
 }
 
+static int darwin_get_frame_number (struct libusb_device_handle *dev_handle, uint64_t *frame_number) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+  IOReturn kresult;
+  UInt64 frame;
+  AbsoluteTime atTime;
+
+  kresult = (*dpriv->device)->GetBusFrameNumber (dpriv->device, &frame, &atTime);
+  if (kresult != kIOReturnSuccess) {
+    usbi_err (HANDLE_CTX (dev_handle), "failed to get bus frame number: %d", kresult);
+    return darwin_to_libusb (kresult);
+  }
+
+  *frame_number = frame;
+  return LIBUSB_SUCCESS;
+}
+
 static int darwin_reset_device (struct libusb_device_handle *dev_handle) {
   struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
   IOReturn kresult;
@@ -2416,11 +2432,17 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
     return darwin_to_libusb (kresult);
   }
 
-  /* schedule for a frame a little in the future */
-  frame += 4;
+  if (itransfer->iso_start_frame_set) {
+    /* the caller picked the frame */
+    frame = itransfer->iso_start_frame;
+  } else {
+    /* schedule for a frame a little in the future */
+    frame += 4;
 
-  if (cInterface->frames[transfer->endpoint] && frame < cInterface->frames[transfer->endpoint])
-    frame = cInterface->frames[transfer->endpoint];
+    if (cInterface->frames[transfer->endpoint] && frame < cInterface->frames[transfer->endpoint])
+      frame = cInterface->frames[transfer->endpoint];
+  }
+  itransfer->iso_start_frame = frame;
 
   /* submit the request */
   if (IS_XFERIN(transfer))
@@ -2948,6 +2970,7 @@ const struct usbi_os_backend usbi_backend = {
         .set_interface_altsetting = darwin_set_interface_altsetting,
         .clear_halt = darwin_clear_halt,
         .reset_device = darwin_reset_device,
+        .get_frame_number = darwin_get_frame_number,
 
 #if MAX_INTERFACE_VERSION >= 550
         .alloc_streams = darwin_alloc_streams,
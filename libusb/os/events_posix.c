@@ -28,6 +28,9 @@
 #ifdef HAVE_TIMERFD
 #include <sys/timerfd.h>
 #endif
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #ifdef __EMSCRIPTEN__
 /* On Emscripten `pipe` does not conform to the spec and does not block
@@ -218,12 +221,163 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 }
 #endif
 
+#ifdef HAVE_EPOLL
+/* maximum number of ready event sources reported by one wait. any further
+ * ready sources stay ready and are reported by the next wait */
+#define EPOLL_MAX_EVENTS	64
+
+/* event data when waiting on an epoll instance. the ready events are
+ * translated to pollfds for the backend */
+struct usbi_epoll_event_data {
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct pollfd fds[EPOLL_MAX_EVENTS];
+};
+
+int usbi_create_event_set(usbi_event_set_t *event_set)
+{
+	event_set->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (event_set->epollfd == -1) {
+		usbi_warn(NULL, "failed to create epoll instance, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_destroy_event_set(usbi_event_set_t *event_set)
+{
+	if (close(event_set->epollfd) == -1)
+		usbi_warn(NULL, "failed to close epoll instance, errno=%d", errno);
+}
+
+int usbi_event_set_add(usbi_event_set_t *event_set, usbi_os_handle_t os_handle,
+	short poll_events)
+{
+	/* the poll() and epoll event bits have the same values */
+	struct epoll_event event = { .events = (uint32_t)poll_events, .data.fd = os_handle };
+
+	if (epoll_ctl(event_set->epollfd, EPOLL_CTL_ADD, os_handle, &event) == -1) {
+		usbi_err(NULL, "failed to add fd %d to epoll instance, errno=%d", os_handle, errno);
+		return errno == ENOMEM ? LIBUSB_ERROR_NO_MEM : LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_event_set_remove(usbi_event_set_t *event_set, usbi_os_handle_t os_handle)
+{
+	/* a closed fd has already left the epoll instance on its own */
+	if (epoll_ctl(event_set->epollfd, EPOLL_CTL_DEL, os_handle, NULL) == -1 &&
+	    errno != EBADF && errno != ENOENT)
+		usbi_warn(NULL, "failed to remove fd %d from epoll instance, errno=%d", os_handle, errno);
+}
+
+static int epoll_wait_for_events(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_epoll_event_data *data = ctx->event_data;
+	struct pollfd *fds = data->fds;
+	unsigned int nfds = 0;
+	int i, num_ready;
+
+	usbi_dbg(ctx, "epoll_wait() with timeout in %dms", timeout_ms);
+	num_ready = epoll_wait(ctx->event_set.epollfd, data->events, EPOLL_MAX_EVENTS, timeout_ms);
+	usbi_dbg(ctx, "epoll_wait() returned %d", num_ready);
+	if (num_ready == 0) {
+		if (usbi_using_timer(ctx))
+			goto done;
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_ready == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "epoll_wait() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	reported_events->event_triggered = 0;
+#ifdef HAVE_OS_TIMER
+	reported_events->timer_triggered = 0;
+#endif
+
+	/* pick out the library's internal file descriptors, and only pass the
+	 * remaining ready fds on to the backend */
+	for (i = 0; i < num_ready; i++) {
+		int fd = data->events[i].data.fd;
+
+		if (fd == USBI_EVENT_OS_HANDLE(&ctx->event)) {
+			reported_events->event_triggered = 1;
+			continue;
+		}
+#ifdef HAVE_OS_TIMER
+		if (usbi_using_timer(ctx) && fd == USBI_TIMER_OS_HANDLE(&ctx->timer)) {
+			reported_events->timer_triggered = 1;
+			continue;
+		}
+#endif
+
+		fds[nfds].fd = fd;
+		fds[nfds].events = (short)data->events[i].events;
+		fds[nfds].revents = (short)data->events[i].events;
+		nfds++;
+	}
+
+	num_ready = (int)nfds;
+	if (!num_ready)
+		goto done;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
+		struct usbi_event_source *ievent_source;
+
+		for_each_removed_event_source(ctx, ievent_source) {
+			unsigned int n;
+
+			for (n = 0; n < nfds; n++) {
+				if (ievent_source->data.os_handle != fds[n].fd)
+					continue;
+				if (!fds[n].revents)
+					continue;
+				/* fd was removed after epoll_wait() reported it. remove
+				 * triggered revent as it is no longer relevant. */
+				usbi_dbg(ctx, "fd %d was removed, ignoring raised events", fds[n].fd);
+				fds[n].revents = 0;
+				num_ready--;
+				break;
+			}
+		}
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (num_ready) {
+		reported_events->event_data = fds;
+		reported_events->event_data_count = nfds;
+	}
+
+done:
+	reported_events->num_ready = (unsigned int)num_ready;
+	return LIBUSB_SUCCESS;
+}
+#endif
+
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
 	struct usbi_event_source *ievent_source;
 	struct pollfd *fds;
 	size_t i = 0;
 
+#ifdef HAVE_EPOLL
+	/* the epoll instance tracks the event sources by itself, so there
+	 * is only the buffer for the ready events to allocate */
+	if (usbi_using_event_set(ctx)) {
+		if (!ctx->event_data) {
+			ctx->event_data = malloc(sizeof(struct usbi_epoll_event_data));
+			if (!ctx->event_data)
+				return LIBUSB_ERROR_NO_MEM;
+		}
+		return 0;
+	}
+#endif
+
 	if (ctx->event_data) {
 		free(ctx->event_data);
 		ctx->event_data = NULL;
@@ -254,6 +408,11 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	usbi_nfds_t nfds = (usbi_nfds_t)ctx->event_data_cnt;
 	int internal_fds, num_ready;
 
+#ifdef HAVE_EPOLL
+	if (usbi_using_event_set(ctx))
+		return epoll_wait_for_events(ctx, reported_events, timeout_ms);
+#endif
+
 	usbi_dbg(ctx, "poll() %u fds with timeout in %dms", (unsigned int)nfds, timeout_ms);
 #ifdef __EMSCRIPTEN__
 	/* Emscripten's poll doesn't actually block, so we need to use an
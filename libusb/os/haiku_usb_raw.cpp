@@ -203,7 +203,10 @@ const struct usbi_os_backend usbi_backend = {
 	/*.set_interface_altsetting =*/ haiku_set_altsetting,
 
 	/*.clear_halt =*/ haiku_clear_halt,
+	/*.reset_endpoint =*/ NULL,
 	/*.reset_device =*/ NULL,
+	/*.get_frame_number =*/ NULL,
+	/*.get_handle_stats =*/ NULL,
 
 	/*.alloc_streams =*/ NULL,
 	/*.free_streams =*/ NULL,
@@ -220,6 +223,11 @@ const struct usbi_os_backend usbi_backend = {
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
 	/*.clear_transfer_priv =*/ NULL,
+	/*.free_transfer_priv =*/ NULL,
+	/*.transfer_slab_size =*/ NULL,
+
+	/*.sync_control_transfer =*/ NULL,
+	/*.sync_bulk_transfer =*/ NULL,
 
 	/*.handle_events =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
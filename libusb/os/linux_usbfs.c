@@ -119,6 +119,15 @@ struct config_descriptor {
 struct linux_context_priv {
 	/* no enumeration or hot-plug detection */
 	int no_device_discovery;
+
+	/* open device handles indexed by their usbfs fd, so that
+	 * op_handle_events() does not have to search for the handle
+	 * of each ready fd. Protected by ctx->open_devs_lock */
+	struct libusb_device_handle **fd_handles;
+	unsigned int fd_handles_len;
+
+	/* set by LIBUSB_OPTION_REAP_BUDGET, 0 for the default */
+	unsigned int max_reap_budget;
 };
 
 struct linux_device_priv {
@@ -134,8 +143,32 @@ struct linux_device_handle_priv {
 	int fd_removed;
 	int fd_keep;
 	uint32_t caps;
+
+	/* number of URBs op_handle_events() may reap in one go, adapted to
+	 * the rate this device completes URBs at */
+	unsigned int reap_budget;
+	/* URBs reaped in the current op_handle_events() call */
+	unsigned int reaped;
+	/* number of times the device still had URBs to reap when its budget
+	 * ran out, read by libusb_get_device_handle_stats() */
+	usbi_atomic_t reap_budget_exhausted;
+
+	/* smallest wMaxPacketSize of each endpoint across the alternate
+	 * settings of the active configuration, valid where the bit of the
+	 * endpoint is set in max_packet_valid. Protected by the lock of the
+	 * device handle */
+	uint16_t max_packet[32];
+	uint32_t max_packet_valid;
 };
 
+/* URBs are reaped from the ready devices in turns of REAP_SLICE, until each
+ * device has nothing left to reap or has used up its budget. The budget of
+ * a device doubles whenever it runs out and halves whenever less than half
+ * of it was needed, between REAP_BUDGET_MIN and the maximum budget. */
+#define REAP_SLICE		16U
+#define REAP_BUDGET_MIN		32U
+#define REAP_BUDGET_MAX_DEFAULT	1024U
+
 enum reap_action {
 	NORMAL = 0,
 	/* submission failed after the first URB, so await cancellation/completion
@@ -153,9 +186,11 @@ enum reap_action {
 };
 
 struct linux_transfer_priv {
+	/* the URBs of the transfer while it is in flight, NULL otherwise.
+	 * isochronous URBs live in the transfer slab, see iso_urb() */
 	union {
 		struct usbfs_urb *urbs;
-		struct usbfs_urb **iso_urbs;
+		struct usbfs_urb *iso_urbs;
 	};
 
 	enum reap_action reap_action;
@@ -165,6 +200,28 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* control transfers always use a single URB, which lives here so that
+	 * submitting one does not need to allocate */
+	struct usbfs_urb control_urb;
+
+	/* URB array of bulk and interrupt transfers. It is kept across
+	 * submissions and only freed along with the transfer; urbs points
+	 * to it while the transfer is in flight. bulk_urbs_built is the
+	 * number of URBs last set up from bulk_shape, 0 if none are. */
+	struct usbfs_urb *bulk_urbs;
+	int bulk_urbs_len;
+	int bulk_urbs_built;
+	struct linux_bulk_shape {
+		unsigned char *buffer;
+		int length;
+		int bulk_buffer_len;
+		int use_bulk_continuation;
+		uint32_t stream_id;
+		uint8_t type;
+		uint8_t endpoint;
+		uint8_t zero_packet;
+	} bulk_shape;
 };
 
 static int dev_has_config0(struct libusb_device *dev)
@@ -351,6 +408,36 @@ static int kernel_version_ge(const struct kernel_version *ver,
 	return ver->sublevel >= sublevel;
 }
 
+/* The usbfs_memory_mb parameter of usbcore caps the buffer memory of all URBs
+ * in flight through usbfs, in MiB. 0 means no limit, and kernels older than
+ * 3.3 have no such parameter. */
+static size_t get_usbfs_memory_limit(struct libusb_context *ctx)
+{
+	char buf[20], *endptr;
+	unsigned long mb;
+	ssize_t r;
+	int fd;
+
+	fd = open(SYSFS_MOUNT_PATH "/module/usbcore/parameters/usbfs_memory_mb", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+	buf[r] = '\0';
+
+	errno = 0;
+	mb = strtoul(buf, &endptr, 10);
+	if (endptr == buf || errno || mb > SIZE_MAX >> 20) {
+		usbi_warn(ctx, "usbfs_memory_mb contains an invalid value: '%s'", buf);
+		return 0;
+	}
+
+	return (size_t)mb << 20;
+}
+
 static int op_init(struct libusb_context *ctx)
 {
 	struct kernel_version kversion;
@@ -400,6 +487,10 @@ static int op_init(struct libusb_context *ctx)
 		}
 	}
 
+	ctx->os_transfer_mem_limit = get_usbfs_memory_limit(ctx);
+	if (ctx->os_transfer_mem_limit)
+		usbi_dbg(ctx, "usbfs memory limit is %zu MiB", ctx->os_transfer_mem_limit >> 20);
+
 	if (cpriv->no_device_discovery) {
 		return LIBUSB_SUCCESS;
 	}
@@ -426,6 +517,10 @@ static void op_exit(struct libusb_context *ctx)
 {
 	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 
+	free(cpriv->fd_handles);
+	cpriv->fd_handles = NULL;
+	cpriv->fd_handles_len = 0;
+
 	if (cpriv->no_device_discovery) {
 		return;
 	}
@@ -439,16 +534,22 @@ static void op_exit(struct libusb_context *ctx)
 
 static int op_set_option(struct libusb_context *ctx, enum libusb_option option, va_list ap)
 {
-	UNUSED(ap);
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 
 	if (option == LIBUSB_OPTION_NO_DEVICE_DISCOVERY) {
-		struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
-
 		usbi_dbg(ctx, "no device discovery will be performed");
 		cpriv->no_device_discovery = 1;
 		return LIBUSB_SUCCESS;
 	}
 
+	if (option == LIBUSB_OPTION_REAP_BUDGET) {
+		int budget = va_arg(ap, int);
+
+		usbi_dbg(ctx, "maximum reap budget %d", budget);
+		cpriv->max_reap_budget = (unsigned int)budget;
+		return LIBUSB_SUCCESS;
+	}
+
 	return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
@@ -1338,12 +1439,50 @@ static int linux_default_scan_devices(struct libusb_context *ctx)
 }
 #endif
 
+/* record (or with a NULL handle, forget) the handle owning a usbfs fd */
+static int set_fd_handle(struct libusb_context *ctx, int fd,
+	struct libusb_device_handle *handle)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	unsigned int idx = (unsigned int)fd;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (idx >= cpriv->fd_handles_len && handle) {
+		unsigned int len = MAX(MAX(2 * cpriv->fd_handles_len, idx + 1), 64U);
+		struct libusb_device_handle **fd_handles;
+
+		fd_handles = realloc(cpriv->fd_handles, len * sizeof(*fd_handles));
+		if (!fd_handles) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		memset(fd_handles + cpriv->fd_handles_len, 0,
+		       (len - cpriv->fd_handles_len) * sizeof(*fd_handles));
+		cpriv->fd_handles = fd_handles;
+		cpriv->fd_handles_len = len;
+	}
+	if (idx < cpriv->fd_handles_len)
+		cpriv->fd_handles[idx] = handle;
+out:
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return r;
+}
+
+static unsigned int max_reap_budget(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+	return cpriv->max_reap_budget ? cpriv->max_reap_budget : REAP_BUDGET_MAX_DEFAULT;
+}
+
 static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
 	int r;
 
 	hpriv->fd = fd;
+	hpriv->reap_budget = MIN(REAP_BUDGET_MIN, max_reap_budget(HANDLE_CTX(handle)));
 
 	r = ioctl(fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
 	if (r < 0) {
@@ -1354,7 +1493,15 @@ static int initialize_handle(struct libusb_device_handle *handle, int fd)
 		hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	r = set_fd_handle(HANDLE_CTX(handle), fd, handle);
+	if (r < 0)
+		return r;
+
+	r = usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (r < 0)
+		set_fd_handle(HANDLE_CTX(handle), fd, NULL);
+
+	return r;
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1441,10 +1588,22 @@ static void op_close(struct libusb_device_handle *dev_handle)
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
 		usbi_remove_event_source(HANDLE_CTX(dev_handle), hpriv->fd);
+	set_fd_handle(HANDLE_CTX(dev_handle), hpriv->fd, NULL);
+	if (usbi_atomic_load(&hpriv->reap_budget_exhausted))
+		usbi_dbg(HANDLE_CTX(dev_handle), "reap budget was exhausted %ld times",
+			 (long)usbi_atomic_load(&hpriv->reap_budget_exhausted));
 	if (!hpriv->fd_keep)
 		close(hpriv->fd);
 }
 
+static void op_get_handle_stats(struct libusb_device_handle *handle,
+	struct libusb_device_handle_stats *stats)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+	stats->reap_budget_exhausted = (unsigned long)usbi_atomic_load(&hpriv->reap_budget_exhausted);
+}
+
 static int op_get_configuration(struct libusb_device_handle *handle,
 	uint8_t *config)
 {
@@ -1501,6 +1660,10 @@ static int op_set_configuration(struct libusb_device_handle *handle, int config)
 		priv->active_config = config;
 	}
 
+	usbi_mutex_lock(&handle->lock);
+	hpriv->max_packet_valid = 0;
+	usbi_mutex_unlock(&handle->lock);
+
 	return LIBUSB_SUCCESS;
 }
 
@@ -1585,6 +1748,162 @@ static int op_clear_halt(struct libusb_device_handle *handle,
 	return 0;
 }
 
+static int op_reset_endpoint(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	int fd = hpriv->fd;
+	unsigned int _endpoint = endpoint;
+	int r = ioctl(fd, IOCTL_USBFS_RESETEP, &_endpoint);
+
+	if (r < 0) {
+		if (errno == ENOENT)
+			return LIBUSB_ERROR_NOT_FOUND;
+		else if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		usbi_err(HANDLE_CTX(handle), "reset endpoint failed, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+static int sync_ioctl_error(struct libusb_device_handle *handle, const char *what)
+{
+	switch (errno) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	case EINVAL:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	default:
+		usbi_dbg(HANDLE_CTX(handle), "%s failed, errno=%d", what, errno);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_ctrltransfer ctrl = {
+		.bmRequestType = bmRequestType,
+		.bRequest = bRequest,
+		.wValue = wValue,
+		.wIndex = wIndex,
+		.wLength = wLength,
+		.timeout = timeout,
+		.data = data
+	};
+	int r;
+
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_ioctl_error(handle, "control ioctl");
+
+	return r;
+}
+
+/* smallest wMaxPacketSize of an endpoint across the alternate settings of
+ * the active configuration, 0 if it cannot be found */
+static uint16_t min_max_packet_size(struct libusb_device *dev,
+	unsigned char endpoint)
+{
+	struct libusb_config_descriptor *config;
+	uint16_t max_packet = 0;
+	int i, j, k;
+
+	if (libusb_get_active_config_descriptor(dev, &config) < 0)
+		return 0;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *altsetting = &iface->altsetting[j];
+
+			for (k = 0; k < altsetting->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep = &altsetting->endpoint[k];
+				uint16_t size = ep->wMaxPacketSize & 0x7ff;
+
+				if (ep->bEndpointAddress == endpoint &&
+				    (!max_packet || size < max_packet))
+					max_packet = size;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return max_packet;
+}
+
+/* whether a bulk or interrupt transfer fits in a single packet of the
+ * endpoint, so that it moves either all of its data or none of it */
+static int is_single_packet(struct libusb_device_handle *handle,
+	unsigned char endpoint, int length)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	unsigned int idx = (endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) |
+		((endpoint & LIBUSB_ENDPOINT_IN) >> 3);
+	uint16_t max_packet;
+
+	usbi_mutex_lock(&handle->lock);
+	if (!(hpriv->max_packet_valid & (1U << idx))) {
+		hpriv->max_packet[idx] = min_max_packet_size(handle->dev, endpoint);
+		hpriv->max_packet_valid |= 1U << idx;
+	}
+	max_packet = hpriv->max_packet[idx];
+	usbi_mutex_unlock(&handle->lock);
+
+	return length <= (int)max_packet;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_bulktransfer bulk = {
+		.ep = endpoint,
+		.len = (unsigned int)length,
+		.timeout = timeout,
+		.data = data
+	};
+	int r;
+
+	/* the kernel does not report the data moved before a timeout, which
+	 * is only known to be none for a transfer of a single packet. Longer
+	 * transfers that can time out take the asynchronous path */
+	if (timeout && !is_single_packet(handle, endpoint, length))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	/* older kernels cap a single request, leave splitting it up to
+	 * submit_bulk_transfer() */
+	if (length > MAX_BULK_BUFFER_LENGTH && !(hpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_BULK, &bulk);
+	if (r < 0)
+		return sync_ioctl_error(handle, "bulk ioctl");
+
+	*transferred = r;
+	return 0;
+}
+
 static int op_reset_device(struct libusb_device_handle *handle)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
@@ -1603,6 +1922,7 @@ static int op_reset_device(struct libusb_device_handle *handle)
 	}
 
 	usbi_mutex_lock(&handle->lock);
+	hpriv->max_packet_valid = 0;
 	r = ioctl(fd, IOCTL_USBFS_RESET, NULL);
 	if (r < 0) {
 		if (errno == ENODEV) {
@@ -1868,6 +2188,41 @@ static void op_destroy_device(struct libusb_device *dev)
 	free(priv->sysfs_dir);
 }
 
+/* Isochronous URBs are carved from the transfer slab, which is sized for
+ * the packet count when the transfer is allocated. They are laid out back
+ * to back, each but the last one carrying MAX_ISO_PACKETS_PER_URB packet
+ * descriptors. */
+#define ISO_URB_STRIDE \
+	PTR_ALIGN(sizeof(struct usbfs_urb) + \
+		  MAX_ISO_PACKETS_PER_URB * sizeof(struct usbfs_iso_packet_desc))
+
+/* whether a usbfs packet descriptor can be copied over a libusb one */
+#define ISO_PACKET_DESC_LAYOUT_MATCHES \
+	(sizeof(struct usbfs_iso_packet_desc) == sizeof(struct libusb_iso_packet_descriptor) && \
+	 offsetof(struct usbfs_iso_packet_desc, length) == offsetof(struct libusb_iso_packet_descriptor, length) && \
+	 offsetof(struct usbfs_iso_packet_desc, actual_length) == offsetof(struct libusb_iso_packet_descriptor, actual_length) && \
+	 offsetof(struct usbfs_iso_packet_desc, status) == offsetof(struct libusb_iso_packet_descriptor, status))
+
+static size_t op_transfer_slab_size(int num_iso_packets)
+{
+	int num_urbs, last_urb_packets;
+
+	if (num_iso_packets < 1)
+		return 0;
+
+	num_urbs = (num_iso_packets + (MAX_ISO_PACKETS_PER_URB - 1)) / MAX_ISO_PACKETS_PER_URB;
+	last_urb_packets = num_iso_packets - (num_urbs - 1) * MAX_ISO_PACKETS_PER_URB;
+
+	return (size_t)(num_urbs - 1) * ISO_URB_STRIDE +
+		PTR_ALIGN(sizeof(struct usbfs_urb) +
+			  (size_t)last_urb_packets * sizeof(struct usbfs_iso_packet_desc));
+}
+
+static struct usbfs_urb *iso_urb(struct usbi_transfer *itransfer, int i)
+{
+	return (struct usbfs_urb *)((unsigned char *)itransfer->slab + (size_t)i * ISO_URB_STRIDE);
+}
+
 /* URBs are discarded in reverse order of submission to avoid races. */
 static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plus_one)
 {
@@ -1881,7 +2236,7 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 
 	for (i = last_plus_one - 1; i >= first; i--) {
 		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			urb = tpriv->iso_urbs[i];
+			urb = iso_urb(itransfer, i);
 		else
 			urb = &tpriv->urbs[i];
 
@@ -1903,20 +2258,84 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+static void build_bulk_urb(struct usbi_transfer *itransfer,
+	const struct linux_bulk_shape *shape, struct usbfs_urb *urb,
+	unsigned char *buffer, int buffer_length, int first, int last)
 {
+	int is_out = IS_EPOUT(shape->endpoint);
+
+	urb->usercontext = itransfer;
+	switch (shape->type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		urb->type = USBFS_URB_TYPE_BULK;
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+		urb->type = USBFS_URB_TYPE_BULK;
+		urb->stream_id = shape->stream_id;
+		break;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		urb->type = USBFS_URB_TYPE_INTERRUPT;
+		break;
+	}
+	urb->endpoint = shape->endpoint;
+	urb->buffer = buffer;
+	urb->buffer_length = buffer_length;
+
+	/* don't set the short not ok flag for the last URB */
+	if (shape->use_bulk_continuation && !is_out && !last)
+		urb->flags = USBFS_URB_SHORT_NOT_OK;
+
+	if (!first && shape->use_bulk_continuation)
+		urb->flags |= USBFS_URB_BULK_CONTINUATION;
+
+	/* we have already checked that the flag is supported */
+	if (last && shape->zero_packet)
+		urb->flags |= USBFS_URB_ZERO_PACKET;
+}
+
+/* number of URBs needed for the segments of a scatter-gather transfer, each
+ * segment gets URBs of its own of at most max_len bytes */
+static int bulk_iovec_num_urbs(struct usbi_transfer *itransfer, int max_len)
+{
+	int num_urbs = 0;
 	int i;
 
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+	for (i = 0; i < itransfer->iov_count; i++) {
+		int seg_len = itransfer->iov[i].length;
 
-		if (!urb)
-			break;
-		free(urb);
+		num_urbs += seg_len / max_len + (seg_len % max_len > 0);
 	}
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	/* a zero-length transfer still needs one URB */
+	return num_urbs ? num_urbs : 1;
+}
+
+static void build_bulk_iovec_urbs(struct usbi_transfer *itransfer,
+	const struct linux_bulk_shape *shape, struct usbfs_urb *urbs,
+	int num_urbs, int max_len)
+{
+	int n = 0;
+	int i;
+
+	if (num_urbs == 1 && !shape->length) {
+		build_bulk_urb(itransfer, shape, &urbs[0], NULL, 0, 1, 1);
+		return;
+	}
+
+	for (i = 0; i < itransfer->iov_count; i++) {
+		unsigned char *buffer = itransfer->iov[i].buffer;
+		int seg_len = itransfer->iov[i].length;
+
+		while (seg_len > 0) {
+			int urb_len = MIN(seg_len, max_len);
+
+			build_bulk_urb(itransfer, shape, &urbs[n], buffer, urb_len,
+				n == 0, n == num_urbs - 1);
+			buffer += urb_len;
+			seg_len -= urb_len;
+			n++;
+		}
+	}
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
@@ -1926,11 +2345,11 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	struct linux_device_handle_priv *hpriv =
 		usbi_get_device_handle_priv(transfer->dev_handle);
+	struct linux_bulk_shape shape;
 	struct usbfs_urb *urbs;
 	int is_out = IS_XFEROUT(transfer);
 	int bulk_buffer_len, use_bulk_continuation;
 	int num_urbs;
-	int last_urb_partial = 0;
 	int r;
 	int i;
 
@@ -1976,62 +2395,95 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		use_bulk_continuation = 0;
 	}
 
-	num_urbs = transfer->length / bulk_buffer_len;
+	if (itransfer->iov_count) {
+		/*
+		 * Scatter-gather transfers submit every segment separately,
+		 * which needs bulk-continuation for short IN transfers to
+		 * end the whole transfer rather than just the segment.
+		 */
+		if (!(hpriv->caps & (USBFS_CAP_BULK_SCATTER_GATHER | USBFS_CAP_NO_PACKET_SIZE_LIM)))
+			bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
+		else
+			bulk_buffer_len = INT_MAX;
+		use_bulk_continuation = !!(hpriv->caps & USBFS_CAP_BULK_CONTINUATION);
+
+		num_urbs = bulk_iovec_num_urbs(itransfer, bulk_buffer_len);
+		if (num_urbs > 1 && !is_out && !use_bulk_continuation) {
+			usbi_dbg(TRANSFER_CTX(transfer), "scatter-gather IN transfers need bulk continuation");
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+	} else {
+		num_urbs = transfer->length / bulk_buffer_len;
 
-	if (transfer->length == 0) {
-		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+		if (transfer->length == 0 || (transfer->length % bulk_buffer_len) > 0)
+			num_urbs++;
 	}
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
-	urbs = calloc(num_urbs, sizeof(*urbs));
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
+
+	memset(&shape, 0, sizeof(shape));
+	shape.buffer = itransfer->iov_count ? NULL : transfer->buffer;
+	shape.length = transfer->length;
+	shape.bulk_buffer_len = bulk_buffer_len;
+	shape.use_bulk_continuation = use_bulk_continuation;
+	shape.stream_id = transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM ?
+		itransfer->stream_id : 0;
+	shape.type = transfer->type;
+	shape.endpoint = transfer->endpoint;
+	shape.zero_packet = is_out && (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET);
+
+	if (num_urbs > tpriv->bulk_urbs_len) {
+		urbs = realloc(tpriv->bulk_urbs, num_urbs * sizeof(*urbs));
+		if (!urbs)
+			return LIBUSB_ERROR_NO_MEM;
+		tpriv->bulk_urbs = urbs;
+		tpriv->bulk_urbs_len = num_urbs;
+		tpriv->bulk_urbs_built = 0;
+	}
+	urbs = tpriv->bulk_urbs;
+
 	tpriv->urbs = urbs;
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
-	for (i = 0; i < num_urbs; i++) {
-		struct usbfs_urb *urb = &urbs[i];
-
-		urb->usercontext = itransfer;
-		switch (transfer->type) {
-		case LIBUSB_TRANSFER_TYPE_BULK:
-			urb->type = USBFS_URB_TYPE_BULK;
-			urb->stream_id = 0;
-			break;
-		case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
-			urb->type = USBFS_URB_TYPE_BULK;
-			urb->stream_id = itransfer->stream_id;
-			break;
-		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-			urb->type = USBFS_URB_TYPE_INTERRUPT;
-			break;
+	if (itransfer->iov_count) {
+		/* the segments may have changed without the array moving, so
+		 * these URBs are never reused */
+		memset(urbs, 0, num_urbs * sizeof(*urbs));
+		build_bulk_iovec_urbs(itransfer, &shape, urbs, num_urbs, bulk_buffer_len);
+		tpriv->bulk_urbs_built = 0;
+	} else if (tpriv->bulk_urbs_built == num_urbs &&
+		   !memcmp(&shape, &tpriv->bulk_shape, sizeof(shape))) {
+		/* resubmission of the same transfer, only reset what the
+		 * kernel reported back last time */
+		for (i = 0; i < num_urbs; i++) {
+			urbs[i].status = 0;
+			urbs[i].actual_length = 0;
+			urbs[i].start_frame = 0;
+			urbs[i].error_count = 0;
 		}
-		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
-
-		/* don't set the short not ok flag for the last URB */
-		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
-			urb->flags = USBFS_URB_SHORT_NOT_OK;
-
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
-
-		if (i > 0 && use_bulk_continuation)
-			urb->flags |= USBFS_URB_BULK_CONTINUATION;
+	} else {
+		memset(urbs, 0, num_urbs * sizeof(*urbs));
+		for (i = 0; i < num_urbs; i++) {
+			int urb_len;
+
+			if (shape.length == 0)
+				urb_len = 0;
+			else if (i == num_urbs - 1 && (shape.length % bulk_buffer_len) > 0)
+				urb_len = shape.length % bulk_buffer_len;
+			else
+				urb_len = bulk_buffer_len;
+			build_bulk_urb(itransfer, &shape, &urbs[i],
+				shape.buffer + (i * bulk_buffer_len), urb_len,
+				i == 0, i == num_urbs - 1);
+		}
+		tpriv->bulk_urbs_built = num_urbs;
+		memcpy(&tpriv->bulk_shape, &shape, sizeof(shape));
+	}
 
-		/* we have already checked that the flag is supported */
-		if (is_out && i == num_urbs - 1 &&
-		    (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET))
-			urb->flags |= USBFS_URB_ZERO_PACKET;
+	for (i = 0; i < num_urbs; i++) {
+		struct usbfs_urb *urb = &urbs[i];
 
 		r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 		if (r == 0)
@@ -2050,7 +2502,6 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free(urbs);
 			tpriv->urbs = NULL;
 			return r;
 		}
@@ -2098,7 +2549,6 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	struct linux_device_handle_priv *hpriv =
 		usbi_get_device_handle_priv(transfer->dev_handle);
-	struct usbfs_urb **urbs;
 	int num_packets = transfer->num_iso_packets;
 	int num_packets_remaining;
 	int i, j;
@@ -2107,7 +2557,8 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	unsigned int total_len = 0;
 	unsigned char *urb_buffer = transfer->buffer;
 
-	if (num_packets < 1)
+	/* the slab only has room for the packets the transfer was allocated with */
+	if (num_packets < 1 || num_packets > itransfer->num_iso_packets)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
 	/* usbfs places arbitrary limits on iso URBs. this limit has changed
@@ -2136,44 +2587,40 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
 
-	urbs = calloc(num_urbs, sizeof(*urbs));
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
-
-	tpriv->iso_urbs = urbs;
+	tpriv->iso_urbs = iso_urb(itransfer, 0);
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
 	tpriv->iso_packet_offset = 0;
 
-	/* allocate + initialize each URB with the correct number of packets */
+	/* initialize each URB with the correct number of packets */
 	num_packets_remaining = num_packets;
 	for (i = 0, j = 0; i < num_urbs; i++) {
 		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
-		struct usbfs_urb *urb;
-		size_t alloc_size;
+		struct usbfs_urb *urb = iso_urb(itransfer, i);
 		int k;
 
-		alloc_size = sizeof(*urb)
-			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		urbs[i] = urb;
+		memset(urb, 0, sizeof(*urb));
 
 		/* populate packet lengths */
 		for (k = 0; k < num_packets_in_urb; j++, k++) {
+			struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[k];
+
 			packet_len = transfer->iso_packet_desc[j].length;
 			urb->buffer_length += packet_len;
-			urb->iso_frame_desc[k].length = packet_len;
+			urb_desc->length = packet_len;
+			urb_desc->actual_length = 0;
+			urb_desc->status = 0;
 		}
 
 		urb->usercontext = itransfer;
 		urb->type = USBFS_URB_TYPE_ISO;
-		/* FIXME: interface for non-ASAP data? */
-		urb->flags = USBFS_URB_ISO_ASAP;
+		/* only the first URB of a scheduled transfer gets a start
+		 * frame, the others are queued right behind it */
+		if (i == 0 && itransfer->iso_start_frame_set)
+			urb->start_frame = (int)itransfer->iso_start_frame;
+		else
+			urb->flags = USBFS_URB_ISO_ASAP;
 		urb->endpoint = transfer->endpoint;
 		urb->number_of_packets = num_packets_in_urb;
 		urb->buffer = urb_buffer;
@@ -2184,7 +2631,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, iso_urb(itransfer, i));
 
 		if (r == 0)
 			continue;
@@ -2206,7 +2653,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free_iso_urbs(tpriv);
+			tpriv->iso_urbs = NULL;
 			return r;
 		}
 
@@ -2251,9 +2698,8 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(*urb));
-	if (!urb)
-		return LIBUSB_ERROR_NO_MEM;
+	urb = &tpriv->control_urb;
+	memset(urb, 0, sizeof(*urb));
 	tpriv->urbs = urb;
 	tpriv->num_urbs = 1;
 	tpriv->reap_action = NORMAL;
@@ -2266,7 +2712,6 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2333,25 +2778,31 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		tpriv->urbs = NULL;
+		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		tpriv->urbs = NULL;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
-			free_iso_urbs(tpriv);
-			tpriv->iso_urbs = NULL;
-		}
+		tpriv->iso_urbs = NULL;
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer), "unknown transfer type %u", transfer->type);
 	}
 }
 
+static void op_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	free(tpriv->bulk_urbs);
+	tpriv->bulk_urbs = NULL;
+	tpriv->bulk_urbs_len = 0;
+	tpriv->bulk_urbs_built = 0;
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
@@ -2385,7 +2836,21 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 * (closing any holes), so that libusb reports the total amount of
 		 * transferred data and presents it in a contiguous chunk.
 		 */
-		if (urb->actual_length > 0) {
+		if (urb->actual_length > 0 && itransfer->iov_count) {
+			/* segments cannot be compacted, so surplus data only
+			 * counts if it directly follows the data received so far */
+			int offset = 0;
+			int i;
+
+			for (i = 0; i < urb_idx; i++)
+				offset += tpriv->urbs[i].buffer_length;
+			if (offset == itransfer->transferred) {
+				usbi_dbg(TRANSFER_CTX(transfer), "received %d bytes of surplus data", urb->actual_length);
+				itransfer->transferred += urb->actual_length;
+			} else {
+				usbi_dbg(TRANSFER_CTX(transfer), "dropping %d bytes of surplus data", urb->actual_length);
+			}
+		} else if (urb->actual_length > 0) {
 			unsigned char *target = transfer->buffer + itransfer->transferred;
 
 			usbi_dbg(TRANSFER_CTX(transfer), "received %d bytes of surplus data", urb->actual_length);
@@ -2481,7 +2946,6 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return tpriv->reap_action == CANCELLED ?
@@ -2496,17 +2960,15 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	int num_urbs = tpriv->num_urbs;
+	size_t urb_offset = (size_t)((unsigned char *)urb - (unsigned char *)itransfer->slab);
 	int urb_idx = 0;
+	struct libusb_iso_packet_descriptor *lib_descs;
 	int i;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
 	usbi_mutex_lock(&itransfer->lock);
-	for (i = 0; i < num_urbs; i++) {
-		if (urb == tpriv->iso_urbs[i]) {
-			urb_idx = i + 1;
-			break;
-		}
-	}
+	if (!(urb_offset % ISO_URB_STRIDE) && urb_offset / ISO_URB_STRIDE < (size_t)num_urbs)
+		urb_idx = (int)(urb_offset / ISO_URB_STRIDE) + 1;
 	if (urb_idx == 0) {
 		usbi_err(TRANSFER_CTX(transfer), "could not locate urb!");
 		usbi_mutex_unlock(&itransfer->lock);
@@ -2516,12 +2978,26 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg(TRANSFER_CTX(transfer), "handling completion status %d of iso urb %d/%d", urb->status,
 		 urb_idx, num_urbs);
 
-	/* copy isochronous results back in */
+	if (urb_idx == 1)
+		itransfer->iso_start_frame = (unsigned int)urb->start_frame;
+
+	/* copy isochronous results back in. where the usbfs and libusb packet
+	 * descriptors share their layout, the lengths are taken over with a
+	 * single copy, which also leaves LIBUSB_TRANSFER_COMPLETED (0) as the
+	 * status of every packet the kernel reported as good. only packets
+	 * with a non-zero status need translating. */
+	lib_descs = &transfer->iso_packet_desc[tpriv->iso_packet_offset];
+	if (ISO_PACKET_DESC_LAYOUT_MATCHES)
+		memcpy(lib_descs, urb->iso_frame_desc,
+		       (size_t)urb->number_of_packets * sizeof(*lib_descs));
+	tpriv->iso_packet_offset += urb->number_of_packets;
 
 	for (i = 0; i < urb->number_of_packets; i++) {
 		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
-		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
+		struct libusb_iso_packet_descriptor *lib_desc = &lib_descs[i];
+
+		if (ISO_PACKET_DESC_LAYOUT_MATCHES && !urb_desc->status)
+			continue;
 
 		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
 		switch (urb_desc->status) {
@@ -2568,7 +3044,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg(TRANSFER_CTX(transfer), "CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			tpriv->iso_urbs = NULL;
 			if (tpriv->reap_action == CANCELLED) {
 				usbi_mutex_unlock(&itransfer->lock);
 				return usbi_handle_transfer_cancellation(itransfer);
@@ -2599,7 +3075,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we've reaped all urbs then we're done */
 	if (tpriv->num_retired == num_urbs) {
 		usbi_dbg(TRANSFER_CTX(transfer), "all URBs in transfer reaped --> complete!");
-		free_iso_urbs(tpriv);
+		tpriv->iso_urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
@@ -2624,7 +3100,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer), "cancel: unrecognised urb status %d",
 				  urb->status);
-		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
@@ -2664,7 +3139,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
@@ -2709,35 +3183,71 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* reap up to REAP_SLICE URBs from a device, within its budget for this
+ * round of event handling. returns 1 when the device is done for this
+ * round, 0 if it may have more URBs to reap or a LIBUSB_ERROR code. */
+static int reap_slice_for_handle(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	unsigned int max_budget = max_reap_budget(HANDLE_CTX(handle));
+	unsigned int slice = MIN(REAP_SLICE, hpriv->reap_budget - hpriv->reaped);
+	int r = 0;
+
+	while (slice--) {
+		r = reap_for_handle(handle);
+		if (r)
+			break;
+		hpriv->reaped++;
+	}
+
+	if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE) {
+		/* drained, give back what was not needed */
+		if (hpriv->reaped < hpriv->reap_budget / 2)
+			hpriv->reap_budget = MAX(hpriv->reap_budget / 2, MIN(REAP_BUDGET_MIN, max_budget));
+		return 1;
+	} else if (r < 0) {
+		return r;
+	}
+
+	if (hpriv->reaped < hpriv->reap_budget)
+		return 0;
+
+	/* there may well be more to reap, allow for more next time */
+	(void)usbi_atomic_inc(&hpriv->reap_budget_exhausted);
+	usbi_dbg(HANDLE_CTX(handle), "reap budget of %u exhausted for fd %d",
+		 hpriv->reap_budget, hpriv->fd);
+	hpriv->reap_budget = MIN(2 * hpriv->reap_budget, max_budget);
+	return 1;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int count, unsigned int num_ready)
 {
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 	struct pollfd *fds = event_data;
-	unsigned int n;
+	unsigned int n, num_reaping = 0;
 	int r;
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (n = 0; n < count && num_ready > 0; n++) {
 		struct pollfd *pollfd = &fds[n];
-		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
-		int reap_count;
+		struct libusb_device_handle *handle = NULL;
+		struct linux_device_handle_priv *hpriv;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		for_each_open_device(ctx, handle) {
-			hpriv = usbi_get_device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
+		if ((unsigned int)pollfd->fd < cpriv->fd_handles_len)
+			handle = cpriv->fd_handles[pollfd->fd];
 
-		if (!hpriv || hpriv->fd != pollfd->fd) {
+		if (!handle) {
 			usbi_err(ctx, "cannot find handle for fd %d",
 				 pollfd->fd);
+			pollfd->revents = 0;
 			continue;
 		}
+		hpriv = usbi_get_device_handle_priv(handle);
 
 		if (pollfd->revents & POLLERR) {
 			/* remove the fd from the pollfd set so that it doesn't continuously
@@ -2761,18 +3271,32 @@ static int op_handle_events(struct libusb_context *ctx,
 			}
 
 			usbi_handle_disconnect(handle);
+			pollfd->revents = 0;
 			continue;
 		}
 
-		reap_count = 0;
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0 && ++reap_count <= 25);
+		hpriv->reaped = 0;
+		num_reaping++;
+	}
 
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
-			goto out;
+	/* serve the ready devices in turns, so that a device with many
+	 * completions cannot hold up the others. the revents of a device that
+	 * is done are cleared to skip it in later turns */
+	while (num_reaping) {
+		for (n = 0; n < count; n++) {
+			struct pollfd *pollfd = &fds[n];
+
+			if (!pollfd->revents)
+				continue;
+
+			r = reap_slice_for_handle(cpriv->fd_handles[pollfd->fd]);
+			if (r < 0)
+				goto out;
+			if (r == 1) {
+				pollfd->revents = 0;
+				num_reaping--;
+			}
+		}
 	}
 
 	r = 0;
@@ -2783,7 +3307,7 @@ out:
 
 const struct usbi_os_backend usbi_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_SUPPORTS_BULK_IOVEC,
 	.init = op_init,
 	.exit = op_exit,
 	.set_option = op_set_option,
@@ -2802,7 +3326,9 @@ const struct usbi_os_backend usbi_backend = {
 
 	.set_interface_altsetting = op_set_interface,
 	.clear_halt = op_clear_halt,
+	.reset_endpoint = op_reset_endpoint,
 	.reset_device = op_reset_device,
+	.get_handle_stats = op_get_handle_stats,
 
 	.alloc_streams = op_alloc_streams,
 	.free_streams = op_free_streams,
@@ -2819,6 +3345,11 @@ const struct usbi_os_backend usbi_backend = {
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.free_transfer_priv = op_free_transfer_priv,
+	.transfer_slab_size = op_transfer_slab_size,
+
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 
 	.handle_events = op_handle_events,
 
@@ -40,6 +40,16 @@ struct usbfs_ctrltransfer {
 	void *data;
 };
 
+struct usbfs_bulktransfer {
+	/* keep in sync with usbdevice_fs.h:usbdevfs_bulktransfer */
+	unsigned int ep;
+	unsigned int len;
+	unsigned int timeout;	/* in milliseconds */
+
+	/* pointer to data */
+	void *data;
+};
+
 struct usbfs_setinterface {
 	/* keep in sync with usbdevice_fs.h:usbdevfs_setinterface */
 	unsigned int interface;
@@ -136,6 +146,8 @@ struct usbfs_streams {
 #define USBFS_SPEED_SUPER_PLUS			6
 
 #define IOCTL_USBFS_CONTROL		_IOWR('U', 0, struct usbfs_ctrltransfer)
+#define IOCTL_USBFS_BULK		_IOWR('U', 2, struct usbfs_bulktransfer)
+#define IOCTL_USBFS_RESETEP		_IOR('U', 3, unsigned int)
 #define IOCTL_USBFS_SETINTERFACE	_IOR('U', 4, struct usbfs_setinterface)
 #define IOCTL_USBFS_SETCONFIGURATION	_IOR('U', 5, unsigned int)
 #define IOCTL_USBFS_GETDRIVER		_IOW('U', 8, struct usbfs_getdriver)
@@ -902,7 +902,10 @@ const struct usbi_os_backend usbi_backend = {
 	windows_release_interface,
 	windows_set_interface_altsetting,
 	windows_clear_halt,
+	NULL,	/* reset_endpoint */
 	windows_reset_device,
+	NULL,	/* get_frame_number */
+	NULL,	/* get_handle_stats */
 	NULL,	/* alloc_streams */
 	NULL,	/* free_streams */
 	NULL,	/* dev_mem_alloc */
@@ -914,6 +917,10 @@ const struct usbi_os_backend usbi_backend = {
 	windows_submit_transfer,
 	windows_cancel_transfer,
 	NULL,	/* clear_transfer_priv */
+	NULL,	/* free_transfer_priv */
+	NULL,	/* transfer_slab_size */
+	NULL,	/* sync_control_transfer */
+	NULL,	/* sync_bulk_transfer */
 	NULL,	/* handle_events */
 	windows_handle_transfer_completion,
 	sizeof(struct windows_context_priv),
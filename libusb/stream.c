@@ -0,0 +1,508 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Continuous bulk streaming for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libusbi.h"
+
+#include <limits.h>
+
+/**
+ * @defgroup libusb_stream Streaming I/O
+ *
+ * This page documents libusb's streaming API, which moves a continuous flow
+ * of data through a bulk endpoint.
+ *
+ * Applications that need the full bandwidth of an endpoint have to keep
+ * several transfers in flight at all times, and resubmit each one as soon as
+ * it completes. A stream does this on their behalf: it owns a ring of
+ * buffers, keeps up to \p depth transfers submitted on the endpoint, and
+ * hands data to the application through libusb_stream_acquire() and
+ * libusb_stream_commit() instead of per-transfer callbacks.
+ *
+ * For an IN endpoint, libusb_stream_acquire() returns the oldest received
+ * data that has not been consumed yet, and libusb_stream_commit() consumes
+ * it. For an OUT endpoint, libusb_stream_acquire() returns free space in the
+ * ring, and libusb_stream_commit() queues the bytes written to it for
+ * sending. Neither function blocks; the stream makes progress while the
+ * application handles events, as with the
+ * \ref libusb_asyncio "asynchronous API".
+ *
+ * The ring holds twice as many buffers as there are transfers in flight. If
+ * the application falls so far behind that an IN endpoint is left without
+ * any transfer, an overrun is counted. Likewise an underrun is counted when
+ * an OUT endpoint runs out of queued data. See libusb_stream_get_stats().
+ */
+
+enum stream_slot_state {
+	/* IN: waiting to be submitted. OUT: being filled by the user */
+	STREAM_SLOT_FREE,
+	STREAM_SLOT_IN_FLIGHT,
+	/* IN: holding data for the user. OUT: waiting to be submitted */
+	STREAM_SLOT_READY,
+};
+
+struct stream_slot {
+	struct libusb_stream *stream;
+	struct libusb_transfer *transfer;
+	enum stream_slot_state state;
+
+	/* IN: bytes already consumed by the user. OUT: bytes filled in */
+	int offset;
+};
+
+struct libusb_stream {
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+	int transfer_size;
+	int depth;
+
+	/* The ring, from device memory if it could be had */
+	unsigned char *buffer;
+	size_t buffer_size;
+	int buffer_is_dev_mem;
+
+	struct stream_slot *slots;
+	int num_slots;
+
+	/* Protects the fields below and the slots */
+	usbi_mutex_t lock;
+
+	/* Next slot to submit, and the slot the user is reading from (IN)
+	 * or writing to (OUT). Both advance around the ring in order */
+	int submit_idx;
+	int user_idx;
+
+	int in_flight;
+	int closing;
+
+	/* Set by libusb_stream_close() once no transfer is in flight */
+	int drained;
+
+	/* First error the stream ran into, stops all submissions */
+	int error;
+
+	struct libusb_stream_stats stats;
+};
+
+#define STREAM_IS_IN(stream)	IS_EPIN((stream)->endpoint)
+
+static int stream_transfer_error(struct libusb_stream *stream,
+	enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(HANDLE_CTX(stream->dev_handle),
+			"unrecognised status code %d", status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+static int stream_next(struct libusb_stream *stream, int idx)
+{
+	return idx + 1 == stream->num_slots ? 0 : idx + 1;
+}
+
+/* Submit slots in ring order until depth transfers are in flight or the
+ * next slot is not ready to go. Called with the stream lock held. */
+static void stream_submit_locked(struct libusb_stream *stream)
+{
+	while (!stream->error && !stream->closing &&
+	       stream->in_flight < stream->depth) {
+		struct stream_slot *slot = &stream->slots[stream->submit_idx];
+		int r;
+
+		if (STREAM_IS_IN(stream)) {
+			if (slot->state != STREAM_SLOT_FREE)
+				break;
+			slot->transfer->length = stream->transfer_size;
+		} else {
+			if (slot->state != STREAM_SLOT_READY)
+				break;
+			slot->transfer->length = slot->offset;
+		}
+
+		r = libusb_submit_transfer(slot->transfer);
+		if (r < 0) {
+			usbi_dbg(HANDLE_CTX(stream->dev_handle), "stream %p submit failed: %s",
+				 (void *) stream, libusb_error_name(r));
+			stream->error = r;
+			break;
+		}
+
+		slot->state = STREAM_SLOT_IN_FLIGHT;
+		stream->in_flight++;
+		stream->submit_idx = stream_next(stream, stream->submit_idx);
+	}
+}
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_slot *slot = transfer->user_data;
+	struct libusb_stream *stream = slot->stream;
+
+	usbi_mutex_lock(&stream->lock);
+	stream->in_flight--;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		stream->stats.bytes_transferred += (uint64_t)transfer->actual_length;
+	} else if (!stream->closing && !stream->error) {
+		stream->error = stream_transfer_error(stream, transfer->status);
+		usbi_dbg(HANDLE_CTX(stream->dev_handle), "stream %p stopped: %s",
+			 (void *) stream, libusb_error_name(stream->error));
+	}
+
+	/* IN data, even a partial one from a failed transfer, is handed to
+	 * the user in order. An OUT buffer can be refilled right away */
+	slot->offset = 0;
+	slot->state = STREAM_IS_IN(stream) ? STREAM_SLOT_READY : STREAM_SLOT_FREE;
+
+	stream_submit_locked(stream);
+
+	if (!stream->in_flight) {
+		if (stream->closing) {
+			stream->drained = 1;
+		} else if (!stream->error) {
+			if (STREAM_IS_IN(stream))
+				stream->stats.overruns++;
+			else
+				stream->stats.underruns++;
+		}
+	}
+	usbi_mutex_unlock(&stream->lock);
+}
+
+static void stream_free(struct libusb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_slots; i++)
+		libusb_free_transfer(stream->slots[i].transfer);
+	free(stream->slots);
+
+	if (stream->buffer_is_dev_mem)
+		libusb_dev_mem_free(stream->dev_handle, stream->buffer, stream->buffer_size);
+	else
+		free(stream->buffer);
+
+	usbi_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/** \ingroup libusb_stream
+ * Open a stream on a bulk endpoint. The ring buffer and all transfers are
+ * allocated up front. For an IN endpoint, \p depth transfers are submitted
+ * right away; for an OUT endpoint, transfers are submitted as data is
+ * committed.
+ *
+ * The ring is taken from device memory (see libusb_dev_mem_alloc()) where
+ * available, and from the heap otherwise.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid bulk endpoint
+ * \param transfer_size the length of each transfer, which should be a
+ * multiple of the endpoint's maximum packet size
+ * \param depth the number of transfers to keep in flight
+ * \param stream output location for the new stream. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if submitting the first transfers
+ * failed
+ * \see libusb_stream_close()
+ */
+int API_EXPORTED libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int transfer_size, int depth,
+	libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	int i, r = 0;
+
+	if (!dev_handle || !stream || transfer_size <= 0 || depth <= 0 ||
+	    depth > INT_MAX / 2 ||
+	    (size_t)transfer_size > SIZE_MAX / 2 / (size_t)depth)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_stream = calloc(1, sizeof(*_stream));
+	if (!_stream)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_stream->dev_handle = dev_handle;
+	_stream->endpoint = endpoint;
+	_stream->transfer_size = transfer_size;
+	_stream->depth = depth;
+	_stream->num_slots = 2 * depth;
+	usbi_mutex_init(&_stream->lock);
+
+	_stream->buffer_size = (size_t)_stream->num_slots * (size_t)transfer_size;
+	_stream->buffer = libusb_dev_mem_alloc(dev_handle, _stream->buffer_size);
+	if (_stream->buffer)
+		_stream->buffer_is_dev_mem = 1;
+	else
+		_stream->buffer = malloc(_stream->buffer_size);
+
+	_stream->slots = calloc((size_t)_stream->num_slots, sizeof(*_stream->slots));
+	if (!_stream->buffer || !_stream->slots) {
+		stream_free(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < _stream->num_slots; i++) {
+		struct stream_slot *slot = &_stream->slots[i];
+
+		slot->stream = _stream;
+		slot->transfer = libusb_alloc_transfer(0);
+		if (!slot->transfer) {
+			stream_free(_stream);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		libusb_fill_bulk_transfer(slot->transfer, dev_handle, endpoint,
+			_stream->buffer + (size_t)i * (size_t)transfer_size,
+			transfer_size, stream_transfer_cb, slot, 0);
+	}
+
+	if (STREAM_IS_IN(_stream)) {
+		usbi_mutex_lock(&_stream->lock);
+		stream_submit_locked(_stream);
+		r = _stream->in_flight ? 0 : _stream->error;
+		usbi_mutex_unlock(&_stream->lock);
+	}
+
+	if (r < 0) {
+		stream_free(_stream);
+		return r;
+	}
+
+	usbi_dbg(HANDLE_CTX(dev_handle), "stream %p on ep 0x%02x, %d transfers of %d bytes%s",
+		 (void *) _stream, endpoint, depth, transfer_size,
+		 _stream->buffer_is_dev_mem ? " in device memory" : "");
+	*stream = _stream;
+	return 0;
+}
+
+/** \ingroup libusb_stream
+ * Close a stream. Transfers still in flight are cancelled, and this function
+ * handles events until they have all completed, so it must not be called
+ * from a transfer callback. Data that has not been transferred yet is
+ * discarded; for an OUT endpoint, wait for libusb_stream_get_stats() to
+ * report all bytes as transferred first if that matters.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream to close. If NULL then this function simply
+ * returns.
+ */
+void API_EXPORTED libusb_stream_close(libusb_stream *stream)
+{
+	struct libusb_context *ctx;
+	int i, r;
+
+	if (!stream)
+		return;
+
+	ctx = HANDLE_CTX(stream->dev_handle);
+	usbi_dbg(ctx, "stream %p", (void *) stream);
+
+	usbi_mutex_lock(&stream->lock);
+	stream->closing = 1;
+	stream->drained = !stream->in_flight;
+	for (i = 0; i < stream->num_slots; i++) {
+		if (stream->slots[i].state == STREAM_SLOT_IN_FLIGHT)
+			libusb_cancel_transfer(stream->slots[i].transfer);
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	while (!stream->drained) {
+		r = libusb_handle_events_completed(ctx, &stream->drained);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				 libusb_error_name(r));
+	}
+
+	stream_free(stream);
+}
+
+/** \ingroup libusb_stream
+ * Get the next contiguous region of the ring. For an IN endpoint, this is
+ * data received from the device that has not been consumed yet. For an OUT
+ * endpoint, this is free space for data to be sent.
+ *
+ * The region stays valid until it is passed to libusb_stream_commit(). A
+ * return value of 0 means that nothing is available right now, and that
+ * events need to be handled for the stream to make progress.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream
+ * \param data output location for the start of the region
+ * \returns the length of the region in bytes, possibly 0
+ * \returns the LIBUSB_ERROR code the stream stopped with, once an IN stream
+ * has no more data or an OUT stream has failed
+ */
+int API_EXPORTED libusb_stream_acquire(libusb_stream *stream,
+	unsigned char **data)
+{
+	struct stream_slot *slot;
+	int r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	slot = &stream->slots[stream->user_idx];
+
+	if (STREAM_IS_IN(stream)) {
+		/* skip over empty transfers */
+		while (slot->state == STREAM_SLOT_READY &&
+		       slot->offset == slot->transfer->actual_length) {
+			slot->state = STREAM_SLOT_FREE;
+			stream->user_idx = stream_next(stream, stream->user_idx);
+			slot = &stream->slots[stream->user_idx];
+			stream_submit_locked(stream);
+		}
+
+		if (slot->state == STREAM_SLOT_READY) {
+			*data = slot->transfer->buffer + slot->offset;
+			r = slot->transfer->actual_length - slot->offset;
+		} else if (stream->error) {
+			r = stream->error;
+		}
+	} else {
+		if (stream->error) {
+			r = stream->error;
+		} else if (slot->state == STREAM_SLOT_FREE) {
+			*data = slot->transfer->buffer + slot->offset;
+			r = stream->transfer_size - slot->offset;
+		}
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_stream
+ * Hand back the first \p length bytes of the region returned by
+ * libusb_stream_acquire(). For an IN endpoint, the data is consumed and its
+ * buffer is reused for another transfer once it has been consumed entirely.
+ * For an OUT endpoint, the data is queued, and sent as soon as a whole
+ * transfer worth of data has been queued; see libusb_stream_flush() to send
+ * less than that.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream
+ * \param length number of bytes to commit, at most the length returned by
+ * the last call to libusb_stream_acquire()
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if \p length is out of range
+ */
+int API_EXPORTED libusb_stream_commit(libusb_stream *stream, int length)
+{
+	struct stream_slot *slot;
+	int r = 0;
+
+	if (length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&stream->lock);
+	slot = &stream->slots[stream->user_idx];
+
+	if (STREAM_IS_IN(stream)) {
+		if (slot->state != STREAM_SLOT_READY ||
+		    length > slot->transfer->actual_length - slot->offset) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		} else {
+			slot->offset += length;
+			if (slot->offset == slot->transfer->actual_length) {
+				slot->state = STREAM_SLOT_FREE;
+				stream->user_idx = stream_next(stream, stream->user_idx);
+				stream_submit_locked(stream);
+			}
+		}
+	} else {
+		if (slot->state != STREAM_SLOT_FREE ||
+		    length > stream->transfer_size - slot->offset) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		} else {
+			slot->offset += length;
+			if (slot->offset == stream->transfer_size) {
+				slot->state = STREAM_SLOT_READY;
+				stream->user_idx = stream_next(stream, stream->user_idx);
+				stream_submit_locked(stream);
+			}
+		}
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_stream
+ * Send the data committed to an OUT stream without waiting for a whole
+ * transfer worth of it. The data goes out as a short transfer.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream
+ * \returns 0 on success, including when there was nothing to send
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if this is an IN stream
+ */
+int API_EXPORTED libusb_stream_flush(libusb_stream *stream)
+{
+	struct stream_slot *slot;
+
+	if (STREAM_IS_IN(stream))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&stream->lock);
+	slot = &stream->slots[stream->user_idx];
+	if (slot->state == STREAM_SLOT_FREE && slot->offset) {
+		slot->state = STREAM_SLOT_READY;
+		stream->user_idx = stream_next(stream, stream->user_idx);
+		stream_submit_locked(stream);
+	}
+	usbi_mutex_unlock(&stream->lock);
+
+	return 0;
+}
+
+/** \ingroup libusb_stream
+ * Get the statistics of a stream.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param stream the stream
+ * \param stats output location for the statistics
+ */
+void API_EXPORTED libusb_stream_get_stats(libusb_stream *stream,
+	struct libusb_stream_stats *stats)
+{
+	usbi_mutex_lock(&stream->lock);
+	*stats = stream->stats;
+	usbi_mutex_unlock(&stream->lock);
+}
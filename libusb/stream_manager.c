@@ -0,0 +1,535 @@
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * USB 3 bulk stream management for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libusbi.h"
+
+#include <string.h>
+
+/**
+ * @defgroup libusb_stream_manager Bulk stream management
+ *
+ * This page documents libusb's stream manager API, which shares the bulk
+ * streams of USB 3 endpoints among the commands of an application.
+ *
+ * Protocols such as UAS run many commands at once, each on its own stream
+ * ID, and the device completes them in any order. A stream manager
+ * allocates the streams with libusb_alloc_streams() and takes care of the
+ * stream IDs: libusb_stream_manager_submit() submits the transfers of one
+ * command, for instance its data and status transfers, on a free stream ID.
+ * Once all of them have completed, the ID is handed to the next command.
+ *
+ * When all streams are busy, commands are queued and submitted in order as
+ * streams become free, so that as many streams as were allocated are kept in
+ * flight. The transfers of a command are otherwise ordinary transfers, with
+ * their callbacks invoked as usual. Statistics are kept for every stream,
+ * see libusb_stream_manager_get_stream_stats().
+ */
+
+struct stream_manager_slot {
+	struct libusb_stream_manager *mgr;
+	uint32_t stream_id;
+
+	/* The transfers of the command using the stream. Completed ones are
+	 * set to NULL, pending counts the others */
+	struct libusb_transfer **transfers;
+	int num_transfers;
+	int capacity;
+	int pending;
+
+	/* Link in the stack of free streams */
+	struct stream_manager_slot *next_free;
+
+	struct libusb_bulk_stream_stats stats;
+};
+
+/* A command waiting for a free stream */
+struct stream_manager_command {
+	struct list_head list;
+	int num_transfers;
+	struct libusb_transfer *transfers[LIBUSB_FLEXIBLE_ARRAY];
+};
+
+struct libusb_stream_manager {
+	struct libusb_device_handle *dev_handle;
+	unsigned char *endpoints;
+	int num_endpoints;
+
+	struct stream_manager_slot *slots;
+	uint32_t num_streams;
+
+	/* Protects the fields below, and the slots */
+	usbi_mutex_t lock;
+	struct stream_manager_slot *free_slots;
+	struct list_head queue;
+	int closing;
+
+	/* Set by libusb_stream_manager_close() once no transfer is pending */
+	int drained;
+};
+
+#define STREAM_COMMAND_SIZE(num_transfers) \
+	(sizeof(struct stream_manager_command) + \
+	 (size_t)(num_transfers) * sizeof(struct libusb_transfer *))
+
+/* Complete transfers that never reached the backend. This runs on the thread
+ * that handles the events or closes the manager; like the event handler, it
+ * invokes the callbacks with the event waiters lock held, and then wakes up
+ * the threads waiting for one of these transfers. */
+static void stream_manager_fail_transfers(struct libusb_context *ctx,
+	struct libusb_transfer **transfers, int num_transfers,
+	enum libusb_transfer_status status)
+{
+	int i;
+
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+		struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+		uint8_t flags = transfer->flags;
+
+		transfer->status = status;
+		transfer->actual_length = 0;
+		if (itransfer->cq) {
+			usbi_cq_push(itransfer);
+			continue;
+		}
+		if (transfer->callback) {
+			libusb_lock_event_waiters(ctx);
+			transfer->callback(transfer);
+			libusb_unlock_event_waiters(ctx);
+		}
+		if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+	}
+
+	libusb_lock_event_waiters(ctx);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	libusb_unlock_event_waiters(ctx);
+}
+
+/* Submit the transfers of a command on a free stream. Transfers after one
+ * that fails to submit are left alone, their number is returned through
+ * num_failed. Called with the manager lock held. */
+static int stream_manager_start_locked(struct stream_manager_slot *slot,
+	struct libusb_transfer **transfers, int num_transfers, int *num_failed)
+{
+	struct libusb_context *ctx = HANDLE_CTX(slot->mgr->dev_handle);
+	int i, r = 0;
+
+	if (num_transfers > slot->capacity) {
+		struct libusb_transfer **grown =
+			realloc(slot->transfers, (size_t)num_transfers * sizeof(*grown));
+
+		if (!grown) {
+			*num_failed = num_transfers;
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		slot->transfers = grown;
+		slot->capacity = num_transfers;
+	}
+
+	slot->num_transfers = num_transfers;
+	slot->pending = 0;
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+		struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+		transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+		libusb_transfer_set_stream_id(transfer, slot->stream_id);
+		itransfer->stream_slot = slot;
+		slot->transfers[i] = transfer;
+		slot->pending++;
+
+		r = libusb_submit_transfer(transfer);
+		if (r < 0) {
+			usbi_dbg(ctx, "stream %u: submitting transfer %p failed: %s",
+				 slot->stream_id, (void *) transfer, libusb_error_name(r));
+			itransfer->stream_slot = NULL;
+			slot->transfers[i] = NULL;
+			slot->pending--;
+			break;
+		}
+	}
+
+	*num_failed = num_transfers - i;
+	return r;
+}
+
+/* Put a stream whose command has completed back to use, either for the next
+ * queued command or on the free stack. Called with the manager lock held.
+ * Queued transfers that failed to submit are moved to failed, to be
+ * completed once the lock has been dropped. */
+static void stream_manager_recycle_locked(struct stream_manager_slot *slot,
+	struct list_head *failed)
+{
+	struct libusb_stream_manager *mgr = slot->mgr;
+	uint32_t i;
+
+	slot->num_transfers = 0;
+	slot->stats.commands++;
+
+	while (!mgr->closing && !list_empty(&mgr->queue)) {
+		struct stream_manager_command *cmd =
+			list_first_entry(&mgr->queue, struct stream_manager_command, list);
+		int num_failed;
+
+		list_del(&cmd->list);
+		stream_manager_start_locked(slot, cmd->transfers, cmd->num_transfers, &num_failed);
+		if (num_failed) {
+			/* keep only the transfers that were not submitted */
+			memmove(cmd->transfers, cmd->transfers + cmd->num_transfers - num_failed,
+				(size_t)num_failed * sizeof(cmd->transfers[0]));
+			cmd->num_transfers = num_failed;
+			slot->stats.errors += (unsigned int)num_failed;
+			list_add_tail(&cmd->list, failed);
+		} else {
+			free(cmd);
+		}
+
+		/* if nothing went out, the stream is still free */
+		if (slot->pending)
+			return;
+	}
+
+	slot->next_free = mgr->free_slots;
+	mgr->free_slots = slot;
+
+	if (mgr->closing) {
+		for (i = 0; i < mgr->num_streams; i++) {
+			if (mgr->slots[i].pending)
+				return;
+		}
+		mgr->drained = 1;
+	}
+}
+
+/* Called by usbi_handle_transfer_completion() for transfers submitted through
+ * a stream manager, before their callback is invoked */
+void usbi_stream_manager_transfer_done(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct stream_manager_slot *slot = itransfer->stream_slot;
+	struct libusb_stream_manager *mgr = slot->mgr;
+	struct stream_manager_command *cmd, *tmp;
+	struct list_head failed;
+	int i;
+
+	itransfer->stream_slot = NULL;
+	list_init(&failed);
+
+	usbi_mutex_lock(&mgr->lock);
+	for (i = 0; i < slot->num_transfers; i++) {
+		if (slot->transfers[i] == transfer) {
+			slot->transfers[i] = NULL;
+			break;
+		}
+	}
+
+	slot->stats.transfers++;
+	slot->stats.bytes += (uint64_t)transfer->actual_length;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		slot->stats.errors++;
+
+	if (!--slot->pending)
+		stream_manager_recycle_locked(slot, &failed);
+	usbi_mutex_unlock(&mgr->lock);
+
+	list_for_each_entry_safe(cmd, tmp, &failed, list, struct stream_manager_command) {
+		list_del(&cmd->list);
+		stream_manager_fail_transfers(HANDLE_CTX(mgr->dev_handle), cmd->transfers,
+			cmd->num_transfers, LIBUSB_TRANSFER_ERROR);
+		free(cmd);
+	}
+}
+
+/** \ingroup libusb_stream_manager
+ * Allocate bulk streams on a set of endpoints and create a manager for them.
+ * The endpoints are those a command uses, for instance the data and status
+ * endpoints of a UAS interface, which must all belong to the same claimed
+ * interface.
+ *
+ * The device may grant fewer streams than requested, see
+ * libusb_stream_manager_get_num_streams().
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoints array of endpoints to allocate streams on
+ * \param num_endpoints length of the endpoints array
+ * \param num_streams number of streams to try to allocate
+ * \param mgr output location for the new manager. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if the streams could not be allocated
+ * \see libusb_stream_manager_close()
+ */
+int API_EXPORTED libusb_stream_manager_open(libusb_device_handle *dev_handle,
+	unsigned char *endpoints, int num_endpoints, uint32_t num_streams,
+	libusb_stream_manager **mgr)
+{
+	struct libusb_stream_manager *_mgr;
+	uint32_t i;
+	int r;
+
+	if (!dev_handle || !endpoints || num_endpoints <= 0 || !num_streams || !mgr)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_mgr = calloc(1, sizeof(*_mgr));
+	if (!_mgr)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_mgr->endpoints = malloc((size_t)num_endpoints);
+	if (!_mgr->endpoints) {
+		free(_mgr);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	memcpy(_mgr->endpoints, endpoints, (size_t)num_endpoints);
+	_mgr->num_endpoints = num_endpoints;
+	_mgr->dev_handle = dev_handle;
+
+	r = libusb_alloc_streams(dev_handle, num_streams, _mgr->endpoints, num_endpoints);
+	if (r <= 0) {
+		free(_mgr->endpoints);
+		free(_mgr);
+		return r ? r : LIBUSB_ERROR_OTHER;
+	}
+	_mgr->num_streams = (uint32_t)r;
+
+	_mgr->slots = calloc(_mgr->num_streams, sizeof(*_mgr->slots));
+	if (!_mgr->slots) {
+		libusb_free_streams(dev_handle, _mgr->endpoints, num_endpoints);
+		free(_mgr->endpoints);
+		free(_mgr);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* hand out the lowest stream IDs first */
+	for (i = _mgr->num_streams; i > 0; i--) {
+		struct stream_manager_slot *slot = &_mgr->slots[i - 1];
+
+		slot->mgr = _mgr;
+		slot->stream_id = i;
+		slot->next_free = _mgr->free_slots;
+		_mgr->free_slots = slot;
+	}
+
+	usbi_mutex_init(&_mgr->lock);
+	list_init(&_mgr->queue);
+
+	usbi_dbg(HANDLE_CTX(dev_handle), "stream manager %p with %u streams on %d endpoints",
+		 (void *) _mgr, _mgr->num_streams, num_endpoints);
+	*mgr = _mgr;
+	return 0;
+}
+
+/** \ingroup libusb_stream_manager
+ * Close a stream manager and free its streams. Queued commands complete with
+ * \ref LIBUSB_TRANSFER_CANCELLED, their callbacks are invoked from this
+ * function. The transfers of commands in flight are cancelled, and this
+ * function handles events until they have all completed, so it must not be
+ * called from a transfer callback.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param mgr the manager to close. If NULL then this function simply returns.
+ */
+void API_EXPORTED libusb_stream_manager_close(libusb_stream_manager *mgr)
+{
+	struct libusb_context *ctx;
+	struct stream_manager_command *cmd, *tmp;
+	struct list_head queue;
+	uint32_t i;
+	int j, r;
+
+	if (!mgr)
+		return;
+
+	ctx = HANDLE_CTX(mgr->dev_handle);
+	usbi_dbg(ctx, "stream manager %p", (void *) mgr);
+
+	usbi_mutex_lock(&mgr->lock);
+	mgr->closing = 1;
+	list_init(&queue);
+	if (!list_empty(&mgr->queue))
+		list_cut(&queue, &mgr->queue);
+
+	mgr->drained = 1;
+	for (i = 0; i < mgr->num_streams; i++) {
+		struct stream_manager_slot *slot = &mgr->slots[i];
+
+		if (!slot->pending)
+			continue;
+		mgr->drained = 0;
+		for (j = 0; j < slot->num_transfers; j++) {
+			if (slot->transfers[j])
+				libusb_cancel_transfer(slot->transfers[j]);
+		}
+	}
+	usbi_mutex_unlock(&mgr->lock);
+
+	list_for_each_entry_safe(cmd, tmp, &queue, list, struct stream_manager_command) {
+		list_del(&cmd->list);
+		stream_manager_fail_transfers(ctx, cmd->transfers, cmd->num_transfers,
+			LIBUSB_TRANSFER_CANCELLED);
+		free(cmd);
+	}
+
+	while (!mgr->drained) {
+		r = libusb_handle_events_completed(ctx, &mgr->drained);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				 libusb_error_name(r));
+	}
+
+	r = libusb_free_streams(mgr->dev_handle, mgr->endpoints, mgr->num_endpoints);
+	if (r < 0)
+		usbi_dbg(ctx, "freeing streams failed: %s", libusb_error_name(r));
+
+	for (i = 0; i < mgr->num_streams; i++)
+		free(mgr->slots[i].transfers);
+	free(mgr->slots);
+	free(mgr->endpoints);
+	usbi_mutex_destroy(&mgr->lock);
+	free(mgr);
+}
+
+/** \ingroup libusb_stream_manager
+ * Get the number of streams a manager hands out. Stream IDs run from 1 to
+ * this number.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param mgr the manager
+ * \returns the number of streams
+ */
+int API_EXPORTED libusb_stream_manager_get_num_streams(libusb_stream_manager *mgr)
+{
+	return (int)mgr->num_streams;
+}
+
+/** \ingroup libusb_stream_manager
+ * Submit the transfers of a command on a free stream. The transfers must be
+ * bulk transfers on the manager's endpoints; they are turned into
+ * \ref LIBUSB_TRANSFER_TYPE_BULK_STREAM "bulk stream" transfers on the stream
+ * ID the command is given. That ID is passed on to another command once all
+ * of the transfers have completed, right before the callback of the last
+ * one is invoked.
+ *
+ * If no stream is free, the command is queued and submitted on the next
+ * stream to become free, in the order commands were submitted. A queued
+ * transfer that cannot be submitted completes with
+ * \ref LIBUSB_TRANSFER_ERROR.
+ *
+ * The transfers must not be resubmitted with libusb_submit_transfer(), as
+ * the stream ID may belong to another command by the time their callback
+ * is invoked.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param mgr the manager
+ * \param transfers the transfers of the command
+ * \param num_transfers the number of transfers
+ * \returns 0 if the command was submitted or queued
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a transfer is not a bulk
+ * transfer on the manager's device, or uses LIBUSB_TRANSFER_AUTO_RESUBMIT,
+ * or LIBUSB_TRANSFER_FREE_TRANSFER together with a completion queue
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if submitting one of the transfers
+ * failed. The transfers before it have been submitted and complete as
+ * usual, the ones after it were not submitted.
+ */
+int API_EXPORTED libusb_stream_manager_submit(libusb_stream_manager *mgr,
+	struct libusb_transfer **transfers, int num_transfers)
+{
+	struct stream_manager_slot *slot;
+	struct stream_manager_command *cmd;
+	int num_failed, i, r;
+
+	if (!transfers || num_transfers <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+
+		if (!transfer || transfer->dev_handle != mgr->dev_handle ||
+		    (transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+		     transfer->type != LIBUSB_TRANSFER_TYPE_BULK_STREAM) ||
+		    (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) ||
+		    (LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->cq &&
+		     (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&mgr->lock);
+	if (mgr->closing) {
+		usbi_mutex_unlock(&mgr->lock);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	slot = mgr->free_slots;
+	if (!slot) {
+		cmd = malloc(STREAM_COMMAND_SIZE(num_transfers));
+		if (!cmd) {
+			usbi_mutex_unlock(&mgr->lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		cmd->num_transfers = num_transfers;
+		memcpy(cmd->transfers, transfers, (size_t)num_transfers * sizeof(transfers[0]));
+		list_add_tail(&cmd->list, &mgr->queue);
+		usbi_mutex_unlock(&mgr->lock);
+		return 0;
+	}
+
+	mgr->free_slots = slot->next_free;
+	r = stream_manager_start_locked(slot, transfers, num_transfers, &num_failed);
+	if (num_failed) {
+		slot->stats.errors += (unsigned int)num_failed;
+		if (!slot->pending) {
+			slot->next_free = mgr->free_slots;
+			mgr->free_slots = slot;
+		}
+	}
+	usbi_mutex_unlock(&mgr->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_stream_manager
+ * Get the statistics of one stream of a manager.
+ *
+ * Since version 1.0.29, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param mgr the manager
+ * \param stream_id the stream ID, from 1 to the number of streams
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if there is no such stream
+ */
+int API_EXPORTED libusb_stream_manager_get_stream_stats(libusb_stream_manager *mgr,
+	uint32_t stream_id, struct libusb_bulk_stream_stats *stats)
+{
+	if (!stream_id || stream_id > mgr->num_streams)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&mgr->lock);
+	*stats = mgr->slots[stream_id - 1].stats;
+	usbi_mutex_unlock(&mgr->lock);
+	return 0;
+}
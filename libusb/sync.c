@@ -69,6 +69,70 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
+/* Take an idle synchronous transfer from the handle's cache, or allocate a
+ * new one. The control bounce buffer is grown to at least buffer_size. */
+static struct usbi_sync_transfer *get_sync_transfer(
+	struct libusb_device_handle *dev_handle, size_t buffer_size)
+{
+	struct usbi_sync_transfer *sync = NULL;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (!list_empty(&dev_handle->sync_transfers)) {
+		sync = list_first_entry(&dev_handle->sync_transfers, struct usbi_sync_transfer, list);
+		list_del(&sync->list);
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (!sync) {
+		sync = calloc(1, sizeof(*sync));
+		if (!sync)
+			return NULL;
+
+		sync->transfer = libusb_alloc_transfer(0);
+		if (!sync->transfer) {
+			free(sync);
+			return NULL;
+		}
+	}
+
+	if (buffer_size > sync->buffer_size) {
+		free(sync->buffer);
+		sync->buffer = malloc(buffer_size);
+		if (!sync->buffer) {
+			sync->buffer_size = 0;
+			usbi_free_sync_transfer(sync);
+			return NULL;
+		}
+		sync->buffer_size = buffer_size;
+	}
+
+	return sync;
+}
+
+/* Return a synchronous transfer to the handle's cache. The cache holds at
+ * most one entry per thread that performed concurrent synchronous I/O on
+ * the handle, and is emptied when the handle is closed. */
+static void put_sync_transfer(struct libusb_device_handle *dev_handle,
+	struct usbi_sync_transfer *sync)
+{
+	/* the handle was closed while the transfer was in flight */
+	if (!sync->transfer->dev_handle) {
+		usbi_free_sync_transfer(sync);
+		return;
+	}
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_add(&sync->list, &dev_handle->sync_transfers);
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+void usbi_free_sync_transfer(struct usbi_sync_transfer *sync)
+{
+	libusb_free_transfer(sync->transfer);
+	free(sync->buffer);
+	free(sync);
+}
+
 /** \ingroup libusb_syncio
  * Perform a USB control transfer.
  *
@@ -104,6 +168,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
+	struct usbi_sync_transfer *sync;
 	struct libusb_transfer *transfer;
 	unsigned char *buffer;
 	int completed = 0;
@@ -112,16 +177,19 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+	if (HANDLE_CTX(dev_handle)->direct_sync_transfers && usbi_backend.sync_control_transfer) {
+		r = usbi_backend.sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			return r;
+	}
 
-	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
+	sync = get_sync_transfer(dev_handle, LIBUSB_CONTROL_SETUP_SIZE + (size_t)wLength);
+	if (!sync)
 		return LIBUSB_ERROR_NO_MEM;
-	}
 
+	transfer = sync->transfer;
+	buffer = sync->buffer;
 	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
 		wLength);
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
@@ -129,10 +197,9 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(dev_handle, sync);
 		return r;
 	}
 
@@ -168,7 +235,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, sync);
 	return r;
 }
 
@@ -176,6 +243,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
+	struct usbi_sync_transfer *sync;
 	struct libusb_transfer *transfer;
 	int completed = 0;
 	int r;
@@ -183,17 +251,30 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
+	if (HANDLE_CTX(dev_handle)->direct_sync_transfers && usbi_backend.sync_bulk_transfer) {
+		int _transferred = 0;
+
+		r = usbi_backend.sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, &_transferred, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			if (transferred)
+				*transferred = _transferred;
+			return r;
+		}
+	}
+
+	sync = get_sync_transfer(dev_handle, 0);
+	if (!sync)
 		return LIBUSB_ERROR_NO_MEM;
 
+	transfer = sync->transfer;
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
 		sync_transfer_cb, &completed, timeout);
 	transfer->type = type;
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(dev_handle, sync);
 		return r;
 	}
 
@@ -230,7 +311,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, sync);
 	return r;
 }
 
@@ -140,10 +140,39 @@ static libusb_testlib_result test_init_context_log_cb(void) {
   LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
 }
 
+static libusb_testlib_result test_init_context_timer_slack(void) {
+  libusb_context *test_ctx = NULL;
+
+  struct libusb_init_option options[] = {
+    {
+      .option = LIBUSB_OPTION_TIMER_SLACK_NS,
+      .value = {
+        .ival = -1,
+      },
+    }
+  };
+
+  /* out of range values are rejected */
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  options[0].value.ival = 1000000000;
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  options[0].value.ival = 2000000;
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+
+  LIBUSB_EXPECT(==, test_ctx->timer_slack_ns, 2000000);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
 static const libusb_testlib_test tests[] = {
   { "test_init_context_basic", &test_init_context_basic },
   { "test_init_context_log_level", &test_init_context_log_level },
   { "test_init_context_log_cb", &test_init_context_log_cb },
+  { "test_init_context_timer_slack", &test_init_context_timer_slack },
   LIBUSB_NULL_TEST
 };
 
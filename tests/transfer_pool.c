@@ -0,0 +1,186 @@
+/*
+ * libusb transfer pool tests and allocation benchmark
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#define BENCHMARK_CYCLES 1000000
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	timespec_get(&now, TIME_UTC);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int transfer_is_pristine(const struct libusb_transfer *transfer, int iso_packets)
+{
+	if (transfer->dev_handle || transfer->flags || transfer->endpoint ||
+	    transfer->type || transfer->timeout || transfer->status ||
+	    transfer->length || transfer->actual_length || transfer->callback ||
+	    transfer->user_data || transfer->buffer || transfer->num_iso_packets)
+		return 0;
+
+	for (int i = 0; i < iso_packets; i++) {
+		const struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+		if (desc->length || desc->actual_length || desc->status)
+			return 0;
+	}
+
+	return 1;
+}
+
+/** Test that released transfers are recycled and come back pristine. */
+static libusb_testlib_result test_pool_recycle(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_transfer_pool *pool = NULL;
+	struct libusb_transfer *transfers[3];
+	struct libusb_transfer *transfer;
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_transfer_pool_create(ctx, 4, -1, &pool) != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Negative transfer count accepted");
+		goto out;
+	}
+
+	if (libusb_transfer_pool_acquire(NULL)) {
+		libusb_testlib_logf("Acquired a transfer from a NULL pool");
+		goto out;
+	}
+
+	r = libusb_transfer_pool_create(ctx, 4, 2, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to create pool: %d", r);
+		goto out;
+	}
+
+	/* the third acquisition has to grow the pool */
+	for (int i = 0; i < 3; i++) {
+		transfers[i] = libusb_transfer_pool_acquire(pool);
+		if (!transfers[i] || !transfer_is_pristine(transfers[i], 4)) {
+			libusb_testlib_logf("Acquisition %d returned %p", i, (void *)transfers[i]);
+			goto out;
+		}
+	}
+
+	transfer = transfers[2];
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	transfer->buffer = malloc(64);
+	transfer->length = 64;
+	transfer->num_iso_packets = 4;
+	transfer->iso_packet_desc[3].length = 16;
+	libusb_transfer_pool_release(transfer);
+
+	transfers[2] = libusb_transfer_pool_acquire(pool);
+	if (transfers[2] != transfer) {
+		libusb_testlib_logf("Released transfer was not recycled");
+		goto out;
+	}
+	if (!transfer_is_pristine(transfer, 4)) {
+		libusb_testlib_logf("Recycled transfer was not reset");
+		goto out;
+	}
+
+	/* libusb_free_transfer() returns pooled transfers as well */
+	libusb_free_transfer(transfers[0]);
+	if (libusb_transfer_pool_acquire(pool) != transfers[0]) {
+		libusb_testlib_logf("Freed transfer was not recycled");
+		goto out;
+	}
+
+	/* destroying the pool leaves acquired transfers valid */
+	libusb_transfer_pool_release(transfers[1]);
+	libusb_transfer_pool_destroy(pool);
+	pool = NULL;
+	libusb_transfer_pool_release(transfers[0]);
+	libusb_transfer_pool_release(transfers[2]);
+
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_transfer_pool_destroy(pool);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Compare the transfer allocation cost with and without a pool. */
+static libusb_testlib_result test_pool_benchmark(void)
+{
+	libusb_context *ctx = NULL;
+	libusb_transfer_pool *pool = NULL;
+	struct timespec start;
+	double alloc_secs, pool_secs;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_transfer_pool_create(ctx, 0, 1, &pool);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to create pool: %d", r);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	timespec_get(&start, TIME_UTC);
+	for (int i = 0; i < BENCHMARK_CYCLES; i++)
+		libusb_free_transfer(libusb_alloc_transfer(0));
+	alloc_secs = elapsed_seconds(&start);
+
+	timespec_get(&start, TIME_UTC);
+	for (int i = 0; i < BENCHMARK_CYCLES; i++)
+		libusb_transfer_pool_release(libusb_transfer_pool_acquire(pool));
+	pool_secs = elapsed_seconds(&start);
+
+	libusb_testlib_logf("alloc/free:      %.0f cycles/s", BENCHMARK_CYCLES / alloc_secs);
+	libusb_testlib_logf("acquire/release: %.0f cycles/s", BENCHMARK_CYCLES / pool_secs);
+
+	libusb_transfer_pool_destroy(pool);
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "pool_recycle", &test_pool_recycle },
+	{ "pool_benchmark", &test_pool_benchmark },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <dlfcn.h>
 #include <linux/ioctl.h>
 #include <linux/usbdevice_fs.h>
 
@@ -32,6 +33,9 @@
 
 #define UNUSED_DATA __attribute__ ((unused)) gconstpointer unused_data
 
+/* the number of bulk streams the mock device grants */
+#define MOCK_NUM_STREAMS 2
+
 /* avoid leak reports inside assertions; leaking stuff on assertion failures does not matter in tests */
 #if !defined(__clang__) && __GNUC__ > 9
 #pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
@@ -69,6 +73,8 @@ struct _UsbChat {
 	const unsigned char *buffer;
 	int buffer_length;
 	int actual_length;
+	int start_frame;
+	unsigned int stream_id;
 
 	/* <submit urb> */
 	UMockdevIoctlData *submit_urb;
@@ -88,6 +94,14 @@ typedef struct {
 	UsbChat *chat;
 	GList *flying_urbs;
 	GList *discarded_urbs;
+	GHashTable *discarded_devnodes;
+
+	/* blocking control/bulk ioctls are answered while set */
+	gboolean accept_direct_ioctls;
+	guint direct_ioctls;
+
+	/* endpoint resets issued while URBs were pending on the endpoint */
+	guint busy_endpoint_resets;
 
 	/* GMutex confuses TSan unnecessarily */
 	pthread_mutex_t mutex;
@@ -267,10 +281,74 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 	case USBDEVFS_RELEASEINTERFACE:
 	case USBDEVFS_CLEAR_HALT:
 	case USBDEVFS_RESET:
-	case USBDEVFS_RESETEP:
 		umockdev_ioctl_client_complete(client, 0, 0);
 		return TRUE;
 
+	case USBDEVFS_RESETEP: {
+		g_autoptr(UMockdevIoctlData) ep_data = NULL;
+		unsigned int endpoint;
+		GList *l;
+
+		/* some host controllers refuse this with URBs pending */
+		ep_data = umockdev_ioctl_data_resolve(ioctl_arg, 0, sizeof(unsigned int), NULL);
+		endpoint = *(unsigned int*) ep_data->data;
+		for (l = fixture->flying_urbs; l; l = l->next)
+			if (((struct usbdevfs_urb*) ((UMockdevIoctlData*) l->data)->data)->endpoint == endpoint)
+				fixture->busy_endpoint_resets += 1;
+		for (l = fixture->discarded_urbs; l; l = l->next)
+			if (((struct usbdevfs_urb*) ((UMockdevIoctlData*) l->data)->data)->endpoint == endpoint)
+				fixture->busy_endpoint_resets += 1;
+
+		umockdev_ioctl_client_complete(client, 0, 0);
+		return TRUE;
+	}
+
+	case USBDEVFS_ALLOC_STREAMS: {
+		g_autoptr(UMockdevIoctlData) streams_data = NULL;
+		struct usbdevfs_streams *streams;
+
+		/* the device grants at most MOCK_NUM_STREAMS streams */
+		streams_data = umockdev_ioctl_data_resolve(ioctl_arg, 0, sizeof(struct usbdevfs_streams), NULL);
+		streams = (struct usbdevfs_streams*) streams_data->data;
+
+		umockdev_ioctl_client_complete(client, MIN(streams->num_streams, MOCK_NUM_STREAMS), 0);
+		return TRUE;
+	}
+
+	case USBDEVFS_FREE_STREAMS:
+		umockdev_ioctl_client_complete(client, 0, 0);
+		return TRUE;
+
+	case USBDEVFS_CONTROL: {
+		g_autoptr(UMockdevIoctlData) ctrl_data = NULL;
+		struct usbdevfs_ctrltransfer *ctrl;
+
+		if (!fixture->accept_direct_ioctls)
+			return FALSE;
+
+		ctrl_data = umockdev_ioctl_data_resolve(ioctl_arg, 0, sizeof(struct usbdevfs_ctrltransfer), NULL);
+		ctrl = (struct usbdevfs_ctrltransfer*) ctrl_data->data;
+		fixture->direct_ioctls += 1;
+
+		umockdev_ioctl_client_complete(client, ctrl->wLength, 0);
+		return TRUE;
+	}
+
+	case USBDEVFS_BULK: {
+		g_autoptr(UMockdevIoctlData) bulk_data = NULL;
+		struct usbdevfs_bulktransfer *bulk;
+
+		if (!fixture->accept_direct_ioctls)
+			return FALSE;
+
+		bulk_data = umockdev_ioctl_data_resolve(ioctl_arg, 0, sizeof(struct usbdevfs_bulktransfer), NULL);
+		bulk = (struct usbdevfs_bulktransfer*) bulk_data->data;
+		fixture->direct_ioctls += 1;
+
+		umockdev_ioctl_client_complete(client, bulk->len, 0);
+		return TRUE;
+	}
+
 	case USBDEVFS_SUBMITURB: {
 		g_autoptr(UMockdevIoctlData) urb_buffer = NULL;
 		g_autoptr(UMockdevIoctlData) urb_data = NULL;
@@ -290,6 +368,11 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 		if (fixture->chat->type == urb->type &&
 		    fixture->chat->endpoint == urb->endpoint &&
 		    fixture->chat->buffer_length == urb->buffer_length &&
+		    (urb->type != USBDEVFS_URB_TYPE_ISO ||
+		     (fixture->chat->flags == urb->flags &&
+		      fixture->chat->start_frame == urb->start_frame)) &&
+		    (urb->type != USBDEVFS_URB_TYPE_BULK ||
+		     fixture->chat->stream_id == urb->stream_id) &&
 		    (fixture->chat->buffer == NULL || memcmp (fixture->chat->buffer, urb_buffer->data, buflen) == 0)) {
 			fixture->flying_urbs = g_list_append (fixture->flying_urbs, umockdev_ioctl_data_ref(urb_data));
 
@@ -328,11 +411,20 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 	case USBDEVFS_REAPURBNDELAY: {
 		g_autoptr(UMockdevIoctlData) urb_ptr = NULL;
 		g_autoptr(UMockdevIoctlData) urb_data = NULL;
+		const char *devnode = g_intern_string(umockdev_ioctl_client_get_devnode(client));
+		GList *discarded;
 
-		if (fixture->discarded_urbs) {
-			urb_data = fixture->discarded_urbs->data;
+		/* discarded URBs are reaped from the device node they were
+		 * discarded on, so that several devices can be emulated */
+		for (discarded = fixture->discarded_urbs; discarded; discarded = discarded->next)
+			if (g_hash_table_lookup(fixture->discarded_devnodes, discarded->data) == devnode)
+				break;
+
+		if (discarded) {
+			urb_data = discarded->data;
 			urb = (struct usbdevfs_urb*) urb_data->data;
-			fixture->discarded_urbs = g_list_delete_link(fixture->discarded_urbs, fixture->discarded_urbs);
+			fixture->discarded_urbs = g_list_delete_link(fixture->discarded_urbs, discarded);
+			g_hash_table_remove(fixture->discarded_devnodes, urb_data);
 			urb->status = -ENOENT;
 
 			urb_ptr = umockdev_ioctl_data_resolve(ioctl_arg, 0, sizeof(gpointer), NULL);
@@ -346,7 +438,7 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 			GList *l = g_list_find(fixture->flying_urbs, fixture->chat->submit_urb);
 
 			if (l) {
-				fixture->flying_urbs = g_list_remove_link(fixture->flying_urbs, fixture->flying_urbs);
+				fixture->flying_urbs = g_list_delete_link(fixture->flying_urbs, l);
 
 				urb_data = fixture->chat->submit_urb;
 				urb = (struct usbdevfs_urb*) urb_data->data;
@@ -356,6 +448,8 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 				if (fixture->chat->buffer)
 					memcpy(urb->buffer, fixture->chat->buffer, fixture->chat->actual_length);
 				urb->status = fixture->chat->status;
+				if (urb->type == USBDEVFS_URB_TYPE_ISO)
+					urb->start_frame = fixture->chat->start_frame;
 
 				urb_ptr = umockdev_ioctl_data_resolve(ioctl_arg, 0, sizeof(gpointer), NULL);
 				umockdev_ioctl_data_set_ptr(urb_ptr, 0, urb_data);
@@ -377,6 +471,8 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 		GList *l = g_list_find_custom(fixture->flying_urbs, *(void**) ioctl_arg->data, cmp_ioctl_data_addr);
 
 		if (l) {
+			g_hash_table_insert(fixture->discarded_devnodes, l->data,
+					    (gpointer) g_intern_string(umockdev_ioctl_client_get_devnode(client)));
 			fixture->discarded_urbs = g_list_append(fixture->discarded_urbs, l->data);
 			fixture->flying_urbs = g_list_delete_link(fixture->flying_urbs, l);
 			umockdev_ioctl_client_complete(client, 0, 0);
@@ -393,27 +489,38 @@ handle_ioctl_cb (UMockdevIoctlBase *handler, UMockdevIoctlClient *client, UMockd
 }
 
 static void
-test_fixture_add_canon(UMockdevTestbedFixture * fixture)
+test_fixture_add_canon(UMockdevTestbedFixture * fixture, int devnum)
 {
+	g_autofree gchar *devname = g_strdup_printf("/dev/bus/usb/001/%03d", devnum);
+	g_autofree gchar *sysfs_path = NULL;
+	g_autofree gchar *desc = NULL;
+
+	/* the first device is the root of the bus, any further one sits on a
+	 * port of it */
+	if (devnum == 1)
+		sysfs_path = g_strdup("/devices/usb1");
+	else
+		sysfs_path = g_strdup_printf("/devices/usb1/1-%d", devnum - 1);
+
 	/* Setup first, so we can be sure libusb_open works when the add uevent
 	 * happens.
 	 */
-	g_assert_cmpint(umockdev_testbed_attach_ioctl(fixture->testbed, "/dev/bus/usb/001/001", fixture->handler, NULL), ==, 1);
+	g_assert_cmpint(umockdev_testbed_attach_ioctl(fixture->testbed, devname, fixture->handler, NULL), ==, 1);
 
 	/* NOTE: add_device would not create a file, needed for device emulation */
 	/* XXX: Racy, see https://github.com/martinpitt/umockdev/issues/173 */
-	umockdev_testbed_add_from_string(fixture->testbed,
-		"P: /devices/usb1\n"
-		"N: bus/usb/001/001\n"
+	desc = g_strdup_printf(
+		"P: %s\n"
+		"N: bus/usb/001/%03d\n"
 		"E: SUBSYSTEM=usb\n"
 		"E: DRIVER=usb\n"
 		"E: BUSNUM=001\n"
-		"E: DEVNUM=001\n"
-		"E: DEVNAME=/dev/bus/usb/001/001\n"
+		"E: DEVNUM=%03d\n"
+		"E: DEVNAME=%s\n"
 		"E: DEVTYPE=usb_device\n"
 		"A: bConfigurationValue=1\\n\n"
 		"A: busnum=1\\n\n"
-		"A: devnum=1\\n\n"
+		"A: devnum=%d\\n\n"
 		"A: bConfigurationValue=1\\n\n"
 		"A: speed=480\\n\n"
 		/* descriptor from a Canon PowerShot SX200; VID 04a9 PID 31c0 */
@@ -422,7 +529,8 @@ test_fixture_add_canon(UMockdevTestbedFixture * fixture)
 		  "030109022700010100c0010904000003"
 		  "06010100070581020002000705020200"
 		  "020007058303080009\n",
-		NULL);
+		sysfs_path, devnum, devnum, devname, devnum);
+	umockdev_testbed_add_from_string(fixture->testbed, desc, NULL);
 }
 
 static void
@@ -455,6 +563,8 @@ test_fixture_setup_common(UMockdevTestbedFixture * fixture)
 	fixture->root_dir = umockdev_testbed_get_root_dir(fixture->testbed);
 	fixture->sys_dir = umockdev_testbed_get_sys_dir(fixture->testbed);
 
+	fixture->discarded_devnodes = g_hash_table_new(NULL, NULL);
+
 	fixture->handler = umockdev_ioctl_base_new();
 	g_object_connect(fixture->handler, "signal-after::handle-ioctl", handle_ioctl_cb, fixture, NULL);
 }
@@ -472,11 +582,35 @@ test_fixture_setup_with_canon(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
 	test_fixture_setup_common(fixture);
 
-	test_fixture_add_canon(fixture);
+	test_fixture_add_canon(fixture, 1);
 
 	test_fixture_setup_libusb(fixture, 1);
 }
 
+static void
+test_fixture_setup_with_two_canons(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	test_fixture_setup_common(fixture);
+
+	test_fixture_add_canon(fixture, 1);
+	test_fixture_add_canon(fixture, 2);
+
+	test_fixture_setup_libusb(fixture, 2);
+}
+
+#define REAP_MIX_LIGHT_DEVICES 8
+
+static void
+test_fixture_setup_with_reap_mix(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	test_fixture_setup_common(fixture);
+
+	for (int i = 1; i <= REAP_MIX_LIGHT_DEVICES + 1; i++)
+		test_fixture_add_canon(fixture, i);
+
+	test_fixture_setup_libusb(fixture, REAP_MIX_LIGHT_DEVICES + 1);
+}
+
 static void
 test_fixture_teardown(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -518,6 +652,7 @@ test_fixture_teardown(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 		umockdev_ioctl_data_unref (fixture->flying_urbs->data);
 		fixture->flying_urbs = g_list_delete_link (fixture->flying_urbs, fixture->flying_urbs);
 	}
+	g_hash_table_destroy(fixture->discarded_devnodes);
 
 	pthread_mutex_destroy(&fixture->mutex);
 }
@@ -827,6 +962,9 @@ test_timeout(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
 	g_assert_nonnull(handle);
 
+	/* the timer slack can change while a device is open */
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_TIMER_SLACK_NS, 1000), ==, 0);
+
 	transfer = libusb_alloc_transfer(0);
 	libusb_fill_bulk_transfer(transfer,
 				  handle,
@@ -851,208 +989,2441 @@ test_timeout(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 	libusb_close(handle);
 }
 
-#define THREADED_SUBMIT_URB_SETS 64
-#define THREADED_SUBMIT_URB_IN_FLIGHT 64
-typedef struct {
-	struct libusb_transfer *transfers[THREADED_SUBMIT_URB_IN_FLIGHT * THREADED_SUBMIT_URB_SETS];
-	int submitted;
-	int completed;
-	int done;
-	UMockdevTestbedFixture *fixture;
-} TestThreadedSubmit;
+/* Count heap allocations made directly from libusb code. Only calls whose
+ * return address lies in the same object as libusb are counted, so that
+ * allocations done by glib and umockdev in the meantime do not interfere.
+ * Overriding the allocator does not mix with the sanitizer runtimes. */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define COUNT_ALLOCATIONS 0
+#else
+#define COUNT_ALLOCATIONS 1
 
-static gpointer
-transfer_submit_all_retry(TestThreadedSubmit *data)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static void * volatile libusb_object_base;
+static volatile gint libusb_allocations;
+
+static void
+count_libusb_allocation(const void *caller)
 {
-	for (guint i = 0; i < G_N_ELEMENTS(data->transfers); i++) {
-		while (libusb_submit_transfer(data->transfers[i]) < 0) {
-			assert_libusb_log_msg(data->fixture, LIBUSB_LOG_LEVEL_ERROR, "submit_bulk_transfer");
-			continue;
-		}
+	void *base = libusb_object_base;
+	Dl_info info;
 
-		data->submitted += 1;
-	}
+	if (base && dladdr(caller, &info) && info.dli_fbase == base)
+		__atomic_add_fetch(&libusb_allocations, 1, __ATOMIC_RELAXED);
+}
 
-	return NULL;
+void *
+malloc(size_t size)
+{
+	count_libusb_allocation(__builtin_return_address(0));
+	return __libc_malloc(size);
 }
 
-static void LIBUSB_CALL
-test_threaded_submit_transfer_cb(struct libusb_transfer *transfer)
+void *
+calloc(size_t nmemb, size_t size)
 {
-	TestThreadedSubmit *data = transfer->user_data;
+	count_libusb_allocation(__builtin_return_address(0));
+	return __libc_calloc(nmemb, size);
+}
 
-	/* We should only be receiving packets in the main thread */
-	g_assert_cmpint (getpid(), ==, gettid());
+void *
+realloc(void *ptr, size_t size)
+{
+	count_libusb_allocation(__builtin_return_address(0));
+	return __libc_realloc(ptr, size);
+}
 
-	/* Check that the transfer buffer has the expected value */
-	g_assert_cmpint (*(int*)transfer->buffer, ==, data->completed);
-	data->completed += 1;
+static void
+start_counting_allocations(void)
+{
+	Dl_info info;
 
-	if (data->completed == G_N_ELEMENTS(data->transfers))
-		data->done = TRUE;
+	g_assert(dladdr((void *) libusb_control_transfer, &info));
+	libusb_allocations = 0;
+	libusb_object_base = info.dli_fbase;
+}
+
+static gint
+stop_counting_allocations(void)
+{
+	libusb_object_base = NULL;
+	return libusb_allocations;
 }
+#endif
 
+/* Fill in the two chat entries of a GET_STATUS control request that
+ * returns a status of 0x0001 */
 static void
-test_threaded_submit(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+fill_get_status_chat(UsbChat *c)
 {
-	GThread *thread = NULL;
-	TestThreadedSubmit data = { .fixture = fixture };
-	UsbChat out_msg = {
+	UsbChat submit = {
+		  .submit = TRUE,
+		  .reaps = &c[1],
+		  .type = USBDEVFS_URB_TYPE_CONTROL,
+		  .buffer_length = 10, /* 8 byte setup, 2 byte status */
+		  .buffer = (const unsigned char*) "\x80\x00\x00\x00\x00\x00\x02\x00",
+	};
+	UsbChat reap = {
+		  .reap = TRUE,
+		  .actual_length = 10,
+		  .buffer = (const unsigned char*) "\x80\x00\x00\x00\x00\x00\x02\x00\x01\x00",
+	};
+
+	c[0] = submit;
+	c[1] = reap;
+}
+
+#define SYNC_NO_ALLOC_ITERATIONS 16
+
+static void
+test_sync_no_alloc(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat bulk_submit = {
 		  .submit = TRUE,
 		  .type = USBDEVFS_URB_TYPE_BULK,
-		  .endpoint = LIBUSB_ENDPOINT_IN,
-		  .buffer_length = sizeof(int),
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .buffer_length = 4,
 	};
-	UsbChat in_msg = {
+	UsbChat bulk_reap = {
 		  .reap = TRUE,
 		  .actual_length = 4,
 	};
-	UsbChat *c;
+	unsigned char status[2];
+	unsigned char data[4] = { 0x01, 0x02, 0x03, 0x04 };
 	libusb_device_handle *handle = NULL;
-	int urb;
+	UsbChat *c;
+	int transferred;
+
+#if !COUNT_ALLOCATIONS
+	g_test_skip("Allocations cannot be counted with sanitizers enabled");
+	return;
+#endif
+
+	c = fixture->chat = g_new0(UsbChat, 4 * (SYNC_NO_ALLOC_ITERATIONS + 1) + 1);
+	for (int i = 0; i < SYNC_NO_ALLOC_ITERATIONS + 1; i++) {
+		fill_get_status_chat(&c[4*i]);
+		c[4*i + 2] = bulk_submit;
+		c[4*i + 2].reaps = &c[4*i + 3];
+		c[4*i + 3] = bulk_reap;
+	}
 
 	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
 	g_assert_nonnull(handle);
 
 	fixture->libusb_log_silence = TRUE;
 
-	c = fixture->chat = g_new0(UsbChat, G_N_ELEMENTS(data.transfers) * 2 + 1);
-	urb = 0;
-	for (int i = 0; i < THREADED_SUBMIT_URB_SETS; i++) {
-		for (int j = 0; j < THREADED_SUBMIT_URB_IN_FLIGHT; j++) {
-			c[i*2*THREADED_SUBMIT_URB_IN_FLIGHT + j] = out_msg;
-			c[i*2*THREADED_SUBMIT_URB_IN_FLIGHT + j].reaps = &c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j];
-			c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j] = in_msg;
-			c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j].buffer = (unsigned char*) g_new0(int, 1);
-			*(int*) c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j].buffer = urb;
-
-			data.transfers[urb] = libusb_alloc_transfer(0);
-			libusb_fill_bulk_transfer(data.transfers[urb],
-						  handle,
-						  LIBUSB_ENDPOINT_IN,
-						  g_malloc(out_msg.buffer_length),
-						  out_msg.buffer_length,
-						  test_threaded_submit_transfer_cb,
-						  &data,
-						  G_MAXUINT);
-			data.transfers[urb]->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-			urb++;
-		}
+	/* The first round fills the handle's transfer cache */
+	g_assert_cmpint(libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_STATUS,
+						0, 0, status, sizeof(status), 1000), ==, 2);
+	g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT | 2, data, sizeof(data),
+					     &transferred, 1000), ==, 0);
+
+#if COUNT_ALLOCATIONS
+	for (int i = 0; i < SYNC_NO_ALLOC_ITERATIONS; i++) {
+		start_counting_allocations();
+		g_assert_cmpint(libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_STATUS,
+							0, 0, status, sizeof(status), 1000), ==, 2);
+		g_assert_cmpint(stop_counting_allocations(), ==, 0);
+		g_assert_cmpint(status[0], ==, 0x01);
+
+		start_counting_allocations();
+		g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT | 2, data, sizeof(data),
+						     &transferred, 1000), ==, 0);
+		g_assert_cmpint(stop_counting_allocations(), ==, 0);
+		g_assert_cmpint(transferred, ==, 4);
 	}
-
-	thread = g_thread_new("transfer all", (GThreadFunc) transfer_submit_all_retry, &data);
-
-	while (!data.done)
-		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &data.done), ==, 0);
-
-	g_thread_join(thread);
+#endif
 
 	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
 	libusb_close(handle);
 
-	for (int i = 0; i < 2 * THREADED_SUBMIT_URB_SETS * THREADED_SUBMIT_URB_SETS; i++)
-		g_clear_pointer ((void**) &c->buffer, g_free);
-	g_free (c);
+	g_free(c);
 }
 
-static int LIBUSB_CALL
-hotplug_count_arrival_cb(libusb_context *ctx,
-                         libusb_device  *device,
-                         libusb_hotplug_event event,
-                         void *user_data)
+static void
+test_buffer_pool(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
-	g_assert_cmpint(event, ==, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
-
-	(void) ctx;
-	(void) device;
-
-	*(int*) user_data += 1;
-
-	return 0;
-}
+	libusb_device_handle *handle = NULL;
+	libusb_buffer_pool *pool = NULL;
+	unsigned char *bufs[3];
 
-#ifdef UMOCKDEV_HOTPLUG
-static int LIBUSB_CALL
-hotplug_count_removal_cb(libusb_context *ctx,
-                         libusb_device  *device,
-                         libusb_hotplug_event event,
-                         void *user_data)
-{
-	g_assert_cmpint(event, ==, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
 
-	(void) ctx;
-	(void) device;
+	g_assert_cmpint(libusb_buffer_pool_create(handle, 0, &pool), ==, LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_buffer_pool_create(handle, 2048, &pool), ==, 0);
+	g_assert_nonnull(pool);
 
-	*(int*) user_data += 1;
+	/* each buffer takes two 512 byte blocks, so at most two fit in device
+	 * memory and the third one has to come from the heap */
+	for (int i = 0; i < 3; i++) {
+		bufs[i] = libusb_buffer_pool_alloc(pool, 600);
+		g_assert_nonnull(bufs[i]);
+		memset(bufs[i], i, 600);
+	}
+	g_assert_false(libusb_buffer_pool_is_dev_mem(pool, bufs[2]));
+	if (libusb_buffer_pool_is_dev_mem(pool, bufs[0])) {
+		g_assert_true(libusb_buffer_pool_is_dev_mem(pool, bufs[1]));
+		g_assert_true(bufs[1] == bufs[0] + 1024 || bufs[0] == bufs[1] + 1024);
+	}
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 600; j++)
+			g_assert_cmpint(bufs[i][j], ==, i);
+
+	/* freed blocks are handed out again */
+	libusb_buffer_pool_free(pool, bufs[0]);
+	libusb_buffer_pool_free(pool, bufs[2]);
+	bufs[2] = libusb_buffer_pool_alloc(pool, 1);
+	g_assert_nonnull(bufs[2]);
+	if (libusb_buffer_pool_is_dev_mem(pool, bufs[1]))
+		g_assert_true(libusb_buffer_pool_is_dev_mem(pool, bufs[2]));
+
+	libusb_buffer_pool_free(pool, bufs[1]);
+	libusb_buffer_pool_free(pool, bufs[2]);
+	libusb_buffer_pool_destroy(pool);
 
-	return 0;
+	libusb_close(handle);
 }
-#endif
 
 static void
-test_hotplug_enumerate(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+test_stream_in(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
-	libusb_hotplug_callback_handle handle_enumerate;
-	libusb_hotplug_callback_handle handle_no_enumerate;
-	int event_count_enumerate = 0;
-	int event_count_no_enumerate = 0;
-	struct timeval zero_tv = { 0 };
-	int r;
+	UsbChat submit = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 4,
+	};
+	/* depth 2 gives a ring of 4 slots. The two initial transfers are
+	 * resubmitted on completion until the ring is full, which leaves the
+	 * endpoint idle. Consuming the first two slots resubmits them. */
+	int submits[] = { 0, 1, 3, 5, 8, 9 };
+	int reaps[][2] = { { 0, 2 }, { 1, 4 }, { 3, 6 }, { 5, 7 } };
+	const unsigned char *data[] = {
+		(const unsigned char *) "\x01\x02\x03\x04",
+		(const unsigned char *) "\x05\x06\x07\x08",
+		(const unsigned char *) "\x09\x0a",
+		(const unsigned char *) "\x0b\x0c\x0d\x0e",
+	};
+	int lengths[] = { 4, 4, 2, 4 };
+	libusb_device_handle *handle = NULL;
+	libusb_stream *stream = NULL;
+	struct libusb_stream_stats stats;
+	unsigned char *buf;
+	UsbChat *c;
 
-	r = libusb_hotplug_register_callback(fixture->ctx,
-	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
-	                                     LIBUSB_HOTPLUG_ENUMERATE,
-	                                     LIBUSB_HOTPLUG_MATCH_ANY,
-	                                     LIBUSB_HOTPLUG_MATCH_ANY,
-	                                     LIBUSB_HOTPLUG_MATCH_ANY,
-	                                     hotplug_count_arrival_cb,
-	                                     &event_count_enumerate,
-	                                     &handle_enumerate);
-	g_assert_cmpint(r, ==, 0);
+	c = fixture->chat = g_new0(UsbChat, 11);
+	for (guint i = 0; i < G_N_ELEMENTS(submits); i++)
+		c[submits[i]] = submit;
+	for (guint i = 0; i < G_N_ELEMENTS(reaps); i++) {
+		c[reaps[i][0]].reaps = &c[reaps[i][1]];
+		c[reaps[i][1]].reap = TRUE;
+		c[reaps[i][1]].buffer = data[i];
+		c[reaps[i][1]].actual_length = lengths[i];
+	}
 
-	r = libusb_hotplug_register_callback(fixture->ctx,
-	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
-	                                     0,
-	                                     LIBUSB_HOTPLUG_MATCH_ANY,
-	                                     LIBUSB_HOTPLUG_MATCH_ANY,
-	                                     LIBUSB_HOTPLUG_MATCH_ANY,
-	                                     hotplug_count_arrival_cb,
-	                                     &event_count_no_enumerate,
-	                                     &handle_no_enumerate);
-	g_assert_cmpint(r, ==, 0);
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
 
-	g_assert_cmpint(event_count_enumerate, ==, 1);
-	g_assert_cmpint(event_count_no_enumerate, ==, 0);
+	g_assert_cmpint(libusb_stream_open(handle, LIBUSB_ENDPOINT_IN | 1, 4, 0, &stream), ==,
+			LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_stream_open(handle, LIBUSB_ENDPOINT_IN | 1, 4, 2, &stream), ==, 0);
+	g_assert_cmpint(libusb_stream_flush(stream), ==, LIBUSB_ERROR_INVALID_PARAM);
 
-	libusb_handle_events_timeout(fixture->ctx, &zero_tv);
+	fixture->libusb_log_silence = TRUE;
+	while (fixture->chat != &c[8]) {
+		struct timeval tv = { 0, 10000 };
 
-	g_assert_cmpint(event_count_enumerate, ==, 1);
-	g_assert_cmpint(event_count_no_enumerate, ==, 0);
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &tv), ==, 0);
+	}
 
-	libusb_hotplug_deregister_callback(fixture->ctx, handle_enumerate);
-	libusb_hotplug_deregister_callback(fixture->ctx, handle_no_enumerate);
+	libusb_stream_get_stats(stream, &stats);
+	g_assert_cmpuint(stats.bytes_transferred, ==, 14);
+	g_assert_cmpuint(stats.overruns, ==, 1);
+
+	/* data is handed out in order, with partial commits */
+	g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, 4);
+	g_assert_cmpmem(buf, 4, data[0], 4);
+	g_assert_cmpint(libusb_stream_commit(stream, 5), ==, LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_stream_commit(stream, 1), ==, 0);
+	g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, 3);
+	g_assert_cmpmem(buf, 3, data[0] + 1, 3);
+	g_assert_cmpint(libusb_stream_commit(stream, 3), ==, 0);
+	g_assert_true(fixture->chat == &c[9]);
+
+	for (int i = 1; i < 4; i++) {
+		g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, lengths[i]);
+		g_assert_cmpmem(buf, lengths[i], data[i], lengths[i]);
+		g_assert_cmpint(libusb_stream_commit(stream, lengths[i]), ==, 0);
+	}
+	g_assert_true(fixture->chat == &c[10]);
+	g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, 0);
 
-	libusb_handle_events_timeout(fixture->ctx, &zero_tv);
+	/* closing cancels the two resubmitted transfers */
+	libusb_stream_close(stream);
+	g_assert_null(fixture->flying_urbs);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
 
-	g_assert_cmpint(event_count_enumerate, ==, 1);
-	g_assert_cmpint(event_count_no_enumerate, ==, 0);
+	libusb_close(handle);
+	g_free(c);
 }
 
 static void
-test_hotplug_add_remove(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+test_stream_out(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
-#ifdef UMOCKDEV_HOTPLUG
-	libusb_device **devs = NULL;
-	libusb_hotplug_callback_handle handle_add;
-	libusb_hotplug_callback_handle handle_remove;
-	int event_count_add = 0;
-	int event_count_remove = 0;
-	struct timeval zero_tv = { 0 };
-	int r;
-
-	r = libusb_hotplug_register_callback(fixture->ctx,
-	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
-	                                     LIBUSB_HOTPLUG_ENUMERATE,
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer = (const unsigned char *) "\x01\x02\x03\x04",
+		  .buffer_length = 4,
+		},
+		{
+		  .reap = TRUE,
+		  .actual_length = 4,
+		},
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer = (const unsigned char *) "\x05\x06",
+		  .buffer_length = 2,
+		},
+		{
+		  .reap = TRUE,
+		  .actual_length = 2,
+		},
+		{
+		  .submit = FALSE,
+		}
+	};
+	libusb_device_handle *handle = NULL;
+	libusb_stream *stream = NULL;
+	struct libusb_stream_stats stats;
+	unsigned char *buf;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	g_assert_cmpint(libusb_stream_open(handle, LIBUSB_ENDPOINT_OUT | 2, 4, 1, &stream), ==, 0);
+
+	/* nothing goes out until a whole transfer is committed */
+	g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, 4);
+	memcpy(buf, "\x01\x02", 2);
+	g_assert_cmpint(libusb_stream_commit(stream, 2), ==, 0);
+	g_assert_true(fixture->chat == &chat[0]);
+	g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, 2);
+	memcpy(buf, "\x03\x04", 2);
+	g_assert_cmpint(libusb_stream_commit(stream, 2), ==, 0);
+	g_assert_true(fixture->chat == &chat[1]);
+
+	/* a flushed partial transfer has to wait for the one in flight */
+	g_assert_cmpint(libusb_stream_acquire(stream, &buf), ==, 4);
+	memcpy(buf, "\x05\x06", 2);
+	g_assert_cmpint(libusb_stream_commit(stream, 2), ==, 0);
+	g_assert_cmpint(libusb_stream_flush(stream), ==, 0);
+	g_assert_true(fixture->chat == &chat[1]);
+
+	while (fixture->chat != &chat[4])
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+
+	/* the endpoint ran dry once the flushed transfer completed */
+	libusb_stream_get_stats(stream, &stats);
+	g_assert_cmpuint(stats.bytes_transferred, ==, 6);
+	g_assert_cmpuint(stats.underruns, ==, 1);
+
+	libusb_stream_close(stream);
+	libusb_close(handle);
+}
+
+struct auto_resubmit_state {
+	UMockdevTestbedFixture *fixture;
+	UsbChat *chat;
+	unsigned char *bufs[2];
+	int completions;
+};
+
+static void LIBUSB_CALL
+test_auto_resubmit_cb(struct libusb_transfer *transfer)
+{
+	struct auto_resubmit_state *state = transfer->user_data;
+	int n = state->completions++;
+
+	if (n == 2) {
+		/* the cancelled transfer is not resubmitted */
+		g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_CANCELLED);
+		g_assert_true(transfer->buffer == state->bufs[0]);
+		return;
+	}
+
+	/* the twin buffer is already in flight when the callback runs */
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfer->actual_length, ==, 4);
+	g_assert_true(transfer->buffer == state->bufs[n]);
+	g_assert_true(libusb_transfer_get_twin_buffer(transfer) == state->bufs[!n]);
+	g_assert_cmpmem(transfer->buffer, 4, n ? "BBBB" : "AAAA", 4);
+	g_assert_true(state->fixture->chat == &state->chat[n ? 5 : 3]);
+
+	if (n == 1)
+		g_assert_cmpint(libusb_cancel_transfer(transfer), ==, 0);
+}
+
+static void
+test_auto_resubmit(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 4,
+		},
+		{
+		  .reap = TRUE,
+		  .buffer = (const unsigned char *) "AAAA",
+		  .actual_length = 4,
+		},
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 4,
+		},
+		{
+		  .reap = TRUE,
+		  .buffer = (const unsigned char *) "BBBB",
+		  .actual_length = 4,
+		},
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 4,
+		},
+		{
+		  .submit = FALSE,
+		}
+	};
+	struct auto_resubmit_state state = { fixture, chat, { NULL, NULL }, 0 };
+	unsigned char bufs[2][4];
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer = NULL;
+
+	fixture->chat = chat;
+	state.bufs[0] = bufs[0];
+	state.bufs[1] = bufs[1];
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 1,
+				  bufs[0], 4, test_auto_resubmit_cb, &state, 1000);
+	transfer->flags = LIBUSB_TRANSFER_AUTO_RESUBMIT;
+
+	/* a twin buffer is required */
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_true(fixture->chat == &chat[0]);
+
+	libusb_transfer_set_twin_buffer(transfer, bufs[1]);
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+
+	while (state.completions < 3)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	g_assert_true(fixture->chat == &chat[5]);
+	g_assert_null(fixture->flying_urbs);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+}
+
+static void LIBUSB_CALL
+test_bulk_iovec_cb(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+
+	*completed = 1;
+}
+
+static void
+test_bulk_iovec(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		/* gather: header and payload go out as separate URBs */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[2],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer = (const unsigned char *) "HDR!",
+		  .buffer_length = 4,
+		},
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer = (const unsigned char *) "PAYLOAD1",
+		  .buffer_length = 8,
+		},
+		{
+		  .reap = TRUE,
+		  .actual_length = 4,
+		},
+		{
+		  .reap = TRUE,
+		  .actual_length = 8,
+		},
+		/* scatter: a short first segment ends the transfer */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[6],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 4,
+		},
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 8,
+		},
+		{
+		  .reap = TRUE,
+		  .buffer = (const unsigned char *) "ab",
+		  .actual_length = 2,
+		  .status = -EREMOTEIO,
+		},
+		/* refilled with a buffer, the segments are gone */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[8],
+		  .type = USBDEVFS_URB_TYPE_INTERRUPT,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 8,
+		},
+		{
+		  .reap = TRUE,
+		  .buffer = (const unsigned char *) "plain",
+		  .actual_length = 5,
+		},
+		{
+		  .submit = FALSE,
+		}
+	};
+	unsigned char header[4] = "HDR!";
+	unsigned char payload[8] = "PAYLOAD1";
+	unsigned char in[2][8];
+	struct libusb_iovec out_iov[] = {
+		{ header, sizeof(header) },
+		{ payload, sizeof(payload) },
+	};
+	struct libusb_iovec in_iov[] = {
+		{ in[0], 4 },
+		{ in[1], 0 },
+		{ in[1], 8 },
+	};
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer = NULL;
+	int completed = 0;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+	g_assert_true(libusb_has_capability(LIBUSB_CAP_SUPPORTS_BULK_IOVEC));
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_iovec_transfer(transfer, handle, LIBUSB_ENDPOINT_OUT | 2,
+					out_iov, -1, test_bulk_iovec_cb, &completed, 1000);
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, LIBUSB_ERROR_INVALID_PARAM);
+	libusb_transfer_set_iovec(transfer, out_iov, G_N_ELEMENTS(out_iov));
+	transfer->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, LIBUSB_ERROR_INVALID_PARAM);
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	g_assert_true(fixture->chat == &chat[0]);
+
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	g_assert_cmpint(transfer->length, ==, 12);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfer->actual_length, ==, 12);
+
+	completed = 0;
+	libusb_fill_bulk_iovec_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 1,
+					in_iov, G_N_ELEMENTS(in_iov), test_bulk_iovec_cb, &completed, 1000);
+	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
+	fixture->libusb_log_silence = TRUE;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_ERROR);
+	g_assert_cmpint(transfer->actual_length, ==, 2);
+	g_assert_cmpmem(in[0], 2, "ab", 2);
+	g_assert_true(fixture->chat == &chat[7]);
+	g_assert_null(fixture->flying_urbs);
+
+	completed = 0;
+	libusb_fill_interrupt_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 1,
+				       in[1], sizeof(in[1]), test_bulk_iovec_cb, &completed, 1000);
+	transfer->flags = 0;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	g_assert_cmpint(transfer->length, ==, 8);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfer->actual_length, ==, 5);
+	g_assert_cmpmem(in[1], 5, "plain", 5);
+	g_assert_true(fixture->chat == &chat[9]);
+	g_assert_null(fixture->flying_urbs);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+}
+
+#define ISO_NO_ALLOC_PACKETS 200
+#define ISO_NO_ALLOC_PACKET_LEN 8
+
+static void
+test_iso_no_alloc(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	/* 200 packets need two URBs of 128 and 72 packets */
+	UsbChat iso_submit[] = {
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_ISO,
+		  .flags = USBDEVFS_URB_ISO_ASAP,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 3,
+		  .buffer_length = 128 * ISO_NO_ALLOC_PACKET_LEN,
+		},
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_ISO,
+		  .flags = USBDEVFS_URB_ISO_ASAP,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 3,
+		  .buffer_length = 72 * ISO_NO_ALLOC_PACKET_LEN,
+		},
+	};
+	unsigned char data[ISO_NO_ALLOC_PACKETS * ISO_NO_ALLOC_PACKET_LEN];
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer;
+	int completed;
+	UsbChat *c;
+
+#if !COUNT_ALLOCATIONS
+	g_test_skip("Allocations cannot be counted with sanitizers enabled");
+	return;
+#endif
+
+	c = fixture->chat = g_new0(UsbChat, 4 * 2 + 1);
+	for (int i = 0; i < 2; i++) {
+		c[4*i] = iso_submit[0];
+		c[4*i].reaps = &c[4*i + 2];
+		c[4*i + 1] = iso_submit[1];
+		c[4*i + 1].reaps = &c[4*i + 3];
+		c[4*i + 2].reap = TRUE;
+		c[4*i + 3].reap = TRUE;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(ISO_NO_ALLOC_PACKETS);
+	g_assert_nonnull(transfer);
+
+	fixture->libusb_log_silence = TRUE;
+
+	for (int i = 0; i < 2; i++) {
+		libusb_fill_iso_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 3,
+					 data, sizeof(data), ISO_NO_ALLOC_PACKETS,
+					 transfer_cb_inc_user_data, &completed, 1000);
+		libusb_set_iso_packet_lengths(transfer, ISO_NO_ALLOC_PACKET_LEN);
+		/* stale results must be overwritten on completion */
+		for (int j = 0; j < ISO_NO_ALLOC_PACKETS; j++) {
+			transfer->iso_packet_desc[j].actual_length = 1;
+			transfer->iso_packet_desc[j].status = LIBUSB_TRANSFER_ERROR;
+		}
+		completed = 0;
+
+#if COUNT_ALLOCATIONS
+		start_counting_allocations();
+#endif
+		g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+		while (!completed)
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+#if COUNT_ALLOCATIONS
+		g_assert_cmpint(stop_counting_allocations(), ==, 0);
+#endif
+
+		g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		for (int j = 0; j < ISO_NO_ALLOC_PACKETS; j++) {
+			g_assert_cmpint(transfer->iso_packet_desc[j].length, ==, ISO_NO_ALLOC_PACKET_LEN);
+			g_assert_cmpint(transfer->iso_packet_desc[j].actual_length, ==, 0);
+			g_assert_cmpint(transfer->iso_packet_desc[j].status, ==, LIBUSB_TRANSFER_COMPLETED);
+		}
+	}
+
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+
+	g_free(c);
+}
+
+static void
+test_iso_start_frame(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_ISO,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 3,
+		  .buffer_length = 4 * 8,
+		  .start_frame = 1000,
+		},
+		{
+		  .reap = TRUE,
+		  .start_frame = 1000,
+		},
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_ISO,
+		  .flags = USBDEVFS_URB_ISO_ASAP,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 3,
+		  .buffer_length = 4 * 8,
+		},
+		{
+		  .reap = TRUE,
+		  .start_frame = 1004,
+		},
+		{
+		  .submit = FALSE,
+		}
+	};
+	unsigned char data[4 * 8];
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer;
+	uint64_t frame;
+	int completed = 0;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* usbfs has no way to query the frame number */
+	g_assert_cmpint(libusb_get_frame_number(handle, &frame), ==, LIBUSB_ERROR_NOT_SUPPORTED);
+
+	transfer = libusb_alloc_transfer(4);
+	libusb_fill_iso_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 3,
+				 data, sizeof(data), 4,
+				 transfer_cb_inc_user_data, &completed, 1000);
+	libusb_set_iso_packet_lengths(transfer, 8);
+
+	/* the first submission is scheduled */
+	libusb_transfer_set_iso_start_frame(transfer, 1000);
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpuint(libusb_transfer_get_iso_start_frame(transfer), ==, 1000);
+
+	/* the next one goes out as soon as possible again */
+	completed = 0;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+	g_assert_cmpuint(libusb_transfer_get_iso_start_frame(transfer), ==, 1004);
+	g_assert_true(fixture->chat == &chat[4]);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+}
+
+static void
+test_iso_ring(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_ISO,
+		  .flags = USBDEVFS_URB_ISO_ASAP,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 3,
+		  .buffer_length = 2 * 8,
+	};
+	libusb_device_handle *handle = NULL;
+	libusb_iso_ring *ring = NULL;
+	struct libusb_iso_ring_packet *packets;
+	struct libusb_iso_ring_stats stats;
+	UsbChat *c;
+
+	/* depth 1 with two packets per transfer gives a ring of 4 packets.
+	 * The second transfer fills it, which leaves the endpoint idle until
+	 * the packets are released. */
+	c = fixture->chat = g_new0(UsbChat, 6);
+	for (int i = 0; i < 3; i++)
+		c[2*i] = submit;
+	for (int i = 0; i < 2; i++) {
+		c[2*i].reaps = &c[2*i + 1];
+		c[2*i + 1].reap = TRUE;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	g_assert_cmpint(libusb_iso_ring_open(handle, LIBUSB_ENDPOINT_IN | 3, 8, 2, 0, &ring), ==,
+			LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_iso_ring_open(handle, LIBUSB_ENDPOINT_IN | 3, 8, 2, 1, &ring), ==, 0);
+	g_assert_cmpint(libusb_iso_ring_set_feedback(ring, LIBUSB_ENDPOINT_IN | 4, 0x10000, 2), ==,
+			LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_iso_ring_peek(ring, &packets), ==, 0);
+	g_assert_true(fixture->chat == &c[1]);
+
+	fixture->libusb_log_silence = TRUE;
+	while (fixture->chat != &c[4]) {
+		struct timeval tv = { 0, 10000 };
+
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &tv), ==, 0);
+	}
+
+	libusb_iso_ring_get_stats(ring, &stats);
+	g_assert_cmpuint(stats.packets, ==, 4);
+	g_assert_cmpuint(stats.packet_errors, ==, 0);
+	g_assert_cmpuint(stats.overruns, ==, 1);
+
+	/* all received packets are handed out at once, in buffer order */
+	g_assert_cmpint(libusb_iso_ring_peek(ring, &packets), ==, 4);
+	for (int i = 0; i < 4; i++) {
+		g_assert_true(packets[i].buffer == packets[0].buffer + i * 8);
+		g_assert_cmpuint(packets[i].length, ==, 0);
+		g_assert_cmpint(packets[i].status, ==, LIBUSB_TRANSFER_COMPLETED);
+		g_assert_cmpuint(packets[i].timestamp, !=, 0);
+	}
+	g_assert_cmpuint(packets[1].timestamp, <=, packets[2].timestamp);
+
+	/* releasing the first transfer's packets resubmits it */
+	g_assert_cmpint(libusb_iso_ring_release(ring, 5), ==, LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_iso_ring_release(ring, 1), ==, 0);
+	g_assert_true(fixture->chat == &c[4]);
+	g_assert_cmpint(libusb_iso_ring_release(ring, 1), ==, 0);
+	g_assert_true(fixture->chat == &c[5]);
+	g_assert_cmpint(libusb_iso_ring_peek(ring, &packets), ==, 2);
+
+	/* closing cancels the resubmitted transfer */
+	libusb_iso_ring_close(ring);
+	g_assert_null(fixture->flying_urbs);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	libusb_close(handle);
+	g_free(c);
+}
+
+static void
+test_transfer_mem_budget(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+	};
+	/* two transfers fill the budget, the third one only goes out once
+	 * the first has completed */
+	int submits[] = { 0, 1, 3 };
+	int reaps[][2] = { { 0, 2 }, { 1, 4 }, { 3, 5 } };
+	unsigned char data[4][32];
+	struct libusb_transfer *transfers[4];
+	int completed[4] = { 0 };
+	libusb_device_handle *handle = NULL;
+	UsbChat *c;
+
+	c = fixture->chat = g_new0(UsbChat, 7);
+	for (guint i = 0; i < G_N_ELEMENTS(submits); i++)
+		c[submits[i]] = submit;
+	for (guint i = 0; i < G_N_ELEMENTS(reaps); i++) {
+		c[reaps[i][0]].reaps = &c[reaps[i][1]];
+		c[reaps[i][1]].reap = TRUE;
+		c[reaps[i][1]].actual_length = 32;
+	}
+
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_TRANSFER_MEM_BUDGET, -1), ==,
+			LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_TRANSFER_MEM_BUDGET, 128), ==, 0);
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* the budget can change while devices are open */
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_TRANSFER_MEM_BUDGET, 64), ==, 0);
+
+	for (int i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN | 1,
+					  data[i], sizeof(data[i]),
+					  transfer_cb_inc_user_data, &completed[i], 1000);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	/* the last two are held, and a held transfer cancels without the
+	 * device seeing it */
+	g_assert_true(fixture->chat == &c[2]);
+	g_assert_cmpint(libusb_submit_transfer(transfers[3]), ==, LIBUSB_ERROR_BUSY);
+	g_assert_cmpint(libusb_cancel_transfer(transfers[3]), ==, 0);
+	g_assert_cmpint(libusb_cancel_transfer(transfers[3]), ==, LIBUSB_ERROR_NOT_FOUND);
+
+	fixture->libusb_log_silence = TRUE;
+	for (int i = 0; i < 4; i++) {
+		while (!completed[i])
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed[i]), ==, 0);
+	}
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	g_assert_true(fixture->chat == &c[6]);
+	for (int i = 0; i < 3; i++) {
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		g_assert_cmpint(transfers[i]->actual_length, ==, 32);
+	}
+	g_assert_cmpint(transfers[3]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+	g_assert_cmpint(completed[3], ==, 1);
+
+	for (int i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	g_free(c);
+}
+
+static void
+test_completion_queue(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[2],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 8,
+		}, {
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 8,
+		}, {
+		  .reap = TRUE,
+		  .actual_length = 8,
+		}, {
+		  .reap = TRUE,
+		  .actual_length = 4,
+		}, {
+		  .submit = TRUE,
+		  .reaps = &chat[5],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 8,
+		}, {
+		  .reap = TRUE,
+		  .actual_length = 8,
+		}, {
+		  .submit = TRUE,
+		  .reaps = &chat[7],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 8,
+		}, {
+		  .reap = TRUE,
+		  .actual_length = 8,
+		},
+		{ .submit = FALSE }
+	};
+	unsigned char data[2][8];
+	struct libusb_transfer *transfers[2], *reaped[4];
+	struct timeval zero = { 0, 0 };
+	libusb_completion_queue *cq = NULL;
+	libusb_device_handle *handle = NULL;
+	int completed = 0;
+
+	fixture->chat = chat;
+
+	g_assert_cmpint(libusb_cq_create(fixture->ctx, &cq), ==, 0);
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < 2; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN | 1,
+					  data[i], sizeof(data[i]),
+					  transfer_cb_inc_user_data, &completed, 1000);
+		libusb_transfer_set_cq(transfers[i], cq);
+	}
+
+	/* the queue owns the transfer once it completes */
+	transfers[0]->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+	g_assert_cmpint(libusb_submit_transfer(transfers[0]), ==, LIBUSB_ERROR_INVALID_PARAM);
+	transfers[0]->flags = 0;
+
+	for (int i = 0; i < 2; i++)
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	g_assert_cmpint(libusb_cq_reap(cq, reaped, G_N_ELEMENTS(reaped), &zero), ==, 0);
+
+	while (fixture->chat != &chat[4])
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &zero), ==, 0);
+
+	/* both come out of one reap, in order, without invoking the callback */
+	g_assert_cmpint(libusb_cq_reap(cq, reaped, G_N_ELEMENTS(reaped), &zero), ==, 2);
+	g_assert_true(reaped[0] == transfers[0]);
+	g_assert_true(reaped[1] == transfers[1]);
+	g_assert_cmpint(transfers[0]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfers[0]->actual_length, ==, 8);
+	g_assert_cmpint(transfers[1]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(transfers[1]->actual_length, ==, 4);
+	g_assert_cmpint(completed, ==, 0);
+
+	libusb_cq_interrupt(NULL);
+	libusb_cq_interrupt(cq);
+	g_assert_cmpint(libusb_cq_reap(cq, reaped, G_N_ELEMENTS(reaped), NULL), ==,
+			LIBUSB_ERROR_INTERRUPTED);
+
+	/* destroying the queue detaches a transfer that was never reaped */
+	g_assert_cmpint(libusb_submit_transfer(transfers[0]), ==, 0);
+	while (fixture->chat != &chat[6])
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &zero), ==, 0);
+	libusb_cq_destroy(cq);
+
+	g_assert_cmpint(libusb_submit_transfer(transfers[0]), ==, 0);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+	g_assert_cmpint(transfers[0]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_true(fixture->chat == &chat[8]);
+
+	for (int i = 0; i < 2; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+}
+
+static void
+test_stream_manager(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		/* command A, a data and a status transfer on stream 1 */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 16,
+		  .stream_id = 1,
+		}, {
+		  .submit = TRUE,
+		  .reaps = &chat[4],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer_length = 8,
+		  .stream_id = 1,
+		},
+		/* command B on stream 2, command C has to wait */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[6],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 16,
+		  .stream_id = 2,
+		},
+		{ .reap = TRUE, .actual_length = 16, },
+		{ .reap = TRUE, .actual_length = 8, },
+		/* stream 1 is free again once both transfers of A completed */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[7],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 16,
+		  .stream_id = 1,
+		},
+		{ .reap = TRUE, .actual_length = 16, },
+		{ .reap = TRUE, .actual_length = 16, },
+		{ .submit = FALSE, }
+	};
+	unsigned char endpoints[] = { LIBUSB_ENDPOINT_IN | 1, LIBUSB_ENDPOINT_OUT | 2 };
+	unsigned char data[4][16];
+	struct libusb_transfer *transfers[4];
+	int completed[4] = { 0 };
+	struct libusb_bulk_stream_stats stats;
+	libusb_stream_manager *mgr = NULL;
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* the device grants fewer streams than requested */
+	g_assert_cmpint(libusb_stream_manager_open(handle, endpoints, G_N_ELEMENTS(endpoints), 4, &mgr), ==, 0);
+	g_assert_cmpint(libusb_stream_manager_get_num_streams(mgr), ==, MOCK_NUM_STREAMS);
+
+	for (int i = 0; i < 4; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, i == 1 ? LIBUSB_ENDPOINT_OUT | 2 : LIBUSB_ENDPOINT_IN | 1,
+					  data[i], i == 1 ? 8 : 16,
+					  transfer_cb_inc_user_data, &completed[i], 1000);
+	}
+
+	transfers[3]->type = LIBUSB_TRANSFER_TYPE_CONTROL;
+	g_assert_cmpint(libusb_stream_manager_submit(mgr, &transfers[3], 1), ==, LIBUSB_ERROR_INVALID_PARAM);
+	transfers[3]->type = LIBUSB_TRANSFER_TYPE_BULK;
+
+	g_assert_cmpint(libusb_stream_manager_submit(mgr, &transfers[0], 2), ==, 0);
+	g_assert_cmpint(libusb_stream_manager_submit(mgr, &transfers[2], 1), ==, 0);
+	g_assert_cmpint(libusb_stream_manager_submit(mgr, &transfers[3], 1), ==, 0);
+	g_assert_true(fixture->chat == &chat[3]);
+
+	fixture->libusb_log_silence = TRUE;
+	for (int i = 0; i < 4; i++) {
+		while (!completed[i])
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed[i]), ==, 0);
+	}
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	g_assert_true(fixture->chat == &chat[8]);
+	for (int i = 0; i < 4; i++)
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	g_assert_cmpint(libusb_transfer_get_stream_id(transfers[3]), ==, 1);
+
+	g_assert_cmpint(libusb_stream_manager_get_stream_stats(mgr, 1, &stats), ==, 0);
+	g_assert_cmpint(stats.commands, ==, 2);
+	g_assert_cmpint(stats.transfers, ==, 3);
+	g_assert_cmpint(stats.bytes, ==, 40);
+	g_assert_cmpint(stats.errors, ==, 0);
+	g_assert_cmpint(libusb_stream_manager_get_stream_stats(mgr, 2, &stats), ==, 0);
+	g_assert_cmpint(stats.commands, ==, 1);
+	g_assert_cmpint(stats.bytes, ==, 16);
+	g_assert_cmpint(libusb_stream_manager_get_stream_stats(mgr, 3, &stats), ==, LIBUSB_ERROR_INVALID_PARAM);
+
+	libusb_stream_manager_close(mgr);
+	for (int i = 0; i < 4; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+}
+
+typedef struct {
+	int *completions;
+	/* 1-based place of the transfer among the completions, 0 until it
+	 * has completed */
+	int order;
+} TestCompletionOrder;
+
+static void LIBUSB_CALL
+transfer_cb_record_order(struct libusb_transfer *transfer)
+{
+	TestCompletionOrder *order = transfer->user_data;
+
+	order->order = ++*order->completions;
+}
+
+static void
+test_recover_stall(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	const unsigned char clear_halt[] = { 0x02, 0x01, 0x00, 0x00, 0x81, 0x00, 0x00, 0x00 };
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[2],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		}, {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		},
+		/* the second transfer is taken back once the first stalls */
+		{ .reap = TRUE, .status = -EPIPE, },
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[4],
+		  .type = USBDEVFS_URB_TYPE_CONTROL,
+		  .endpoint = 0,
+		  .buffer = clear_halt,
+		  .buffer_length = sizeof(clear_halt),
+		},
+		{ .reap = TRUE, .actual_length = 8, },
+		/* and both go out again in their original order */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[7],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		}, {
+		  .submit = TRUE,
+		  .reaps = &chat[8],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		},
+		{ .reap = TRUE, .actual_length = 32, },
+		{ .reap = TRUE, .actual_length = 32, },
+		{ .submit = FALSE, }
+	};
+	unsigned char data[2][32];
+	struct libusb_transfer *transfers[2];
+	int completions = 0;
+	TestCompletionOrder order[2] = {
+		{ .completions = &completions, },
+		{ .completions = &completions, },
+	};
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < 2; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN | 1,
+					  data[i], sizeof(data[i]),
+					  transfer_cb_record_order, &order[i], 1000);
+		transfers[i]->flags = LIBUSB_TRANSFER_RECOVER_STALL;
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	fixture->libusb_log_silence = TRUE;
+	for (int i = 0; i < 2; i++) {
+		while (!order[i].order)
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &order[i].order), ==, 0);
+	}
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	/* the stall never reached the callback, and the endpoint was only
+	 * reset once the second transfer was back */
+	g_assert_true(fixture->chat == &chat[9]);
+	g_assert_cmpuint(fixture->busy_endpoint_resets, ==, 0);
+	for (int i = 0; i < 2; i++) {
+		g_assert_cmpint(order[i].order, ==, i + 1);
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		g_assert_cmpint(transfers[i]->actual_length, ==, 32);
+		libusb_free_transfer(transfers[i]);
+	}
+
+	libusb_close(handle);
+}
+
+static void
+test_recover_stall_cancel(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	const unsigned char clear_halt[] = { 0x02, 0x01, 0x00, 0x00, 0x81, 0x00, 0x00, 0x00 };
+	unsigned char out[4] = { 0x01, 0x02, 0x03, 0x04 };
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		},
+		{ .reap = TRUE, .status = -EPIPE, },
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[4],
+		  .type = USBDEVFS_URB_TYPE_CONTROL,
+		  .endpoint = 0,
+		  .buffer = clear_halt,
+		  .buffer_length = sizeof(clear_halt),
+		},
+		/* the halt is only cleared once this has been submitted */
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[5],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer_length = sizeof(out),
+		},
+		{ .reap = TRUE, .actual_length = 8, },
+		{ .reap = TRUE, .actual_length = sizeof(out), },
+		{ .submit = FALSE, }
+	};
+	unsigned char data[32];
+	struct libusb_transfer *transfers[2];
+	int completed[2] = { 0 };
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfers[0] = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfers[0], handle, LIBUSB_ENDPOINT_IN | 1,
+				  data, sizeof(data), transfer_cb_inc_user_data, &completed[0], 1000);
+	transfers[0]->flags = LIBUSB_TRANSFER_RECOVER_STALL;
+	g_assert_cmpint(libusb_submit_transfer(transfers[0]), ==, 0);
+
+	fixture->libusb_log_silence = TRUE;
+	while (fixture->chat != &chat[3]) {
+		struct timeval tv = { 0, 10000 };
+
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &tv), ==, 0);
+	}
+
+	/* parked while the halt is being cleared */
+	g_assert_cmpint(completed[0], ==, 0);
+	g_assert_cmpint(libusb_cancel_transfer(transfers[0]), ==, 0);
+
+	transfers[1] = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfers[1], handle, LIBUSB_ENDPOINT_OUT | 2,
+				  out, sizeof(out), transfer_cb_inc_user_data, &completed[1], 1000);
+	g_assert_cmpint(libusb_submit_transfer(transfers[1]), ==, 0);
+
+	for (int i = 0; i < 2; i++) {
+		while (!completed[i])
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed[i]), ==, 0);
+	}
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	g_assert_true(fixture->chat == &chat[6]);
+	g_assert_cmpint(completed[0], ==, 1);
+	g_assert_cmpint(transfers[0]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+	g_assert_cmpint(completed[1], ==, 1);
+	g_assert_cmpint(transfers[1]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+
+	for (int i = 0; i < 2; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+}
+
+static void
+test_recover_stall_clear_fails(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	const unsigned char clear_halt[] = { 0x02, 0x01, 0x00, 0x00, 0x81, 0x00, 0x00, 0x00 };
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		},
+		{ .reap = TRUE, .status = -EPIPE, },
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_CONTROL,
+		  .endpoint = 0,
+		  .buffer = clear_halt,
+		  .buffer_length = sizeof(clear_halt),
+		},
+		/* the device refuses to clear the halt */
+		{ .reap = TRUE, .status = -EPIPE, },
+		{ .submit = FALSE, }
+	};
+	unsigned char data[32];
+	struct libusb_transfer *transfer;
+	int completed = 0;
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 1,
+				  data, sizeof(data), transfer_cb_inc_user_data, &completed, 1000);
+	transfer->flags = LIBUSB_TRANSFER_RECOVER_STALL;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+
+	fixture->libusb_log_silence = TRUE;
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	/* the transfer is not submitted again */
+	g_assert_true(fixture->chat == &chat[4]);
+	g_assert_cmpint(completed, ==, 1);
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_STALL);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+}
+
+static void
+test_recover_stall_close(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	const unsigned char clear_halt[] = { 0x02, 0x01, 0x00, 0x00, 0x81, 0x00, 0x00, 0x00 };
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		},
+		{ .reap = TRUE, .status = -EPIPE, },
+		/* the halt is never cleared */
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_CONTROL,
+		  .endpoint = 0,
+		  .buffer = clear_halt,
+		  .buffer_length = sizeof(clear_halt),
+		},
+		{ .submit = FALSE, }
+	};
+	unsigned char data[32];
+	struct libusb_transfer *transfer;
+	int completed = 0;
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, LIBUSB_ENDPOINT_IN | 1,
+				  data, sizeof(data), transfer_cb_inc_user_data, &completed, 1000);
+	transfer->flags = LIBUSB_TRANSFER_RECOVER_STALL;
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+
+	fixture->libusb_log_silence = TRUE;
+	while (fixture->chat != &chat[3]) {
+		struct timeval tv = { 0, 10000 };
+
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &tv), ==, 0);
+	}
+
+	/* closing drops the recovery, the parked transfer still completes */
+	libusb_close(handle);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	g_assert_cmpint(completed, ==, 1);
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_NO_DEVICE);
+	g_assert_null(transfer->dev_handle);
+
+	libusb_free_transfer(transfer);
+}
+
+static void
+test_submit_transfers(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[2],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		}, {
+		  .submit = TRUE,
+		  .reaps = &chat[3],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		},
+		{ .reap = TRUE, .actual_length = 32, },
+		{ .reap = TRUE, .actual_length = 32, },
+		{ .submit = FALSE, }
+	};
+	unsigned char data[2][32];
+	struct libusb_transfer *transfers[3];
+	int results[3];
+	int completed[2] = { 0 };
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < 2; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_IN | 1,
+					  data[i], sizeof(data[i]),
+					  transfer_cb_inc_user_data, &completed[i], 1000);
+	}
+	transfers[2] = NULL;
+	g_assert_cmpint(libusb_submit_transfers(transfers, 3, results), ==, LIBUSB_ERROR_INVALID_PARAM);
+	g_assert_true(fixture->chat == &chat[0]);
+
+	/* the same transfer twice in a batch is only submitted once */
+	transfers[2] = transfers[0];
+	g_assert_cmpint(libusb_submit_transfers(transfers, 3, results), ==, 2);
+	g_assert_cmpint(results[0], ==, 0);
+	g_assert_cmpint(results[1], ==, 0);
+	g_assert_cmpint(results[2], ==, LIBUSB_ERROR_BUSY);
+	g_assert_true(fixture->chat == &chat[2]);
+
+	fixture->libusb_log_silence = TRUE;
+	for (int i = 0; i < 2; i++) {
+		while (!completed[i])
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed[i]), ==, 0);
+	}
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	g_assert_true(fixture->chat == &chat[4]);
+	for (int i = 0; i < 2; i++) {
+		g_assert_cmpint(completed[i], ==, 1);
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		libusb_free_transfer(transfers[i]);
+	}
+
+	libusb_close(handle);
+}
+
+static void
+test_cancel_endpoint_transfers(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		}, {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN | 1,
+		  .buffer_length = 32,
+		}, {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer_length = 32,
+		},
+		{ .submit = FALSE, }
+	};
+	unsigned char data[3][32];
+	struct libusb_transfer *transfers[3];
+	int completed[3] = { 0 };
+	libusb_device_handle *handle = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	memset(data, 0, sizeof(data));
+	for (int i = 0; i < 3; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, i < 2 ? LIBUSB_ENDPOINT_IN | 1 : LIBUSB_ENDPOINT_OUT | 2,
+					  data[i], sizeof(data[i]),
+					  transfer_cb_inc_user_data, &completed[i], 1000);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+	g_assert_true(fixture->chat == &chat[3]);
+
+	/* only the endpoint's transfers are cancelled, and only once */
+	g_assert_cmpint(libusb_cancel_endpoint_transfers(handle, LIBUSB_ENDPOINT_IN | 1), ==, 2);
+	g_assert_cmpint(libusb_cancel_endpoint_transfers(handle, LIBUSB_ENDPOINT_IN | 1), ==, 0);
+
+	fixture->libusb_log_silence = TRUE;
+	for (int i = 0; i < 2; i++) {
+		while (!completed[i])
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed[i]), ==, 0);
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+	}
+	g_assert_cmpint(completed[2], ==, 0);
+
+	g_assert_cmpint(libusb_cancel_handle_transfers(handle), ==, 1);
+	while (!completed[2])
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed[2]), ==, 0);
+	g_assert_cmpint(transfers[2]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	for (int i = 0; i < 3; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+}
+
+static void
+test_sync_direct(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	struct libusb_init_option option = { .option = LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS };
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT | 2,
+		  .buffer_length = 1024,
+		}, {
+		  .reap = TRUE,
+		  .actual_length = 1024,
+		},
+		{ .submit = FALSE }
+	};
+	unsigned char status[2];
+	unsigned char data[1024] = { 0x01, 0x02, 0x03, 0x04 };
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	int transferred = 0;
+
+	g_assert_cmpint(libusb_init_context(&ctx, &option, 1), ==, 0);
+	handle = libusb_open_device_with_vid_pid(ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* There is no chat, submitting any URB would fail */
+	fixture->accept_direct_ioctls = TRUE;
+	g_assert_cmpint(libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_STATUS,
+						0, 0, status, sizeof(status), 1000), ==, 2);
+	g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT | 2, data, sizeof(data),
+					     &transferred, 0), ==, 0);
+	g_assert_cmpint(transferred, ==, sizeof(data));
+	g_assert_cmpint(fixture->direct_ioctls, ==, 2);
+
+	/* a transfer of a single packet moves nothing if it times out, so it
+	 * takes the direct path with its timeout */
+	transferred = 0;
+	g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT | 2, data, 4,
+					     &transferred, 1000), ==, 0);
+	g_assert_cmpint(transferred, ==, 4);
+	g_assert_cmpint(fixture->direct_ioctls, ==, 3);
+
+	/* a longer one that can time out must report partial data, which
+	 * only the asynchronous path does */
+	fixture->chat = chat;
+	transferred = 0;
+	g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT | 2, data, sizeof(data),
+					     &transferred, 1000), ==, 0);
+	g_assert_cmpint(transferred, ==, sizeof(data));
+	g_assert_true(fixture->chat == &chat[2]);
+	g_assert_cmpint(fixture->direct_ioctls, ==, 3);
+	fixture->accept_direct_ioctls = FALSE;
+
+	libusb_close(handle);
+	libusb_exit(ctx);
+}
+
+#define SYNC_LATENCY_ITERATIONS 1000
+
+static gdouble
+time_get_status(libusb_device_handle *handle)
+{
+	unsigned char status[2];
+	gint64 start = g_get_monotonic_time();
+
+	for (int i = 0; i < SYNC_LATENCY_ITERATIONS; i++)
+		g_assert_cmpint(libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_STATUS,
+							0, 0, status, sizeof(status), 1000), ==, 2);
+
+	return (gdouble) (g_get_monotonic_time() - start) / SYNC_LATENCY_ITERATIONS;
+}
+
+static void
+test_sync_direct_latency(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	struct libusb_init_option option = { .option = LIBUSB_OPTION_DIRECT_SYNC_TRANSFERS };
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	gdouble async_usec, direct_usec;
+	UsbChat *c;
+
+	if (!g_test_perf()) {
+		g_test_skip("Not running performance tests");
+		return;
+	}
+
+	c = fixture->chat = g_new0(UsbChat, 2 * SYNC_LATENCY_ITERATIONS + 1);
+	for (int i = 0; i < SYNC_LATENCY_ITERATIONS; i++)
+		fill_get_status_chat(&c[2*i]);
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+	fixture->libusb_log_silence = TRUE;
+	async_usec = time_get_status(handle);
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+	libusb_close(handle);
+
+	g_assert_cmpint(libusb_init_context(&ctx, &option, 1), ==, 0);
+	handle = libusb_open_device_with_vid_pid(ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+	fixture->accept_direct_ioctls = TRUE;
+	direct_usec = time_get_status(handle);
+	fixture->accept_direct_ioctls = FALSE;
+	libusb_close(handle);
+	libusb_exit(ctx);
+
+	g_test_minimized_result(async_usec, "asynchronous path: %.1f us per control transfer", async_usec);
+	g_test_minimized_result(direct_usec, "direct ioctl: %.1f us per control transfer", direct_usec);
+
+	g_free(c);
+}
+
+static const int timeout_scaling_in_flight[] = { 64, 512, 4096 };
+
+/* Submit n bulk transfers with distinct, increasing timeouts and cancel them
+ * all again. Returns the time spent per transfer in microseconds. */
+static gdouble
+time_flying_transfers(UMockdevTestbedFixture * fixture, libusb_device_handle *handle, int n)
+{
+	unsigned char data[4] = { 0x01, 0x02, 0x03, 0x04 };
+	struct libusb_transfer **transfers = g_new0(struct libusb_transfer *, n);
+	UsbChat *c = fixture->chat = g_new0(UsbChat, n + 1);
+	int completed = 0;
+	gint64 start;
+
+	for (int i = 0; i < n; i++) {
+		c[i].submit = TRUE;
+		c[i].type = USBDEVFS_URB_TYPE_BULK;
+		c[i].endpoint = LIBUSB_ENDPOINT_OUT | 2;
+		c[i].buffer_length = sizeof(data);
+
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_OUT | 2,
+					  data, sizeof(data), transfer_cb_inc_user_data,
+					  &completed, 60000 + (unsigned int) i);
+	}
+
+	start = g_get_monotonic_time();
+	for (int i = 0; i < n; i++)
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	for (int i = 0; i < n; i++)
+		g_assert_cmpint(libusb_cancel_transfer(transfers[i]), ==, 0);
+	while (completed < n)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	start = g_get_monotonic_time() - start;
+
+	for (int i = 0; i < n; i++) {
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+		libusb_free_transfer(transfers[i]);
+	}
+	g_free(transfers);
+	g_free(c);
+	fixture->chat = NULL;
+
+	return (gdouble) start / n;
+}
+
+static void
+test_timeout_scaling(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	libusb_device_handle *handle = NULL;
+
+	if (!g_test_perf()) {
+		g_test_skip("Not running performance tests");
+		return;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	fixture->libusb_log_silence = TRUE;
+	for (guint i = 0; i < G_N_ELEMENTS(timeout_scaling_in_flight); i++) {
+		int n = timeout_scaling_in_flight[i];
+		gdouble usec = time_flying_transfers(fixture, handle, n);
+
+		g_test_minimized_result(usec, "%d in flight: %.1f us per submit/cancel", n, usec);
+	}
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	libusb_close(handle);
+}
+
+#define REAP_BUDGET_URBS 2048
+
+static guint
+count_libusb_log_msgs(UMockdevTestbedFixture * fixture, const char *re)
+{
+	guint count = 0;
+
+	g_assert(pthread_mutex_lock(&fixture->mutex) == 0);
+	for (GList *l = fixture->libusb_log; l; l = l->next) {
+		LogMessage *msg = l->data;
+
+		if (g_regex_match_simple(re, msg->str, 0, 0))
+			count++;
+	}
+	pthread_mutex_unlock(&fixture->mutex);
+
+	return count;
+}
+
+/* Queue up REAP_BUDGET_URBS completions on one device and count the event
+ * handling rounds needed to reap them with the given maximum reap budget */
+static void
+time_reap(UMockdevTestbedFixture * fixture, int max_budget, guint *rounds, guint *exhausted, gdouble *usec)
+{
+	unsigned char data[4] = { 0x01, 0x02, 0x03, 0x04 };
+	struct libusb_transfer *transfers[REAP_BUDGET_URBS];
+	struct libusb_device_handle_stats stats;
+	libusb_device_handle *handle = NULL;
+	UsbChat *c = fixture->chat = g_new0(UsbChat, REAP_BUDGET_URBS + 1);
+	int completed = 0;
+	gint64 start;
+
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_REAP_BUDGET, max_budget), ==, 0);
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < REAP_BUDGET_URBS; i++) {
+		c[i].submit = TRUE;
+		c[i].type = USBDEVFS_URB_TYPE_BULK;
+		c[i].endpoint = LIBUSB_ENDPOINT_OUT | 2;
+		c[i].buffer_length = sizeof(data);
+
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_OUT | 2,
+					  data, sizeof(data), transfer_cb_inc_user_data,
+					  &completed, 0);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	/* every discarded URB is ready to be reaped */
+	for (int i = 0; i < REAP_BUDGET_URBS; i++)
+		g_assert_cmpint(libusb_cancel_transfer(transfers[i]), ==, 0);
+
+	*rounds = 0;
+	start = g_get_monotonic_time();
+	while (completed < REAP_BUDGET_URBS) {
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+		*rounds += 1;
+	}
+	*usec = (gdouble) (g_get_monotonic_time() - start);
+	libusb_get_device_handle_stats(handle, &stats);
+	*exhausted = (guint) stats.reap_budget_exhausted;
+	g_assert_cmpint(*exhausted, ==, count_libusb_log_msgs(fixture, "reap budget of [0-9]+ exhausted"));
+
+	for (int i = 0; i < REAP_BUDGET_URBS; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	g_free(c);
+	fixture->chat = NULL;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+}
+
+static void
+test_reap_budget(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	guint rounds, exhausted;
+	gdouble usec;
+
+	if (!g_test_perf()) {
+		g_test_skip("Not running performance tests");
+		return;
+	}
+
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_REAP_BUDGET, -1), ==,
+			LIBUSB_ERROR_INVALID_PARAM);
+
+	fixture->libusb_log_silence = TRUE;
+
+	/* a budget below the adaptive minimum stays fixed, like the former
+	 * limit of 26 URBs per device and round */
+	time_reap(fixture, 26, &rounds, &exhausted, &usec);
+	g_test_minimized_result(rounds, "fixed budget of 26: %u rounds, exhausted %u times, %.0f us",
+				rounds, exhausted, usec);
+
+	time_reap(fixture, 0, &rounds, &exhausted, &usec);
+	g_test_minimized_result(rounds, "adaptive budget: %u rounds, exhausted %u times, %.0f us",
+				rounds, exhausted, usec);
+
+	fixture->libusb_log_silence = FALSE;
+}
+
+#define REAP_FAIRNESS_BUSY_URBS 1024
+#define REAP_FAIRNESS_LIGHT_URBS 64
+
+typedef struct {
+	libusb_device_handle *light;
+	int busy_completed;
+	int light_completed;
+	/* completions in a row from one device while both had some left */
+	libusb_device_handle *last;
+	int run;
+	int longest_run;
+} TestReapFairness;
+
+static void LIBUSB_CALL
+transfer_cb_reap_fairness(struct libusb_transfer *transfer)
+{
+	TestReapFairness *data = transfer->user_data;
+
+	if (data->light_completed < REAP_FAIRNESS_LIGHT_URBS) {
+		data->run = transfer->dev_handle == data->last ? data->run + 1 : 1;
+		data->longest_run = MAX(data->longest_run, data->run);
+		data->last = transfer->dev_handle;
+	}
+
+	if (transfer->dev_handle == data->light)
+		data->light_completed++;
+	else
+		data->busy_completed++;
+}
+
+static void
+submit_and_cancel_bulk(libusb_device_handle *handle, struct libusb_transfer **transfers, int n,
+		       unsigned char *data, TestReapFairness *fairness)
+{
+	for (int i = 0; i < n; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_OUT | 2,
+					  data, 4, transfer_cb_reap_fairness, fairness, 0);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+	for (int i = 0; i < n; i++)
+		g_assert_cmpint(libusb_cancel_transfer(transfers[i]), ==, 0);
+}
+
+/* One device has many more completions to reap than another. The busy
+ * device must not delay the other one, no matter how far its adaptive reap
+ * budget grows. */
+static void
+test_reap_fairness(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	unsigned char data[4] = { 0x01, 0x02, 0x03, 0x04 };
+	struct libusb_transfer *busy_transfers[REAP_FAIRNESS_BUSY_URBS];
+	struct libusb_transfer *light_transfers[REAP_FAIRNESS_LIGHT_URBS];
+	const int n = REAP_FAIRNESS_BUSY_URBS + REAP_FAIRNESS_LIGHT_URBS;
+	UsbChat *c = fixture->chat = g_new0(UsbChat, n + 1);
+	TestReapFairness fairness = { 0 };
+	libusb_device_handle *busy = NULL;
+	libusb_device **devs = NULL;
+
+	for (int i = 0; i < n; i++) {
+		c[i].submit = TRUE;
+		c[i].type = USBDEVFS_URB_TYPE_BULK;
+		c[i].endpoint = LIBUSB_ENDPOINT_OUT | 2;
+		c[i].buffer_length = sizeof(data);
+	}
+
+	g_assert_cmpint(libusb_get_device_list(fixture->ctx, &devs), ==, 2);
+	g_assert_cmpint(libusb_open(devs[0], &busy), ==, 0);
+	g_assert_cmpint(libusb_open(devs[1], &fairness.light), ==, 0);
+	libusb_free_device_list(devs, TRUE);
+
+	fixture->libusb_log_silence = TRUE;
+
+	/* every discarded URB is ready to be reaped */
+	submit_and_cancel_bulk(busy, busy_transfers, REAP_FAIRNESS_BUSY_URBS, data, &fairness);
+	submit_and_cancel_bulk(fairness.light, light_transfers, REAP_FAIRNESS_LIGHT_URBS, data, &fairness);
+
+	/* both devices are served in the first round already */
+	g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	g_assert_cmpint(fairness.busy_completed, >, 0);
+	g_assert_cmpint(fairness.light_completed, >, 0);
+
+	while (fairness.busy_completed + fairness.light_completed < n)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+
+	/* a device is served at most 16 URBs per turn, and its last turn of
+	 * one round may be followed by its first turn of the next one */
+	g_assert_cmpint(fairness.longest_run, <=, 32);
+
+	fixture->libusb_log_silence = FALSE;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	for (int i = 0; i < REAP_FAIRNESS_BUSY_URBS; i++)
+		libusb_free_transfer(busy_transfers[i]);
+	for (int i = 0; i < REAP_FAIRNESS_LIGHT_URBS; i++)
+		libusb_free_transfer(light_transfers[i]);
+	libusb_close(busy);
+	libusb_close(fairness.light);
+	g_free(c);
+	fixture->chat = NULL;
+}
+
+#define REAP_MIX_LIGHT_URBS 4
+#define REAP_MIX_BUSY_URBS 256
+#define REAP_MIX_ROUNDS 64
+
+typedef struct {
+	libusb_device_handle *busy;
+	gboolean stopping;
+	int busy_in_flight;
+	guint busy_completed;
+	int light_completed;
+} TestReapMix;
+
+/* The busy device streams: each of its transfers is submitted again and
+ * discarded right away, so that it always has completions ready */
+static void LIBUSB_CALL
+transfer_cb_reap_mix(struct libusb_transfer *transfer)
+{
+	TestReapMix *mix = transfer->user_data;
+
+	if (transfer->dev_handle != mix->busy) {
+		mix->light_completed++;
+		return;
+	}
+
+	mix->busy_completed++;
+	if (mix->stopping) {
+		mix->busy_in_flight--;
+		return;
+	}
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+	g_assert_cmpint(libusb_cancel_transfer(transfer), ==, 0);
+}
+
+/* One device saturates a bulk endpoint while several others each have a
+ * few interrupt completions. Runs REAP_MIX_ROUNDS rounds of event handling
+ * and reports the completions of the busy device, the round in which the
+ * last interrupt completion was reaped, and how often the busy device ran
+ * out of reap budget. */
+static void
+time_reap_mix(UMockdevTestbedFixture * fixture, int max_budget, guint *busy_completed,
+	      guint *light_rounds, guint *exhausted, gdouble *usec)
+{
+	const int n_light = REAP_MIX_LIGHT_DEVICES * REAP_MIX_LIGHT_URBS;
+	unsigned char data[8] = { 0 };
+	struct libusb_transfer *busy_transfers[REAP_MIX_BUSY_URBS];
+	struct libusb_transfer *light_transfers[REAP_MIX_LIGHT_DEVICES * REAP_MIX_LIGHT_URBS];
+	libusb_device_handle *light[REAP_MIX_LIGHT_DEVICES];
+	struct libusb_device_handle_stats stats;
+	UsbChat *c = fixture->chat = g_new0(UsbChat, n_light + 1);
+	TestReapMix mix = { 0 };
+	libusb_device **devs = NULL;
+	gint64 start;
+
+	/* the interrupt transfers are submitted first, the bulk ones as often
+	 * as they like */
+	for (int i = 0; i < n_light; i++) {
+		c[i].submit = TRUE;
+		c[i].type = USBDEVFS_URB_TYPE_INTERRUPT;
+		c[i].endpoint = LIBUSB_ENDPOINT_IN | 3;
+		c[i].buffer_length = sizeof(data);
+	}
+	c[n_light].submit = TRUE;
+	c[n_light].next = &c[n_light];
+	c[n_light].type = USBDEVFS_URB_TYPE_BULK;
+	c[n_light].endpoint = LIBUSB_ENDPOINT_OUT | 2;
+	c[n_light].buffer_length = sizeof(data);
+
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_REAP_BUDGET, max_budget), ==, 0);
+	g_assert_cmpint(libusb_get_device_list(fixture->ctx, &devs), ==, REAP_MIX_LIGHT_DEVICES + 1);
+	g_assert_cmpint(libusb_open(devs[0], &mix.busy), ==, 0);
+	for (int i = 0; i < REAP_MIX_LIGHT_DEVICES; i++)
+		g_assert_cmpint(libusb_open(devs[i + 1], &light[i]), ==, 0);
+	libusb_free_device_list(devs, TRUE);
+
+	/* every discarded URB is ready to be reaped */
+	for (int i = 0; i < n_light; i++) {
+		light_transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_interrupt_transfer(light_transfers[i], light[i % REAP_MIX_LIGHT_DEVICES],
+					       LIBUSB_ENDPOINT_IN | 3, data, sizeof(data),
+					       transfer_cb_reap_mix, &mix, 0);
+		g_assert_cmpint(libusb_submit_transfer(light_transfers[i]), ==, 0);
+		g_assert_cmpint(libusb_cancel_transfer(light_transfers[i]), ==, 0);
+	}
+	for (int i = 0; i < REAP_MIX_BUSY_URBS; i++) {
+		busy_transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(busy_transfers[i], mix.busy, LIBUSB_ENDPOINT_OUT | 2,
+					  data, sizeof(data), transfer_cb_reap_mix, &mix, 0);
+		g_assert_cmpint(libusb_submit_transfer(busy_transfers[i]), ==, 0);
+		g_assert_cmpint(libusb_cancel_transfer(busy_transfers[i]), ==, 0);
+	}
+	mix.busy_in_flight = REAP_MIX_BUSY_URBS;
+
+	*light_rounds = 0;
+	start = g_get_monotonic_time();
+	for (guint round = 1; round <= REAP_MIX_ROUNDS; round++) {
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+		if (!*light_rounds && mix.light_completed == n_light)
+			*light_rounds = round;
+	}
+	*usec = (gdouble) (g_get_monotonic_time() - start);
+	*busy_completed = mix.busy_completed;
+	g_assert_cmpint(mix.light_completed, ==, n_light);
+
+	libusb_get_device_handle_stats(mix.busy, &stats);
+	*exhausted = (guint) stats.reap_budget_exhausted;
+	for (int i = 0; i < REAP_MIX_LIGHT_DEVICES; i++) {
+		libusb_get_device_handle_stats(light[i], &stats);
+		g_assert_cmpuint(stats.reap_budget_exhausted, ==, 0);
+	}
+
+	mix.stopping = TRUE;
+	while (mix.busy_in_flight)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+
+	for (int i = 0; i < REAP_MIX_BUSY_URBS; i++)
+		libusb_free_transfer(busy_transfers[i]);
+	for (int i = 0; i < n_light; i++)
+		libusb_free_transfer(light_transfers[i]);
+	libusb_close(mix.busy);
+	for (int i = 0; i < REAP_MIX_LIGHT_DEVICES; i++)
+		libusb_close(light[i]);
+	g_free(c);
+	fixture->chat = NULL;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+}
+
+/* A saturating bulk stream next to many low-rate interrupt devices: the
+ * adaptive budget lets the stream move more data per round, without the
+ * interrupt completions waiting any longer for it */
+static void
+test_reap_budget_mix(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	guint busy_completed, light_rounds, exhausted;
+	gdouble usec;
+
+	if (!g_test_perf()) {
+		g_test_skip("Not running performance tests");
+		return;
+	}
+
+	fixture->libusb_log_silence = TRUE;
+
+	time_reap_mix(fixture, 26, &busy_completed, &light_rounds, &exhausted, &usec);
+	g_test_maximized_result(busy_completed,
+				"fixed budget of 26: %u bulk completions in %d rounds, interrupts done in round %u, exhausted %u times, %.0f us",
+				busy_completed, REAP_MIX_ROUNDS, light_rounds, exhausted, usec);
+	g_assert_cmpuint(light_rounds, ==, 1);
+
+	time_reap_mix(fixture, 0, &busy_completed, &light_rounds, &exhausted, &usec);
+	g_test_maximized_result(busy_completed,
+				"adaptive budget: %u bulk completions in %d rounds, interrupts done in round %u, exhausted %u times, %.0f us",
+				busy_completed, REAP_MIX_ROUNDS, light_rounds, exhausted, usec);
+	g_assert_cmpuint(light_rounds, ==, 1);
+
+	fixture->libusb_log_silence = FALSE;
+}
+
+#define COMPLETION_BURST_THREADS 4
+
+static const int completion_burst_transfers[] = { 64, 512, 4096 };
+
+typedef struct {
+	struct libusb_transfer **transfers;
+	int n;
+} TestCompletionBurst;
+
+static gpointer
+cancel_all(TestCompletionBurst *data)
+{
+	for (int i = 0; i < data->n; i++)
+		g_assert_cmpint(libusb_cancel_transfer(data->transfers[i]), ==, 0);
+
+	return NULL;
+}
+
+/* Hold n - 1 bulk transfers behind a transfer memory budget that only lets
+ * one of them out, and cancel the held ones from several threads while the
+ * main thread handles the events. Every one of them completes through the
+ * completion queue of the context without reaching the device. Returns the
+ * time spent per completion in microseconds and the number of event handler
+ * wakeups this took. */
+static gdouble
+time_completion_burst(UMockdevTestbedFixture * fixture, libusb_device_handle *handle, int n,
+		      guint *wakeups)
+{
+	unsigned char data[4] = { 0x01, 0x02, 0x03, 0x04 };
+	struct libusb_transfer **transfers = g_new0(struct libusb_transfer *, n);
+	TestCompletionBurst bursts[COMPLETION_BURST_THREADS];
+	GThread *threads[COMPLETION_BURST_THREADS];
+	UsbChat *c = fixture->chat = g_new0(UsbChat, 2);
+	int per_thread = (n - 1) / COMPLETION_BURST_THREADS;
+	int completed = 0;
+	gint64 start;
+
+	c[0].submit = TRUE;
+	c[0].type = USBDEVFS_URB_TYPE_BULK;
+	c[0].endpoint = LIBUSB_ENDPOINT_OUT | 2;
+	c[0].buffer_length = sizeof(data);
+
+	for (int i = 0; i < n; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, LIBUSB_ENDPOINT_OUT | 2,
+					  data, sizeof(data), transfer_cb_inc_user_data,
+					  &completed, 0);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+	g_assert_true(fixture->chat == &c[1]);
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	start = g_get_monotonic_time();
+	for (int t = 0; t < COMPLETION_BURST_THREADS; t++) {
+		bursts[t].transfers = &transfers[1 + t * per_thread];
+		bursts[t].n = t < COMPLETION_BURST_THREADS - 1 ? per_thread :
+			      n - 1 - t * per_thread;
+		threads[t] = g_thread_new("cancel held", (GThreadFunc) cancel_all, &bursts[t]);
+	}
+	while (completed < n - 1)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+	start = g_get_monotonic_time() - start;
+	for (int t = 0; t < COMPLETION_BURST_THREADS; t++)
+		g_thread_join(threads[t]);
+	*wakeups = count_libusb_log_msgs(fixture, "event triggered");
+
+	g_assert_cmpint(libusb_cancel_transfer(transfers[0]), ==, 0);
+	while (completed < n)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+
+	for (int i = 0; i < n; i++) {
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+		libusb_free_transfer(transfers[i]);
+	}
+	g_free(transfers);
+	g_free(c);
+	fixture->chat = NULL;
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+
+	return (gdouble) start / (n - 1);
+}
+
+static void
+test_completion_burst(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	libusb_device_handle *handle = NULL;
+
+	if (!g_test_perf()) {
+		g_test_skip("Not running performance tests");
+		return;
+	}
+
+	g_assert_cmpint(libusb_set_option(fixture->ctx, LIBUSB_OPTION_TRANSFER_MEM_BUDGET, 4), ==, 0);
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	fixture->libusb_log_silence = TRUE;
+	for (guint i = 0; i < G_N_ELEMENTS(completion_burst_transfers); i++) {
+		int n = completion_burst_transfers[i];
+		guint wakeups;
+		gdouble usec = time_completion_burst(fixture, handle, n, &wakeups);
+
+		g_test_minimized_result(usec, "%d completions: %.2f us each, %u wakeups",
+					n - 1, usec, wakeups);
+	}
+	fixture->libusb_log_silence = FALSE;
+
+	libusb_close(handle);
+}
+
+#define THREADED_SUBMIT_URB_SETS 64
+#define THREADED_SUBMIT_URB_IN_FLIGHT 64
+typedef struct {
+	struct libusb_transfer *transfers[THREADED_SUBMIT_URB_IN_FLIGHT * THREADED_SUBMIT_URB_SETS];
+	int submitted;
+	int completed;
+	int done;
+	UMockdevTestbedFixture *fixture;
+} TestThreadedSubmit;
+
+static gpointer
+transfer_submit_all_retry(TestThreadedSubmit *data)
+{
+	for (guint i = 0; i < G_N_ELEMENTS(data->transfers); i++) {
+		while (libusb_submit_transfer(data->transfers[i]) < 0) {
+			assert_libusb_log_msg(data->fixture, LIBUSB_LOG_LEVEL_ERROR, "submit_bulk_transfer");
+			continue;
+		}
+
+		data->submitted += 1;
+	}
+
+	return NULL;
+}
+
+static void LIBUSB_CALL
+test_threaded_submit_transfer_cb(struct libusb_transfer *transfer)
+{
+	TestThreadedSubmit *data = transfer->user_data;
+
+	/* We should only be receiving packets in the main thread */
+	g_assert_cmpint (getpid(), ==, gettid());
+
+	/* Check that the transfer buffer has the expected value */
+	g_assert_cmpint (*(int*)transfer->buffer, ==, data->completed);
+	data->completed += 1;
+
+	if (data->completed == G_N_ELEMENTS(data->transfers))
+		data->done = TRUE;
+}
+
+static void
+test_threaded_submit(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	GThread *thread = NULL;
+	TestThreadedSubmit data = { .fixture = fixture };
+	UsbChat out_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = sizeof(int),
+	};
+	UsbChat in_msg = {
+		  .reap = TRUE,
+		  .actual_length = 4,
+	};
+	UsbChat *c;
+	libusb_device_handle *handle = NULL;
+	int urb;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	fixture->libusb_log_silence = TRUE;
+
+	c = fixture->chat = g_new0(UsbChat, G_N_ELEMENTS(data.transfers) * 2 + 1);
+	urb = 0;
+	for (int i = 0; i < THREADED_SUBMIT_URB_SETS; i++) {
+		for (int j = 0; j < THREADED_SUBMIT_URB_IN_FLIGHT; j++) {
+			c[i*2*THREADED_SUBMIT_URB_IN_FLIGHT + j] = out_msg;
+			c[i*2*THREADED_SUBMIT_URB_IN_FLIGHT + j].reaps = &c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j];
+			c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j] = in_msg;
+			c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j].buffer = (unsigned char*) g_new0(int, 1);
+			*(int*) c[(i*2+1)*THREADED_SUBMIT_URB_IN_FLIGHT + j].buffer = urb;
+
+			data.transfers[urb] = libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(data.transfers[urb],
+						  handle,
+						  LIBUSB_ENDPOINT_IN,
+						  g_malloc(out_msg.buffer_length),
+						  out_msg.buffer_length,
+						  test_threaded_submit_transfer_cb,
+						  &data,
+						  G_MAXUINT);
+			data.transfers[urb]->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+			urb++;
+		}
+	}
+
+	thread = g_thread_new("transfer all", (GThreadFunc) transfer_submit_all_retry, &data);
+
+	while (!data.done)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &data.done), ==, 0);
+
+	g_thread_join(thread);
+
+	fixture->libusb_log_silence = FALSE;
+	libusb_close(handle);
+
+	for (int i = 0; i < 2 * THREADED_SUBMIT_URB_SETS * THREADED_SUBMIT_URB_SETS; i++)
+		g_clear_pointer ((void**) &c->buffer, g_free);
+	g_free (c);
+}
+
+static int LIBUSB_CALL
+hotplug_count_arrival_cb(libusb_context *ctx,
+                         libusb_device  *device,
+                         libusb_hotplug_event event,
+                         void *user_data)
+{
+	g_assert_cmpint(event, ==, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+
+	(void) ctx;
+	(void) device;
+
+	*(int*) user_data += 1;
+
+	return 0;
+}
+
+#ifdef UMOCKDEV_HOTPLUG
+static int LIBUSB_CALL
+hotplug_count_removal_cb(libusb_context *ctx,
+                         libusb_device  *device,
+                         libusb_hotplug_event event,
+                         void *user_data)
+{
+	g_assert_cmpint(event, ==, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+
+	(void) ctx;
+	(void) device;
+
+	*(int*) user_data += 1;
+
+	return 0;
+}
+#endif
+
+static void
+test_hotplug_enumerate(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	libusb_hotplug_callback_handle handle_enumerate;
+	libusb_hotplug_callback_handle handle_no_enumerate;
+	int event_count_enumerate = 0;
+	int event_count_no_enumerate = 0;
+	struct timeval zero_tv = { 0 };
+	int r;
+
+	r = libusb_hotplug_register_callback(fixture->ctx,
+	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+	                                     LIBUSB_HOTPLUG_ENUMERATE,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     hotplug_count_arrival_cb,
+	                                     &event_count_enumerate,
+	                                     &handle_enumerate);
+	g_assert_cmpint(r, ==, 0);
+
+	r = libusb_hotplug_register_callback(fixture->ctx,
+	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+	                                     0,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     hotplug_count_arrival_cb,
+	                                     &event_count_no_enumerate,
+	                                     &handle_no_enumerate);
+	g_assert_cmpint(r, ==, 0);
+
+	g_assert_cmpint(event_count_enumerate, ==, 1);
+	g_assert_cmpint(event_count_no_enumerate, ==, 0);
+
+	libusb_handle_events_timeout(fixture->ctx, &zero_tv);
+
+	g_assert_cmpint(event_count_enumerate, ==, 1);
+	g_assert_cmpint(event_count_no_enumerate, ==, 0);
+
+	libusb_hotplug_deregister_callback(fixture->ctx, handle_enumerate);
+	libusb_hotplug_deregister_callback(fixture->ctx, handle_no_enumerate);
+
+	libusb_handle_events_timeout(fixture->ctx, &zero_tv);
+
+	g_assert_cmpint(event_count_enumerate, ==, 1);
+	g_assert_cmpint(event_count_no_enumerate, ==, 0);
+}
+
+static void
+test_hotplug_add_remove(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+#ifdef UMOCKDEV_HOTPLUG
+	libusb_device **devs = NULL;
+	libusb_hotplug_callback_handle handle_add;
+	libusb_hotplug_callback_handle handle_remove;
+	int event_count_add = 0;
+	int event_count_remove = 0;
+	struct timeval zero_tv = { 0 };
+	int r;
+
+	r = libusb_hotplug_register_callback(fixture->ctx,
+	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+	                                     LIBUSB_HOTPLUG_ENUMERATE,
 	                                     LIBUSB_HOTPLUG_MATCH_ANY,
 	                                     LIBUSB_HOTPLUG_MATCH_ANY,
 	                                     LIBUSB_HOTPLUG_MATCH_ANY,
@@ -1078,7 +3449,7 @@ test_hotplug_add_remove(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 	g_assert_cmpint(event_count_remove, ==, 0);
 
 	/* Add a device */
-	test_fixture_add_canon(fixture);
+	test_fixture_add_canon(fixture, 1);
 
 	/* Either the thread has picked it up already, or we do so now. */
 	g_assert_cmpint(libusb_get_device_list(fixture->ctx, &devs), ==, 1);
@@ -1156,6 +3527,131 @@ main(int argc, char **argv)
 	           test_timeout,
 	           test_fixture_teardown);
 
+	g_test_add("/libusb/sync-no-alloc", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_sync_no_alloc,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/iso-no-alloc", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_iso_no_alloc,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/iso-start-frame", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_iso_start_frame,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/buffer-pool", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_buffer_pool,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/stream-in", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_stream_in,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/stream-out", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_stream_out,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/auto-resubmit", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_auto_resubmit,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/bulk-iovec", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_bulk_iovec,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/iso-ring", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_iso_ring,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/transfer-mem-budget", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_transfer_mem_budget,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/completion-queue", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_completion_queue,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/stream-manager", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_stream_manager,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/recover-stall", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_recover_stall,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/recover-stall-cancel", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_recover_stall_cancel,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/recover-stall-clear-fails", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_recover_stall_clear_fails,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/recover-stall-close", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_recover_stall_close,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/submit-transfers", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_submit_transfers,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/cancel-endpoint-transfers", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_cancel_endpoint_transfers,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/sync-direct", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_sync_direct,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/sync-direct-latency", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_sync_direct_latency,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/timeout-scaling", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_timeout_scaling,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/reap-budget", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_reap_budget,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/reap-fairness", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_two_canons,
+	           test_reap_fairness,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/reap-budget-mix", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_reap_mix,
+	           test_reap_budget_mix,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/completion-burst", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_completion_burst,
+	           test_fixture_teardown);
+
 	g_test_add("/libusb/threaded-submit", UMockdevTestbedFixture, NULL,
 	           test_fixture_setup_with_canon,
 	           test_threaded_submit,